@@ -0,0 +1,387 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+// Process-wide metrics in the Prometheus text format, shared by the servers of this repository.
+// Recording is a relaxed atomic add on a cache line owned by the calling thread, a few
+// nanoseconds with no contention; reading sums the slots and only happens when scraped.
+
+#define METRICS_SHARDS 32            // Slots per metric, threads take them in turn (power of two)
+#define METRICS_SUB_BITS 2           // Histogram sub-buckets per power of two: 4, within 19% of a value
+#define METRICS_BUCKETS (64 << METRICS_SUB_BITS)
+#define METRICS_EXPORT_MIN_OCTAVE 7  // Exported bucket bounds 2^7 .. 2^36 units: 128 ns .. 69 s for nanoseconds
+#define METRICS_EXPORT_MAX_OCTAVE 36
+#define METRICS_PORT 9100            // Side port of servers without an HTTP handler of their own
+#define METRICS_SCRAPE_TIMEOUT_MS 2000 // Whole exchange with one scraper, request and response
+#define METRICS_ACCEPT_BACKOFF_MS 100  // Pause after a failed accept, out of descriptors say
+
+// Slot of the calling thread. Threads get consecutive slots, so with one event loop per core
+// every core updates its own cache line; past METRICS_SHARDS threads slots are shared, which
+// only costs contention since updates are atomic.
+inline size_t metrics_shard() {
+    static std::atomic<size_t> next{0};
+    thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) & (METRICS_SHARDS - 1);
+    return shard;
+}
+
+// Monotonic clock for latency measurements, a vDSO call
+inline uint64_t metrics_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// Monotonically increasing count
+class Counter {
+public:
+    void inc(uint64_t n = 1) {
+        slots_[metrics_shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t sum = 0;
+        for (const Slot& slot : slots_) {
+            sum += slot.value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> value{0};
+    };
+    Slot slots_[METRICS_SHARDS];
+};
+
+// Current level of something that goes up and down (open connections, blocks in use).
+// Each thread adds its own changes to its slot, the level is their sum.
+class Gauge {
+public:
+    void add(int64_t n) {
+        slots_[metrics_shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t value() const {
+        int64_t sum = 0;
+        for (const Slot& slot : slots_) {
+            sum += slot.value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<int64_t> value{0};
+    };
+    Slot slots_[METRICS_SHARDS];
+};
+
+// Log-linear histogram of non-negative integers (nanoseconds, bytes): METRICS_SUB_BITS linear
+// sub-buckets per power of two, so a bucket is found with one count-leading-zeros and no search
+class Histogram {
+public:
+    struct Snapshot {
+        std::vector<uint64_t> counts = std::vector<uint64_t>(METRICS_BUCKETS);
+        uint64_t count = 0;
+        uint64_t sum = 0;
+
+        // Upper bound of the bucket holding the p-th percentile, 0 <= p <= 100
+        uint64_t percentile(double p) const {
+            uint64_t rank = static_cast<uint64_t>(p / 100.0 * count);
+            uint64_t seen = 0;
+            for (int i = 0; i < METRICS_BUCKETS; ++i) {
+                seen += counts[i];
+                if (seen > rank) {
+                    return upper_bound(i);
+                }
+            }
+            return 0;
+        }
+
+        // Values below 2^octave; octaves fall on bucket edges, so this is exact
+        uint64_t count_below_octave(int octave) const {
+            uint64_t below = 0;
+            for (int i = 0; i < index(uint64_t(1) << octave); ++i) {
+                below += counts[i];
+            }
+            return below;
+        }
+    };
+
+    Histogram() : shards_(new Shard[METRICS_SHARDS]()) {}
+
+    void record(uint64_t value) {
+        Shard& shard = shards_[metrics_shard()];
+        shard.counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    Snapshot snapshot() const {
+        Snapshot snap;
+        for (int s = 0; s < METRICS_SHARDS; ++s) {
+            for (int i = 0; i < METRICS_BUCKETS; ++i) {
+                uint64_t n = shards_[s].counts[i].load(std::memory_order_relaxed);
+                snap.counts[i] += n;
+                snap.count += n;
+            }
+            snap.sum += shards_[s].sum.load(std::memory_order_relaxed);
+        }
+        return snap;
+    }
+
+    static int index(uint64_t value) {
+        if (value < (1u << METRICS_SUB_BITS)) {
+            return static_cast<int>(value);
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int sub = static_cast<int>((value >> (msb - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1));
+        return ((msb - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) | sub;
+    }
+
+    // Exclusive upper bound of a bucket
+    static uint64_t upper_bound(int idx) {
+        if (idx < (1 << METRICS_SUB_BITS)) {
+            return idx + 1;
+        }
+        int msb = (idx >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+        uint64_t sub = idx & ((1 << METRICS_SUB_BITS) - 1);
+        uint64_t bound = (uint64_t(1) << METRICS_SUB_BITS | sub) + 1;
+        int shift = msb - METRICS_SUB_BITS;
+        return bound << shift >> shift == bound ? bound << shift : UINT64_MAX;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counts[METRICS_BUCKETS];
+        std::atomic<uint64_t> sum{0};
+    };
+    std::unique_ptr<Shard[]> shards_;
+};
+
+// Named metrics and their exposition. Register at startup and keep the returned reference:
+// lookups take a lock, recording doesn't. Labels are given preformatted, e.g. code="200".
+class MetricsRegistry {
+public:
+    Counter& counter(const std::string& name, const std::string& help, const std::string& labels = "") {
+        Series& series = find(name, help, "counter", labels);
+        if (!series.counter) {
+            series.counter.reset(new Counter);
+        }
+        return *series.counter;
+    }
+
+    Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels = "") {
+        Series& series = find(name, help, "gauge", labels);
+        if (!series.gauge) {
+            series.gauge.reset(new Gauge);
+        }
+        return *series.gauge;
+    }
+
+    // A gauge read when scraped, for levels another structure already tracks
+    void gauge_callback(const std::string& name, const std::string& help, std::function<double()> read,
+                        const std::string& labels = "") {
+        find(name, help, "gauge", labels).callback = std::move(read);
+    }
+
+    // unit converts recorded values to the exported base unit, nanoseconds to seconds by default
+    Histogram& histogram(const std::string& name, const std::string& help, const std::string& labels = "",
+                         double unit = 1e-9) {
+        Series& series = find(name, help, "histogram", labels);
+        if (!series.histogram) {
+            series.histogram.reset(new Histogram);
+            series.unit = unit;
+        }
+        return *series.histogram;
+    }
+
+    // Text exposition format 0.0.4. Histograms are exported at power-of-two bounds.
+    std::string render() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::string out;
+        char line[128];
+        for (const auto& [name, family] : families_) {
+            out += "# HELP " + name + " " + family.help + "\n";
+            out += "# TYPE " + name + " " + family.type + "\n";
+            for (const Series& series : family.series) {
+                if (series.counter) {
+                    append_sample(out, name, "", series.labels, "", std::to_string(series.counter->value()));
+                } else if (series.gauge) {
+                    append_sample(out, name, "", series.labels, "", std::to_string(series.gauge->value()));
+                } else if (series.callback) {
+                    snprintf(line, sizeof(line), "%.12g", series.callback());
+                    append_sample(out, name, "", series.labels, "", line);
+                } else if (series.histogram) {
+                    Histogram::Snapshot snap = series.histogram->snapshot();
+                    for (int octave = METRICS_EXPORT_MIN_OCTAVE; octave <= METRICS_EXPORT_MAX_OCTAVE; ++octave) {
+                        snprintf(line, sizeof(line), "le=\"%.6g\"", static_cast<double>(uint64_t(1) << octave) * series.unit);
+                        append_sample(out, name, "_bucket", series.labels, line,
+                                      std::to_string(snap.count_below_octave(octave)));
+                    }
+                    append_sample(out, name, "_bucket", series.labels, "le=\"+Inf\"", std::to_string(snap.count));
+                    snprintf(line, sizeof(line), "%.12g", static_cast<double>(snap.sum) * series.unit);
+                    append_sample(out, name, "_sum", series.labels, "", line);
+                    append_sample(out, name, "_count", series.labels, "", std::to_string(snap.count));
+                }
+            }
+        }
+        return out;
+    }
+
+private:
+    struct Series {
+        std::string labels;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+        std::function<double()> callback;
+        double unit = 1;
+    };
+
+    struct Family {
+        std::string help;
+        const char* type;
+        std::vector<Series> series;
+    };
+
+    Series& find(const std::string& name, const std::string& help, const char* type, const std::string& labels) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        Family& family = families_[name];
+        if (family.series.empty()) {
+            family.help = help;
+            family.type = type;
+        }
+        for (Series& series : family.series) {
+            if (series.labels == labels) {
+                return series;
+            }
+        }
+        family.series.emplace_back();
+        family.series.back().labels = labels;
+        return family.series.back();
+    }
+
+    static void append_sample(std::string& out, const std::string& name, const char* suffix,
+                              const std::string& labels, const char* extra_label, const std::string& value) {
+        out += name;
+        out += suffix;
+        if (!labels.empty() || *extra_label) {
+            out += '{';
+            out += labels;
+            if (!labels.empty() && *extra_label) {
+                out += ',';
+            }
+            out += extra_label;
+            out += '}';
+        }
+        out += ' ';
+        out += value;
+        out += '\n';
+    }
+
+    mutable std::mutex mtx_;
+    std::map<std::string, Family> families_;
+};
+
+// The registry every metric of the process lives in
+inline MetricsRegistry& metrics() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+// Serve the registry over HTTP on a side port from a background thread, for servers that have
+// no HTTP handler of their own: any request gets the exposition and the connection is closed.
+// Scrapes come every few seconds at most, so one thread is plenty; each exchange gets a fixed
+// deadline so a slow or stalled scraper can't hold it for longer.
+inline bool start_metrics_server(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("metrics socket");
+        return false;
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 16) < 0) {
+        perror("metrics bind");
+        close(fd);
+        return false;
+    }
+
+    std::thread([fd] {
+        while (true) {
+            int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                if (errno != EINTR && errno != ECONNABORTED) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(METRICS_ACCEPT_BACKOFF_MS));
+                }
+                continue;
+            }
+            // Wait until the socket is ready, or false once the deadline has passed
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(METRICS_SCRAPE_TIMEOUT_MS);
+            auto ready = [client, deadline](short events) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                struct pollfd pfd = {client, events, 0};
+                return left.count() > 0 && poll(&pfd, 1, static_cast<int>(left.count())) > 0;
+            };
+
+            // Read the request head
+            char request[4096];
+            size_t received = 0;
+            while (received < sizeof(request) && ready(POLLIN)) {
+                ssize_t n = recv(client, request + received, sizeof(request) - received, MSG_DONTWAIT);
+                if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                received += n;
+                if (memmem(request, received, "\r\n\r\n", 4)) {
+                    break;
+                }
+            }
+
+            std::string body = metrics().render();
+            std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                                   std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            for (size_t sent = 0; sent < response.size() && ready(POLLOUT); ) {
+                ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                sent += n;
+            }
+            close(client);
+        }
+    }).detach();
+    return true;
+}
+
+#endif // METRICS_H
@@ -0,0 +1,179 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+#define ADMISSION_SHARDS 16
+
+// Limits applied before any work is done for a client. Zero disables a limit.
+struct AdmissionConfig {
+    int backlog = 4096;                  // listen() backlog of every reactor's socket
+    size_t max_connections = 10000;      // open connections across all reactors
+    size_t max_connections_per_ip = 512; // concurrent connections from one address
+    double requests_per_second_per_ip = 0; // token refill rate per address
+    double request_burst_per_ip = 100;     // token bucket depth
+    std::chrono::microseconds queue_target{5000};    // CoDel target sojourn time
+    std::chrono::microseconds queue_interval{100000}; // CoDel interval
+};
+
+enum class Admission {
+    Accepted,
+    TooManyConnections, // server-wide cap, 503
+    TooManyFromClient,  // per-address cap or rate, 429
+};
+
+// Connection and request admission shared by all reactors: a global connection count and,
+// per client address, a connection count and a request token bucket. Addresses live in
+// mutex-protected shards like FileCache, so reactors rarely contend.
+class AdmissionController {
+public:
+    explicit AdmissionController(const AdmissionConfig& config) : config_(config) {}
+
+    const AdmissionConfig& config() const {
+        return config_;
+    }
+
+    void configure(const AdmissionConfig& config) {
+        config_ = config;
+    }
+
+    // Call for every accepted socket; on Accepted, release_connection() must follow its close
+    Admission admit_connection(uint32_t ip) {
+        size_t open = connections_.fetch_add(1, std::memory_order_relaxed);
+        if (config_.max_connections && open >= config_.max_connections) {
+            connections_.fetch_sub(1, std::memory_order_relaxed);
+            return Admission::TooManyConnections;
+        }
+        Shard& shard = shard_for(ip);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        Client& client = shard.clients[ip];
+        if (config_.max_connections_per_ip && client.connections >= config_.max_connections_per_ip) {
+            connections_.fetch_sub(1, std::memory_order_relaxed);
+            return Admission::TooManyFromClient;
+        }
+        ++client.connections;
+        return Admission::Accepted;
+    }
+
+    void release_connection(uint32_t ip) {
+        connections_.fetch_sub(1, std::memory_order_relaxed);
+        Shard& shard = shard_for(ip);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto it = shard.clients.find(ip);
+        if (it != shard.clients.end() && it->second.connections > 0) {
+            --it->second.connections;
+        }
+    }
+
+    // Take one token from the address's bucket, false when it is empty
+    bool admit_request(uint32_t ip, std::chrono::steady_clock::time_point now) {
+        if (config_.requests_per_second_per_ip <= 0) {
+            return true;
+        }
+        Shard& shard = shard_for(ip);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        Client& client = shard.clients[ip];
+        refill(client, now);
+        if (client.tokens < 1) {
+            return false;
+        }
+        client.tokens -= 1;
+        return true;
+    }
+
+    // Forget addresses with no connections and a full bucket, so the table tracks active clients only
+    void sweep(std::chrono::steady_clock::time_point now) {
+        for (Shard& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            for (auto it = shard.clients.begin(); it != shard.clients.end(); ) {
+                refill(it->second, now);
+                bool full = config_.requests_per_second_per_ip <= 0 || it->second.tokens >= config_.request_burst_per_ip;
+                it = it->second.connections == 0 && full ? shard.clients.erase(it) : std::next(it);
+            }
+        }
+    }
+
+    size_t connections() const {
+        return connections_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Client {
+        size_t connections = 0;
+        double tokens = -1; // -1: bucket not used yet, starts full
+        std::chrono::steady_clock::time_point last_refill;
+    };
+
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_map<uint32_t, Client> clients;
+    };
+
+    void refill(Client& client, std::chrono::steady_clock::time_point now) {
+        if (client.tokens < 0) {
+            client.tokens = config_.request_burst_per_ip;
+        } else {
+            double elapsed = std::chrono::duration<double>(now - client.last_refill).count();
+            client.tokens = std::min(config_.request_burst_per_ip,
+                                     client.tokens + elapsed * config_.requests_per_second_per_ip);
+        }
+        client.last_refill = now;
+    }
+
+    Shard& shard_for(uint32_t ip) {
+        return shards_[(ip * 2654435761u) >> 28 & (ADMISSION_SHARDS - 1)];
+    }
+
+    AdmissionConfig config_;
+    std::atomic<size_t> connections_{0};
+    Shard shards_[ADMISSION_SHARDS];
+};
+
+// CoDel-style overload detector for one reactor (Nichols & Jacobson). The sojourn time of a
+// request is how long it waited in the event loop since epoll_wait returned its connection.
+// A queue that stays above the target for a whole interval is a standing queue: from then on
+// requests that waited longer than the target are shed with a cheap 503 instead of being
+// served late, until one gets through below the target again. Short bursts are absorbed.
+class QueueDelayMonitor {
+public:
+    QueueDelayMonitor(std::chrono::microseconds target, std::chrono::microseconds interval)
+        : target_(target), interval_(interval) {}
+
+    bool should_shed(std::chrono::steady_clock::duration sojourn, std::chrono::steady_clock::time_point now) {
+        if (target_.count() <= 0 || sojourn < target_) {
+            above_since_ = {};
+            dropping_ = false;
+            return false;
+        }
+        if (above_since_ == std::chrono::steady_clock::time_point{}) {
+            above_since_ = now;
+            return false;
+        }
+        if (!dropping_ && now - above_since_ >= interval_) {
+            dropping_ = true;
+        }
+        if (dropping_) {
+            ++shed_;
+        }
+        return dropping_;
+    }
+
+    uint64_t shed() const {
+        return shed_;
+    }
+
+private:
+    std::chrono::microseconds target_;
+    std::chrono::microseconds interval_;
+    std::chrono::steady_clock::time_point above_since_{};
+    bool dropping_ = false;
+    uint64_t shed_ = 0;
+};
+
+#endif // ADMISSION_H
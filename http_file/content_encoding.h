@@ -0,0 +1,151 @@
+#ifndef CONTENT_ENCODING_H
+#define CONTENT_ENCODING_H
+
+#include <string>
+#include <string_view>
+#include <cstdlib>
+#include <strings.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#define GZIP_LEVEL 6    // On-the-fly levels favour speed; precompressed siblings can use the maximum
+#define BROTLI_QUALITY 5
+
+// Content codings the server can produce, in order of preference when the client rates them equally
+enum ContentEncoding {
+    ENCODING_BR,
+    ENCODING_GZIP,
+    ENCODING_COUNT,
+    ENCODING_IDENTITY = -1,
+};
+
+inline const char* encoding_name(int encoding) {
+    return encoding == ENCODING_BR ? "br" : "gzip";
+}
+
+// Suffix of a precompressed sibling file, e.g. app.js.br next to app.js
+inline const char* encoding_suffix(int encoding) {
+    return encoding == ENCODING_BR ? ".br" : ".gz";
+}
+
+inline bool encoding_supported(int encoding) {
+#ifdef HAVE_BROTLI
+    return encoding == ENCODING_BR || encoding == ENCODING_GZIP;
+#else
+    return encoding == ENCODING_GZIP;
+#endif
+}
+
+// Text-like types worth compressing; images and video are already compressed
+inline bool is_compressible(std::string_view mime_type) {
+    return mime_type.compare(0, 5, "text/") == 0 || mime_type == "application/javascript" ||
+           mime_type == "application/json" || mime_type == "application/xml" || mime_type == "image/svg+xml";
+}
+
+// Pick the content coding for an Accept-Encoding header (RFC 7231 section 5.3.4): the supported
+// coding with the highest q-value, "*" covering codings not listed. Returns ENCODING_IDENTITY
+// when nothing acceptable beats sending the bytes as they are.
+inline int negotiate_encoding(std::string_view accept_encoding) {
+    int q[ENCODING_COUNT] = {-1, -1}; // -1: not mentioned
+    int wildcard = -1;
+    while (!accept_encoding.empty()) {
+        size_t comma = std::min(accept_encoding.find(','), accept_encoding.size());
+        std::string_view item = accept_encoding.substr(0, comma);
+        accept_encoding.remove_prefix(std::min(comma + 1, accept_encoding.size()));
+
+        size_t semicolon = std::min(item.find(';'), item.size());
+        std::string_view coding = item.substr(0, semicolon);
+        while (!coding.empty() && (coding.front() == ' ' || coding.front() == '\t')) {
+            coding.remove_prefix(1);
+        }
+        while (!coding.empty() && (coding.back() == ' ' || coding.back() == '\t')) {
+            coding.remove_suffix(1);
+        }
+
+        // q-value in thousandths, 1000 when absent
+        int qvalue = 1000;
+        size_t q_pos = item.find("q=", semicolon);
+        if (q_pos != std::string_view::npos) {
+            std::string_view value = item.substr(q_pos + 2);
+            qvalue = 0;
+            int scale = 1000;
+            bool fraction = false;
+            for (char c : value) {
+                if (c == '.') {
+                    fraction = true;
+                } else if (c >= '0' && c <= '9') {
+                    if (!fraction) {
+                        qvalue = (c - '0') * 1000;
+                    } else if (scale > 1) {
+                        scale /= 10;
+                        qvalue += (c - '0') * scale;
+                    }
+                } else {
+                    break;
+                }
+            }
+        }
+
+        if (coding.size() == 2 && strncasecmp(coding.data(), "br", 2) == 0) {
+            q[ENCODING_BR] = qvalue;
+        } else if ((coding.size() == 4 && strncasecmp(coding.data(), "gzip", 4) == 0) ||
+                   (coding.size() == 6 && strncasecmp(coding.data(), "x-gzip", 6) == 0)) {
+            q[ENCODING_GZIP] = qvalue;
+        } else if (coding == "*") {
+            wildcard = qvalue;
+        }
+    }
+
+    int best = ENCODING_IDENTITY;
+    int best_q = 0;
+    for (int encoding = 0; encoding < ENCODING_COUNT; ++encoding) {
+        int qvalue = q[encoding] >= 0 ? q[encoding] : wildcard;
+        if (encoding_supported(encoding) && qvalue > best_q) {
+            best = encoding;
+            best_q = qvalue;
+        }
+    }
+    return best;
+}
+
+// Compress data with the given coding, false if the encoder failed
+inline bool compress_body(int encoding, const std::string& data, std::string& out) {
+#ifdef HAVE_BROTLI
+    if (encoding == ENCODING_BR) {
+        size_t size = BrotliEncoderMaxCompressedSize(data.size());
+        if (size == 0) {
+            return false;
+        }
+        out.resize(size);
+        if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.size(),
+                                   reinterpret_cast<const uint8_t*>(data.data()), &size,
+                                   reinterpret_cast<uint8_t*>(&out[0]))) {
+            return false;
+        }
+        out.resize(size);
+        return true;
+    }
+#endif
+    if (encoding != ENCODING_GZIP) {
+        return false;
+    }
+
+    z_stream zs{};
+    // windowBits 15 + 16 selects the gzip wrapper instead of zlib's
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    out.resize(deflateBound(&zs, data.size()));
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in = data.size();
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = out.size();
+    int rc = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END;
+}
+
+#endif // CONTENT_ENCODING_H
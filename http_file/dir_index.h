@@ -0,0 +1,241 @@
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "output_queue.h"
+
+// Escape text for HTML element content and attribute values
+inline std::string html_escape(const std::string& text) {
+    std::string out;
+    out.reserve(text.size());
+    for (char c : text) {
+        switch (c) {
+            case '&': out += "&amp;"; break;
+            case '<': out += "&lt;"; break;
+            case '>': out += "&gt;"; break;
+            case '"': out += "&quot;"; break;
+            case '\'': out += "&#39;"; break;
+            default: out += c;
+        }
+    }
+    return out;
+}
+
+// Percent-encode a file name for use as a URL path segment
+inline std::string url_encode_segment(const std::string& name) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string out;
+    for (unsigned char c : name) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            out += c;
+        } else {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+    }
+    return out;
+}
+
+// HTML listing of one directory, kept up to date from inotify events instead of being
+// rebuilt on every request. A change to a single entry is applied incrementally (one lstat);
+// only a change to the directory itself or an inotify overflow triggers a full rescan.
+// Pages are rendered lazily from an immutable snapshot and reused until the next change.
+class DirectoryIndex {
+public:
+    struct Page {
+        std::shared_ptr<const std::string> body;
+        std::string_view etag; // kept alive by body
+        size_t number = 1; // 1-based
+        size_t count = 1;
+    };
+
+    DirectoryIndex(std::string dir, std::string url_prefix, size_t page_size)
+        : dir_(std::move(dir)), url_prefix_(std::move(url_prefix)), page_size_(page_size),
+          instance_(std::to_string(std::chrono::system_clock::now().time_since_epoch().count() & 0xffffffff)) {}
+
+    // ResourceWatcher callback
+    void on_change(const std::string& path, bool is_dir) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (path == dir_ || (is_dir && dir_.compare(0, path.size() + 1, path + "/") == 0)) {
+            needs_rescan_ = true;
+            ++version_;
+            return;
+        }
+        size_t slash = path.find_last_of('/');
+        if (slash == std::string::npos || path.compare(0, slash, dir_) != 0 || slash != dir_.size()) {
+            return; // not an immediate child
+        }
+        // Content changes of existing files fire events too; only membership changes bump the version
+        std::string name = path.substr(slash + 1);
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0) {
+            if (entries_.emplace(name, render_entry(name)).second) {
+                ++version_;
+            }
+        } else if (entries_.erase(name)) {
+            ++version_;
+        }
+    }
+
+    // The complete listing in one response, generated piece by piece from the current snapshot
+    // as the connection drains instead of being rendered up front
+    struct Listing {
+        std::shared_ptr<BodySource> body;
+        std::string etag;
+    };
+
+    Listing listing() {
+        std::shared_ptr<Snapshot> snapshot = current_snapshot();
+        Listing listing;
+        listing.etag = "\"dir-" + instance_ + "-" + std::to_string(snapshot->version) + "-all\"";
+        listing.body = std::make_shared<ListingSource>(std::move(snapshot));
+        return listing;
+    }
+
+    // Page number is clamped to the available pages
+    Page page(size_t number) {
+        std::shared_ptr<Snapshot> snapshot = current_snapshot();
+        Page page;
+        page.count = std::max<size_t>(1, (snapshot->lines.size() + page_size_ - 1) / page_size_);
+        page.number = std::min(std::max<size_t>(1, number), page.count);
+
+        std::lock_guard<std::mutex> lock(snapshot->pages_mtx);
+        auto& cached = snapshot->pages[page.number];
+        if (!cached) {
+            cached = render_page(*snapshot, page.number, page.count);
+        }
+        // Aliasing pointer: shares ownership of the rendered page, points at its body
+        page.body = std::shared_ptr<const std::string>(cached, &cached->body);
+        page.etag = cached->etag;
+        return page;
+    }
+
+private:
+    struct RenderedPage {
+        std::string body;
+        std::string etag;
+    };
+
+    struct Snapshot {
+        uint64_t version = 0;
+        std::vector<std::string> lines; // rendered <li> elements in name order
+        std::mutex pages_mtx;
+        std::map<size_t, std::shared_ptr<const RenderedPage>> pages;
+    };
+
+    class ListingSource : public BodySource {
+    public:
+        explicit ListingSource(std::shared_ptr<Snapshot> snapshot) : snapshot_(std::move(snapshot)) {}
+
+        bool next(std::string& out, size_t max_bytes) override {
+            size_t start = out.size();
+            if (next_line_ == 0) {
+                out += "<html><body><h1>Resources Directory</h1><ul>";
+                if (snapshot_->lines.empty()) {
+                    out += "<li>No files found</li>";
+                }
+            }
+            const std::vector<std::string>& lines = snapshot_->lines;
+            while (next_line_ < lines.size() && out.size() - start < max_bytes) {
+                out += lines[next_line_++];
+            }
+            if (next_line_ < lines.size()) {
+                return true;
+            }
+            out += "</ul></body></html>";
+            return false;
+        }
+
+    private:
+        std::shared_ptr<Snapshot> snapshot_; // pinned: later changes don't affect a listing in flight
+        size_t next_line_ = 0;
+    };
+
+    std::string render_entry(const std::string& name) const {
+        return "<li><a href=\"" + url_prefix_ + url_encode_segment(name) + "\">" + html_escape(name) + "</a></li>";
+    }
+
+    void rescan() {
+        entries_.clear();
+        DIR* dir = opendir(dir_.c_str());
+        if (!dir) {
+            return;
+        }
+        while (struct dirent* ent = readdir(dir)) {
+            if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+                entries_[ent->d_name] = render_entry(ent->d_name);
+            }
+        }
+        closedir(dir);
+    }
+
+    std::shared_ptr<Snapshot> current_snapshot() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (needs_rescan_) {
+            rescan();
+            needs_rescan_ = false;
+        }
+        if (!snapshot_ || snapshot_->version != version_) {
+            auto snapshot = std::make_shared<Snapshot>();
+            snapshot->version = version_;
+            snapshot->lines.reserve(entries_.size());
+            for (const auto& entry : entries_) {
+                snapshot->lines.push_back(entry.second);
+            }
+            snapshot_ = snapshot;
+        }
+        return snapshot_;
+    }
+
+    std::shared_ptr<const RenderedPage> render_page(const Snapshot& snapshot, size_t number, size_t count) const {
+        auto page = std::make_shared<RenderedPage>();
+        page->etag = "\"dir-" + instance_ + "-" + std::to_string(snapshot.version) + "-" + std::to_string(number) + "\"";
+        std::string* body = &page->body;
+        *body = "<html><body><h1>Resources Directory</h1><ul>";
+        size_t begin = (number - 1) * page_size_;
+        size_t end = std::min(snapshot.lines.size(), begin + page_size_);
+        for (size_t i = begin; i < end; ++i) {
+            *body += snapshot.lines[i];
+        }
+        if (snapshot.lines.empty()) {
+            *body += "<li>No files found</li>";
+        }
+        *body += "</ul>";
+        if (count > 1) {
+            *body += "<p>Page " + std::to_string(number) + " of " + std::to_string(count);
+            if (number > 1) {
+                *body += " <a href=\"" + url_prefix_ + "?page=" + std::to_string(number - 1) + "\">Previous</a>";
+            }
+            if (number < count) {
+                *body += " <a href=\"" + url_prefix_ + "?page=" + std::to_string(number + 1) + "\">Next</a>";
+            }
+            *body += "</p>";
+        }
+        *body += "</body></html>";
+        return page;
+    }
+
+    std::string dir_;
+    std::string url_prefix_;
+    size_t page_size_;
+    std::string instance_; // distinguishes ETags across server restarts
+
+    std::mutex mtx_;
+    std::map<std::string, std::string> entries_; // name -> rendered <li>
+    bool needs_rescan_ = true;
+    uint64_t version_ = 1;
+    std::shared_ptr<Snapshot> snapshot_;
+};
+
+#endif // DIR_INDEX_H
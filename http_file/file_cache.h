@@ -0,0 +1,186 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <ctime>
+
+#include "content_encoding.h"
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_TOMBSTONES 256 // Invalidated paths remembered per shard to turn away stale inserts
+
+// One cached representation of a file (its bytes as stored, or a content-coded copy) together
+// with every header line it is served with, preformatted once when the entry is built
+struct CachedRepresentation {
+    std::shared_ptr<const std::string> body; // nullptr: representation not available
+    std::string etag;
+    std::string validators;    // ETag and Last-Modified lines
+    std::string extra_headers; // Content-Encoding / Vary / Cache-Control lines
+    std::string headers;       // all header lines of a 200 response, minus Connection
+
+    size_t charge() const {
+        return (body ? body->size() : 0) + etag.size() + validators.size() + extra_headers.size() + headers.size();
+    }
+};
+
+// An immutable cached file: everything needed to answer without touching the disk
+struct CacheEntry {
+    std::string mime_type;
+    uint64_t size = 0;
+    time_t mtime = 0;
+    CachedRepresentation identity;
+
+    // Content-coded copies indexed by ContentEncoding, added lazily. encoded_known marks
+    // codings already tried, so a file that doesn't shrink isn't recompressed.
+    CachedRepresentation encoded[ENCODING_COUNT];
+    bool encoded_known[ENCODING_COUNT] = {};
+
+    size_t charge() const {
+        size_t total = identity.charge() + mime_type.size() + sizeof(CacheEntry);
+        for (const CachedRepresentation& representation : encoded) {
+            total += representation.charge();
+        }
+        return total;
+    }
+};
+
+// Bounded in-memory cache keyed by path, split into shards so reactor threads rarely contend.
+// Each shard evicts in LRU order once its share of the memory cap is exceeded. Entries are
+// shared_ptr so a response still being written keeps its bytes alive after eviction.
+class FileCache {
+public:
+    FileCache(size_t capacity, size_t max_entry_size)
+        : shard_capacity_(capacity / FILE_CACHE_SHARDS), max_entry_size_(max_entry_size) {}
+
+    // Files larger than this are never cached and go through sendfile instead
+    size_t max_entry_size() const {
+        return shard_capacity_ ? max_entry_size_ : 0;
+    }
+
+    void disable() {
+        shard_capacity_ = 0;
+    }
+
+    std::shared_ptr<const CacheEntry> lookup(const std::string& path) {
+        Shard& shard = shard_for(path);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto it = shard.index.find(path);
+        if (it == shard.index.end()) {
+            return nullptr;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        return it->second->second;
+    }
+
+    // Bumped by every invalidation. Read it before loading a file and pass it to insert():
+    // if that file (or a directory above it) changed while it was being read, the stale copy
+    // is not cached. Changes elsewhere don't matter, so a file that is written continuously,
+    // a log or an upload in progress, doesn't keep every other file out of the cache.
+    uint64_t generation() const {
+        return generation_.load(std::memory_order_acquire);
+    }
+
+    void insert(const std::string& path, std::shared_ptr<const CacheEntry> entry, uint64_t generation) {
+        size_t charge = entry->charge();
+        Shard& shard = shard_for(path);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        if (charge > shard_capacity_ || stale(shard, path, generation)) {
+            return;
+        }
+        auto it = shard.index.find(path);
+        if (it != shard.index.end()) {
+            erase(shard, it->second);
+        }
+        while (shard.bytes + charge > shard_capacity_ && !shard.lru.empty()) {
+            erase(shard, std::prev(shard.lru.end()));
+        }
+        shard.lru.emplace_front(path, std::move(entry));
+        shard.index[path] = shard.lru.begin();
+        shard.bytes += charge;
+    }
+
+    // Drop path and, if it names a directory, everything below it
+    void invalidate(const std::string& path, bool is_dir) {
+        uint64_t generation = generation_.fetch_add(1, std::memory_order_acq_rel) + 1;
+        if (!is_dir) {
+            Shard& shard = shard_for(path);
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            remember_invalidated(shard, path, generation);
+            auto it = shard.index.find(path);
+            if (it != shard.index.end()) {
+                erase(shard, it->second);
+            }
+            return;
+        }
+        std::string prefix = path + "/";
+        // Directories change rarely: everything being loaded anywhere is turned away
+        for (Shard& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            shard.stale_before = generation;
+            shard.invalidated.clear();
+            for (auto it = shard.lru.begin(); it != shard.lru.end(); ) {
+                auto next = std::next(it);
+                if (it->first == path || it->first.compare(0, prefix.size(), prefix) == 0) {
+                    erase(shard, it);
+                }
+                it = next;
+            }
+        }
+    }
+
+private:
+    using Lru = std::list<std::pair<std::string, std::shared_ptr<const CacheEntry>>>;
+
+    struct Shard {
+        std::mutex mtx;
+        Lru lru; // most recently used first
+        std::unordered_map<std::string, Lru::iterator> index;
+        // Generation at which each recently invalidated path was dropped; loads started
+        // before stale_before are turned away whatever their path
+        std::unordered_map<std::string, uint64_t> invalidated;
+        uint64_t stale_before = 0;
+        size_t bytes = 0;
+    };
+
+    Shard& shard_for(const std::string& path) {
+        return shards_[std::hash<std::string>()(path) % FILE_CACHE_SHARDS];
+    }
+
+    // Whether a copy of key loaded at generation may predate a change to it
+    static bool stale(const Shard& shard, const std::string& key, uint64_t generation) {
+        if (generation < shard.stale_before) {
+            return true;
+        }
+        auto it = shard.invalidated.find(key);
+        return it != shard.invalidated.end() && generation < it->second;
+    }
+
+    static void remember_invalidated(Shard& shard, const std::string& key, uint64_t generation) {
+        if (shard.invalidated.size() >= FILE_CACHE_TOMBSTONES && shard.invalidated.find(key) == shard.invalidated.end()) {
+            // Too many to remember one by one: forget them for one shard-wide cutoff
+            shard.stale_before = generation;
+            shard.invalidated.clear();
+            return;
+        }
+        shard.invalidated[key] = generation;
+    }
+
+    void erase(Shard& shard, Lru::iterator it) {
+        shard.bytes -= it->second->charge();
+        shard.index.erase(it->first);
+        shard.lru.erase(it);
+    }
+
+    Shard shards_[FILE_CACHE_SHARDS];
+    size_t shard_capacity_;
+    size_t max_entry_size_;
+    std::atomic<uint64_t> generation_{0};
+};
+
+#endif // FILE_CACHE_H
@@ -0,0 +1,497 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+// HPACK header compression (RFC 7541): a decoder for request header blocks and an encoder
+// for response headers, each with its own dynamic table as the two directions are independent.
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096 // SETTINGS_HEADER_TABLE_SIZE until the peer says otherwise
+#define HPACK_ENTRY_OVERHEAD 32       // Per-entry accounting overhead from RFC 7541 section 4.1
+#define HPACK_STATIC_TABLE_SIZE 61
+
+struct HpackHeader {
+    std::string name;
+    std::string value;
+};
+
+struct HpackStaticEntry {
+    std::string_view name;
+    std::string_view value;
+};
+
+// RFC 7541 Appendix A, index 1 first
+constexpr HpackStaticEntry HPACK_STATIC_TABLE[HPACK_STATIC_TABLE_SIZE] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+struct HpackHuffmanCode {
+    uint32_t code;
+    uint8_t bits;
+};
+
+// RFC 7541 Appendix B, indexed by byte value; EOS (30 ones) is never emitted
+constexpr HpackHuffmanCode HPACK_HUFFMAN_CODES[256] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+};
+
+// Binary decoding tree of the Huffman code, built once on first use. Leaves hold byte + 1.
+struct HpackHuffmanTree {
+    struct Node {
+        int16_t child[2] = {-1, -1};
+        int16_t symbol = 0;
+    };
+    std::vector<Node> nodes;
+
+    HpackHuffmanTree() {
+        nodes.emplace_back();
+        for (int symbol = 0; symbol < 256; ++symbol) {
+            const HpackHuffmanCode& code = HPACK_HUFFMAN_CODES[symbol];
+            int node = 0;
+            for (int bit = code.bits - 1; bit >= 0; --bit) {
+                int b = (code.code >> bit) & 1;
+                if (nodes[node].child[b] < 0) {
+                    nodes[node].child[b] = static_cast<int16_t>(nodes.size());
+                    nodes.emplace_back();
+                }
+                node = nodes[node].child[b];
+            }
+            nodes[node].symbol = static_cast<int16_t>(symbol + 1);
+        }
+    }
+
+    static const HpackHuffmanTree& instance() {
+        static const HpackHuffmanTree tree;
+        return tree;
+    }
+};
+
+// Decode a Huffman-coded string; false on an invalid code, EOS, or padding that is longer
+// than 7 bits or not all ones (RFC 7541 section 5.2)
+inline bool hpack_huffman_decode(const uint8_t* data, size_t len, std::string& out) {
+    const HpackHuffmanTree& tree = HpackHuffmanTree::instance();
+    int node = 0;
+    int pad_bits = 0;
+    bool pad_ones = true;
+    for (size_t i = 0; i < len; ++i) {
+        for (int bit = 7; bit >= 0; --bit) {
+            int b = (data[i] >> bit) & 1;
+            node = tree.nodes[node].child[b];
+            if (node < 0) {
+                return false; // only EOS lives off the tree
+            }
+            ++pad_bits;
+            pad_ones = pad_ones && b;
+            if (tree.nodes[node].symbol) {
+                out += static_cast<char>(tree.nodes[node].symbol - 1);
+                node = 0;
+                pad_bits = 0;
+                pad_ones = true;
+            }
+        }
+    }
+    return pad_bits <= 7 && pad_ones;
+}
+
+inline size_t hpack_huffman_length(std::string_view s) {
+    size_t bits = 0;
+    for (char c : s) {
+        bits += HPACK_HUFFMAN_CODES[static_cast<unsigned char>(c)].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+inline void hpack_huffman_encode(std::string_view s, std::string& out) {
+    uint64_t acc = 0;
+    int bits = 0;
+    for (char c : s) {
+        const HpackHuffmanCode& code = HPACK_HUFFMAN_CODES[static_cast<unsigned char>(c)];
+        acc = (acc << code.bits) | code.code;
+        bits += code.bits;
+        while (bits >= 8) {
+            bits -= 8;
+            out += static_cast<char>(acc >> bits);
+        }
+    }
+    if (bits > 0) {
+        // Pad with the most significant bits of EOS, i.e. ones
+        out += static_cast<char>((acc << (8 - bits)) | (0xff >> bits));
+    }
+}
+
+// Prefix-coded integer (RFC 7541 section 5.1); first_byte carries the representation's flag bits
+inline void hpack_encode_integer(std::string& out, uint8_t first_byte, int prefix_bits, uint64_t value) {
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if (value < max_prefix) {
+        out += static_cast<char>(first_byte | value);
+        return;
+    }
+    out += static_cast<char>(first_byte | max_prefix);
+    value -= max_prefix;
+    while (value >= 128) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+inline bool hpack_decode_integer(const uint8_t*& p, const uint8_t* end, int prefix_bits, uint64_t& value) {
+    if (p == end) {
+        return false;
+    }
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    value = *p++ & max_prefix;
+    if (value < max_prefix) {
+        return true;
+    }
+    for (int shift = 0; p < end && shift <= 28; shift += 7) {
+        uint8_t b = *p++;
+        value += static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false; // truncated, or too large to be a sane length or index
+}
+
+// Dynamic table shared by the encoder and decoder logic: newest entry first, so HPACK
+// index 62 is entries[0]
+class HpackDynamicTable {
+public:
+    size_t max_size() const {
+        return max_size_;
+    }
+
+    void set_max_size(size_t size) {
+        max_size_ = size;
+        evict(0);
+    }
+
+    size_t count() const {
+        return entries_.size();
+    }
+
+    const HpackHeader& operator[](size_t i) const {
+        return entries_[i];
+    }
+
+    void add(std::string_view name, std::string_view value) {
+        size_t size = name.size() + value.size() + HPACK_ENTRY_OVERHEAD;
+        evict(size);
+        if (size > max_size_) {
+            return; // an entry larger than the table just empties it
+        }
+        entries_.push_front({std::string(name), std::string(value)});
+        size_ += size;
+    }
+
+private:
+    void evict(size_t room) {
+        while (!entries_.empty() && size_ + room > max_size_) {
+            const HpackHeader& last = entries_.back();
+            size_ -= last.name.size() + last.value.size() + HPACK_ENTRY_OVERHEAD;
+            entries_.pop_back();
+        }
+    }
+
+    std::deque<HpackHeader> entries_;
+    size_t size_ = 0;
+    size_t max_size_ = HPACK_DEFAULT_TABLE_SIZE;
+};
+
+class HpackDecoder {
+public:
+    // Decode one complete header block. Returns false on a compression error, after which
+    // the decoder state is unusable and the connection must be torn down.
+    bool decode(const uint8_t* data, size_t len, std::vector<HpackHeader>& headers) {
+        const uint8_t* p = data;
+        const uint8_t* end = data + len;
+        bool at_start = true;
+        while (p < end) {
+            uint8_t b = *p;
+            uint64_t index;
+            if (b & 0x80) {
+                // Indexed header field
+                if (!hpack_decode_integer(p, end, 7, index) || !lookup(index, headers, true)) {
+                    return false;
+                }
+            } else if ((b & 0xe0) == 0x20) {
+                // Dynamic table size update, only allowed before the first field
+                if (!at_start || !hpack_decode_integer(p, end, 5, index) || index > HPACK_DEFAULT_TABLE_SIZE) {
+                    return false;
+                }
+                table_.set_max_size(index);
+                continue;
+            } else {
+                // Literal, with incremental indexing (01), without (0000) or never indexed (0001)
+                bool indexing = (b & 0xc0) == 0x40;
+                if (!hpack_decode_integer(p, end, indexing ? 6 : 4, index)) {
+                    return false;
+                }
+                HpackHeader header;
+                if (index != 0) {
+                    if (!lookup(index, headers, false)) {
+                        return false;
+                    }
+                    header.name = std::move(headers.back().name);
+                    headers.pop_back();
+                } else if (!decode_string(p, end, header.name)) {
+                    return false;
+                }
+                if (!decode_string(p, end, header.value)) {
+                    return false;
+                }
+                if (indexing) {
+                    table_.add(header.name, header.value);
+                }
+                headers.push_back(std::move(header));
+            }
+            at_start = false;
+        }
+        return true;
+    }
+
+private:
+    // Append the entry at a static or dynamic index, the name only when with_value is false
+    bool lookup(uint64_t index, std::vector<HpackHeader>& headers, bool with_value) {
+        if (index == 0) {
+            return false;
+        }
+        if (index <= HPACK_STATIC_TABLE_SIZE) {
+            const HpackStaticEntry& entry = HPACK_STATIC_TABLE[index - 1];
+            headers.push_back({std::string(entry.name), with_value ? std::string(entry.value) : std::string()});
+            return true;
+        }
+        index -= HPACK_STATIC_TABLE_SIZE + 1;
+        if (index >= table_.count()) {
+            return false;
+        }
+        headers.push_back({table_[index].name, with_value ? table_[index].value : std::string()});
+        return true;
+    }
+
+    static bool decode_string(const uint8_t*& p, const uint8_t* end, std::string& out) {
+        if (p == end) {
+            return false;
+        }
+        bool huffman = *p & 0x80;
+        uint64_t length;
+        if (!hpack_decode_integer(p, end, 7, length) || length > static_cast<uint64_t>(end - p)) {
+            return false;
+        }
+        if (huffman) {
+            if (!hpack_huffman_decode(p, length, out)) {
+                return false;
+            }
+        } else {
+            out.assign(reinterpret_cast<const char*>(p), length);
+        }
+        p += length;
+        return true;
+    }
+
+    HpackDynamicTable table_;
+};
+
+class HpackEncoder {
+public:
+    // The peer's SETTINGS_HEADER_TABLE_SIZE. We never grow past the default, and announce a
+    // change at the start of the next header block.
+    void set_peer_table_size(size_t size) {
+        size = std::min<size_t>(size, HPACK_DEFAULT_TABLE_SIZE);
+        if (size != table_.max_size()) {
+            table_.set_max_size(size);
+            size_update_pending_ = true;
+        }
+    }
+
+    void begin_block(std::string& out) {
+        if (size_update_pending_) {
+            hpack_encode_integer(out, 0x20, 5, table_.max_size());
+            size_update_pending_ = false;
+        }
+    }
+
+    // Encode one field. Fields that recur across responses (content types, cache policies)
+    // are added to the dynamic table so later responses send a single index byte; values
+    // unique to one response, like Content-Length, should pass indexable = false.
+    void encode(std::string& out, std::string_view name, std::string_view value, bool indexable) {
+        size_t name_index = 0;
+        for (size_t i = 0; i < HPACK_STATIC_TABLE_SIZE; ++i) {
+            if (HPACK_STATIC_TABLE[i].name == name) {
+                if (HPACK_STATIC_TABLE[i].value == value) {
+                    hpack_encode_integer(out, 0x80, 7, i + 1);
+                    return;
+                }
+                if (name_index == 0) {
+                    name_index = i + 1;
+                }
+            }
+        }
+        for (size_t i = 0; i < table_.count(); ++i) {
+            if (table_[i].name == name && table_[i].value == value) {
+                hpack_encode_integer(out, 0x80, 7, HPACK_STATIC_TABLE_SIZE + 1 + i);
+                return;
+            }
+        }
+
+        if (indexable) {
+            hpack_encode_integer(out, 0x40, 6, name_index);
+        } else {
+            hpack_encode_integer(out, 0x00, 4, name_index);
+        }
+        if (name_index == 0) {
+            encode_string(out, name);
+        }
+        encode_string(out, value);
+        if (indexable) {
+            table_.add(name, value);
+        }
+    }
+
+private:
+    static void encode_string(std::string& out, std::string_view s) {
+        size_t huffman_length = hpack_huffman_length(s);
+        if (huffman_length < s.size()) {
+            hpack_encode_integer(out, 0x80, 7, huffman_length);
+            hpack_huffman_encode(s, out);
+        } else {
+            hpack_encode_integer(out, 0x00, 7, s.size());
+            out.append(s);
+        }
+    }
+
+    HpackDynamicTable table_;
+    bool size_update_pending_ = false;
+};
+
+#endif // HPACK_H
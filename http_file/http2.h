@@ -0,0 +1,719 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "http_parser.h"
+#include "hpack.h"
+#include "output_queue.h"
+
+// HTTP/2 over cleartext TCP (h2c, RFC 9113), entered with prior knowledge (the client opens
+// with the connection preface) or through an HTTP/1.1 "Upgrade: h2c" request. Each stream is
+// answered by the same handler as HTTP/1.1: it writes an HTTP/1.1 response into the stream's
+// own OutputQueue, whose head is re-encoded with HPACK into a HEADERS frame and whose body
+// chunks (memory, shared cache buffers, sendfile ranges) are cut into DATA frames. DATA frames
+// of all streams are interleaved round robin within the flow-control windows, so a large
+// download no longer holds up the small files requested next to it.
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_SIZE 24
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_DEFAULT_FRAME_SIZE 16384 // SETTINGS_MAX_FRAME_SIZE default, and the largest frame we accept
+#define H2_MAX_FRAME_SIZE 16777215
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_MAX_CONCURRENT_STREAMS 100
+#define H2_FILL_BYTES (256 * 1024) // DATA queued per fill(), so new responses get a turn at socket pace
+
+enum Http2FrameType : uint8_t {
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9,
+};
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+enum Http2Error : uint32_t {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+enum Http2Setting : uint16_t {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+};
+
+// Writes an HTTP/1.1 response for req into out, like handle_request
+using Http2Handler = void (*)(const HttpRequest& req, OutputQueue& out, bool keep_alive);
+
+// How much of the client connection preface data starts with: 1 complete, 0 a proper prefix
+// so far, -1 not HTTP/2
+inline int http2_preface_match(const char* data, size_t len) {
+    size_t n = std::min<size_t>(len, H2_PREFACE_SIZE);
+    if (memcmp(data, H2_PREFACE, n) != 0) {
+        return -1;
+    }
+    return n == H2_PREFACE_SIZE ? 1 : 0;
+}
+
+// HTTP2-Settings carries a SETTINGS payload in base64url without padding (RFC 7540 section 3.2.1)
+inline bool http2_base64url_decode(std::string_view in, std::string& out) {
+    uint32_t acc = 0;
+    int bits = 0;
+    for (char c : in) {
+        int v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '-' || c == '+') v = 62;
+        else if (c == '_' || c == '/') v = 63;
+        else if (c == '=') break;
+        else return false;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out += static_cast<char>(acc >> bits);
+        }
+    }
+    return true;
+}
+
+inline void http2_lowercase(std::string& s) {
+    for (char& c : s) {
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<char>(c - 'A' + 'a');
+        }
+    }
+}
+
+inline uint32_t http2_read_u32(const uint8_t* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+struct Http2Stream {
+    std::vector<HpackHeader> headers; // request headers, the HttpRequest views point here
+    bool end_stream = false;          // the client finished sending the request
+    int64_t send_window = H2_DEFAULT_WINDOW;
+    OutputQueue body;                 // response body not yet framed
+};
+
+// Protocol state of one HTTP/2 connection. Like Connection it is owned by a single reactor
+// thread; frames to send are appended to the connection's OutputQueue.
+class Http2Session {
+public:
+    explicit Http2Session(Http2Handler handler) : handler_(handler) {}
+
+    // Prior knowledge: the connection preface is in the receive buffer
+    void start(OutputQueue& out) {
+        send_settings(out);
+    }
+
+    // Upgrade from HTTP/1.1: answers 101, then req on stream 1. Returns false without
+    // writing anything when the HTTP2-Settings header is malformed.
+    bool start_upgrade(const HttpRequest& req, std::string_view settings, OutputQueue& out) {
+        std::string payload;
+        if (!http2_base64url_decode(settings, payload) || payload.size() % 6 != 0) {
+            return false;
+        }
+        if (apply_settings(reinterpret_cast<const uint8_t*>(payload.data()), payload.size()) != H2_NO_ERROR) {
+            return false;
+        }
+        out.append("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+        send_settings(out);
+
+        // The upgrading request is stream 1, already half-closed by the client
+        last_stream_id_ = 1;
+        Http2Stream& stream = streams_[1];
+        stream.send_window = peer_initial_window_;
+        stream.end_stream = true;
+        stream.headers.push_back({":method", std::string(req.method)});
+        stream.headers.push_back({":path", std::string(req.path)});
+        for (size_t i = 0; i < req.header_count; ++i) {
+            std::string name(req.headers[i].name);
+            http2_lowercase(name);
+            if (!connection_specific(name) && name != "upgrade" && name != "http2-settings") {
+                stream.headers.push_back({std::move(name), std::string(req.headers[i].value)});
+            }
+        }
+        dispatch(1, out);
+        return true;
+    }
+
+    // Process the complete frames at the start of data, consumed reports the bytes used.
+    // Returns false after a connection error: GOAWAY is queued and nothing more may be read.
+    bool receive(const char* data, size_t len, size_t& consumed, OutputQueue& out) {
+        consumed = 0;
+        if (dead_) {
+            return false;
+        }
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+        if (!preface_received_) {
+            int match = http2_preface_match(data, len);
+            if (match < 0) {
+                return connection_error(out, H2_PROTOCOL_ERROR);
+            }
+            if (match == 0) {
+                return true;
+            }
+            preface_received_ = true;
+            consumed = H2_PREFACE_SIZE;
+        }
+
+        while (len - consumed >= H2_FRAME_HEADER_SIZE) {
+            const uint8_t* frame = p + consumed;
+            uint32_t length = (uint32_t(frame[0]) << 16) | (uint32_t(frame[1]) << 8) | frame[2];
+            if (length > H2_DEFAULT_FRAME_SIZE) {
+                return connection_error(out, H2_FRAME_SIZE_ERROR);
+            }
+            if (len - consumed < H2_FRAME_HEADER_SIZE + length) {
+                break;
+            }
+            consumed += H2_FRAME_HEADER_SIZE + length;
+            uint32_t stream_id = http2_read_u32(frame + 5) & 0x7fffffff;
+            if (!handle_frame(frame[3], frame[4], stream_id, frame + H2_FRAME_HEADER_SIZE, length, out)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Queue DATA frames for streams with response bytes left, one frame per stream per turn,
+    // within the connection and stream send windows. Returns false if nothing was queued.
+    bool fill(OutputQueue& out) {
+        if (dead_) {
+            return false;
+        }
+        size_t queued = 0;
+        bool progress = true;
+        while (progress && queued < H2_FILL_BYTES && send_window_ > 0) {
+            progress = false;
+            auto it = streams_.upper_bound(last_served_);
+            for (size_t n = streams_.size(); n > 0 && queued < H2_FILL_BYTES && send_window_ > 0; --n) {
+                if (it == streams_.end()) {
+                    it = streams_.begin();
+                }
+                Http2Stream& stream = it->second;
+                if (stream.body.empty() || stream.send_window <= 0) {
+                    ++it;
+                    continue;
+                }
+                queued += send_data(out, it->first, stream);
+                last_served_ = it->first;
+                progress = true;
+                it = stream.body.empty() ? streams_.erase(it) : std::next(it);
+            }
+        }
+        return queued > 0;
+    }
+
+    // The client sent GOAWAY and every stream it had opened is answered
+    bool finished() const {
+        return goaway_received_ && streams_.empty();
+    }
+
+private:
+    bool handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t length,
+                      OutputQueue& out) {
+        if (!settings_received_ && type != H2_SETTINGS) {
+            return connection_error(out, H2_PROTOCOL_ERROR); // the preface must be followed by SETTINGS
+        }
+        if (continuation_stream_ != 0 && type != H2_CONTINUATION) {
+            return connection_error(out, H2_PROTOCOL_ERROR);
+        }
+
+        switch (type) {
+            case H2_DATA:
+                return on_data(flags, stream_id, payload, length, out);
+            case H2_HEADERS:
+                return on_headers(flags, stream_id, payload, length, out);
+            case H2_CONTINUATION:
+                if (stream_id == 0 || stream_id != continuation_stream_) {
+                    return connection_error(out, H2_PROTOCOL_ERROR);
+                }
+                return add_header_fragment(payload, length, flags, out);
+            case H2_PRIORITY:
+                // Priorities are advisory and every stream is served round robin
+                if (stream_id == 0) {
+                    return connection_error(out, H2_PROTOCOL_ERROR);
+                }
+                if (length != 5) {
+                    reset_stream(out, stream_id, H2_FRAME_SIZE_ERROR);
+                }
+                return true;
+            case H2_RST_STREAM:
+                if (stream_id == 0 || stream_id > last_stream_id_) {
+                    return connection_error(out, H2_PROTOCOL_ERROR);
+                }
+                if (length != 4) {
+                    return connection_error(out, H2_FRAME_SIZE_ERROR);
+                }
+                streams_.erase(stream_id);
+                return true;
+            case H2_SETTINGS:
+                return on_settings(flags, stream_id, payload, length, out);
+            case H2_PING:
+                if (stream_id != 0) {
+                    return connection_error(out, H2_PROTOCOL_ERROR);
+                }
+                if (length != 8) {
+                    return connection_error(out, H2_FRAME_SIZE_ERROR);
+                }
+                if (!(flags & H2_FLAG_ACK)) {
+                    write_frame_header(out, 8, H2_PING, H2_FLAG_ACK, 0);
+                    out.append(reinterpret_cast<const char*>(payload), 8);
+                }
+                return true;
+            case H2_GOAWAY:
+                if (stream_id != 0) {
+                    return connection_error(out, H2_PROTOCOL_ERROR);
+                }
+                goaway_received_ = true;
+                return true;
+            case H2_WINDOW_UPDATE:
+                return on_window_update(stream_id, payload, length, out);
+            case H2_PUSH_PROMISE:
+                return connection_error(out, H2_PROTOCOL_ERROR); // clients never push
+            default:
+                return true; // unknown frame types are ignored
+        }
+    }
+
+    // Strip the Pad Length field and padding of a DATA or HEADERS payload
+    static bool strip_padding(uint8_t flags, const uint8_t*& payload, uint32_t& length) {
+        if (!(flags & H2_FLAG_PADDED)) {
+            return true;
+        }
+        if (length < 1 || payload[0] >= length) {
+            return false;
+        }
+        uint8_t pad = payload[0];
+        ++payload;
+        length -= 1 + pad;
+        return true;
+    }
+
+    bool on_data(uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t length, OutputQueue& out) {
+        if (stream_id == 0) {
+            return connection_error(out, H2_PROTOCOL_ERROR);
+        }
+        // The whole frame, padding included, counts against the windows. Request bodies are
+        // discarded, so the credit is handed back straight away and the receive windows never
+        // shrink below what a single frame could use.
+        if (length > 0) {
+            send_window_update(out, 0, length);
+        }
+        uint32_t flow_length = length;
+        if (!strip_padding(flags, payload, length)) {
+            return connection_error(out, H2_PROTOCOL_ERROR);
+        }
+
+        auto it = streams_.find(stream_id);
+        if (it == streams_.end() || it->second.end_stream) {
+            if (stream_id > last_stream_id_) {
+                return connection_error(out, H2_PROTOCOL_ERROR); // idle stream
+            }
+            reset_stream(out, stream_id, H2_STREAM_CLOSED);
+            return true;
+        }
+        if (flags & H2_FLAG_END_STREAM) {
+            it->second.end_stream = true;
+            dispatch(stream_id, out);
+        } else if (flow_length > 0) {
+            send_window_update(out, stream_id, flow_length);
+        }
+        return true;
+    }
+
+    bool on_headers(uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t length, OutputQueue& out) {
+        if (stream_id == 0 || stream_id % 2 == 0) {
+            return connection_error(out, H2_PROTOCOL_ERROR);
+        }
+        if (!strip_padding(flags, payload, length)) {
+            return connection_error(out, H2_PROTOCOL_ERROR);
+        }
+        if (flags & H2_FLAG_PRIORITY) {
+            if (length < 5) {
+                return connection_error(out, H2_FRAME_SIZE_ERROR);
+            }
+            payload += 5;
+            length -= 5;
+        }
+        header_block_.clear();
+        header_stream_ = stream_id;
+        header_end_stream_ = flags & H2_FLAG_END_STREAM;
+        continuation_stream_ = stream_id;
+        return add_header_fragment(payload, length, flags, out);
+    }
+
+    bool add_header_fragment(const uint8_t* payload, uint32_t length, uint8_t flags, OutputQueue& out) {
+        if (header_block_.size() + length > HTTP_MAX_HEADER_BYTES) {
+            return connection_error(out, H2_ENHANCE_YOUR_CALM);
+        }
+        header_block_.append(reinterpret_cast<const char*>(payload), length);
+        if (!(flags & H2_FLAG_END_HEADERS)) {
+            return true;
+        }
+        continuation_stream_ = 0;
+
+        // Every block is decoded, even for refused streams, to keep the HPACK tables in step
+        std::vector<HpackHeader> headers;
+        if (!decoder_.decode(reinterpret_cast<const uint8_t*>(header_block_.data()), header_block_.size(), headers)) {
+            return connection_error(out, H2_COMPRESSION_ERROR);
+        }
+
+        uint32_t id = header_stream_;
+        auto it = streams_.find(id);
+        if (it != streams_.end()) {
+            // Trailers: they must end the request
+            if (it->second.end_stream || !header_end_stream_) {
+                reset_stream(out, id, H2_PROTOCOL_ERROR);
+                streams_.erase(it);
+                return true;
+            }
+            it->second.end_stream = true;
+            dispatch(id, out);
+            return true;
+        }
+        if (id <= last_stream_id_) {
+            return connection_error(out, H2_STREAM_CLOSED);
+        }
+        last_stream_id_ = id;
+        if (streams_.size() >= H2_MAX_CONCURRENT_STREAMS) {
+            reset_stream(out, id, H2_REFUSED_STREAM);
+            return true;
+        }
+
+        Http2Stream& stream = streams_[id];
+        stream.headers = std::move(headers);
+        stream.send_window = peer_initial_window_;
+        stream.end_stream = header_end_stream_;
+        if (stream.end_stream) {
+            dispatch(id, out);
+        }
+        return true;
+    }
+
+    bool on_settings(uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t length, OutputQueue& out) {
+        if (stream_id != 0) {
+            return connection_error(out, H2_PROTOCOL_ERROR);
+        }
+        if (flags & H2_FLAG_ACK) {
+            return length == 0 || connection_error(out, H2_FRAME_SIZE_ERROR);
+        }
+        if (length % 6 != 0) {
+            return connection_error(out, H2_FRAME_SIZE_ERROR);
+        }
+        Http2Error error = apply_settings(payload, length);
+        if (error != H2_NO_ERROR) {
+            return connection_error(out, error);
+        }
+        settings_received_ = true;
+        write_frame_header(out, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+        return true;
+    }
+
+    Http2Error apply_settings(const uint8_t* payload, size_t length) {
+        for (size_t i = 0; i + 6 <= length; i += 6) {
+            uint16_t id = (uint16_t(payload[i]) << 8) | payload[i + 1];
+            uint32_t value = http2_read_u32(payload + i + 2);
+            switch (id) {
+                case H2_SETTINGS_HEADER_TABLE_SIZE:
+                    encoder_.set_peer_table_size(value);
+                    break;
+                case H2_SETTINGS_ENABLE_PUSH:
+                    if (value > 1) {
+                        return H2_PROTOCOL_ERROR;
+                    }
+                    break;
+                case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                    if (value > H2_MAX_WINDOW) {
+                        return H2_FLOW_CONTROL_ERROR;
+                    }
+                    // Applies retroactively to every open stream
+                    for (auto& entry : streams_) {
+                        entry.second.send_window += int64_t(value) - peer_initial_window_;
+                    }
+                    peer_initial_window_ = value;
+                    break;
+                case H2_SETTINGS_MAX_FRAME_SIZE:
+                    if (value < H2_DEFAULT_FRAME_SIZE || value > H2_MAX_FRAME_SIZE) {
+                        return H2_PROTOCOL_ERROR;
+                    }
+                    peer_max_frame_size_ = value;
+                    break;
+                default:
+                    break; // MAX_CONCURRENT_STREAMS only limits pushes, we never push
+            }
+        }
+        return H2_NO_ERROR;
+    }
+
+    bool on_window_update(uint32_t stream_id, const uint8_t* payload, uint32_t length, OutputQueue& out) {
+        if (length != 4) {
+            return connection_error(out, H2_FRAME_SIZE_ERROR);
+        }
+        uint32_t increment = http2_read_u32(payload) & 0x7fffffff;
+        if (stream_id == 0) {
+            if (increment == 0 || send_window_ + increment > H2_MAX_WINDOW) {
+                return connection_error(out, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            }
+            send_window_ += increment;
+            return true;
+        }
+        auto it = streams_.find(stream_id);
+        if (it == streams_.end()) {
+            return true; // the stream already finished
+        }
+        if (increment == 0 || it->second.send_window + increment > H2_MAX_WINDOW) {
+            reset_stream(out, stream_id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            streams_.erase(it);
+            return true;
+        }
+        it->second.send_window += increment;
+        return true;
+    }
+
+    // Headers HTTP/2 forbids because the connection semantics they describe don't exist
+    static bool connection_specific(std::string_view name) {
+        return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+               name == "transfer-encoding";
+    }
+
+    // The request on a stream is complete: run the handler and send the response head
+    void dispatch(uint32_t id, OutputQueue& out) {
+        Http2Stream& stream = streams_[id];
+        HttpRequest req;
+        req.http_version = "HTTP/2.0";
+        std::string_view authority;
+        bool malformed = false;
+        bool too_many = false;
+        for (const HpackHeader& header : stream.headers) {
+            if (!header.name.empty() && header.name[0] == ':') {
+                if (header.name == ":method") {
+                    req.method = header.value;
+                } else if (header.name == ":path") {
+                    req.path = header.value;
+                } else if (header.name == ":authority") {
+                    authority = header.value;
+                } else if (header.name != ":scheme") {
+                    malformed = true;
+                }
+                continue;
+            }
+            bool lowercase = std::none_of(header.name.begin(), header.name.end(),
+                                          [](char c) { return c >= 'A' && c <= 'Z'; });
+            if (header.name.empty() || !lowercase || connection_specific(header.name)) {
+                malformed = true;
+            } else if (req.header_count == HTTP_MAX_HEADERS) {
+                too_many = true;
+            } else {
+                req.headers[req.header_count++] = {header.name, header.value};
+            }
+        }
+        // :authority replaces Host
+        if (!authority.empty() && !req.header("host") && req.header_count < HTTP_MAX_HEADERS) {
+            req.headers[req.header_count++] = {"host", authority};
+        }
+        if (malformed || req.method.empty() || req.path.empty()) {
+            reset_stream(out, id, H2_PROTOCOL_ERROR);
+            streams_.erase(id);
+            return;
+        }
+
+        if (too_many) {
+            stream.body.append("HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\n\r\n");
+        } else {
+            handler_(req, stream.body, true);
+        }
+        respond(id, stream, out);
+    }
+
+    // Turn the HTTP/1.1 head at the front of the stream's output into a HEADERS frame
+    void respond(uint32_t id, Http2Stream& stream, OutputQueue& out) {
+        size_t end = std::string_view::npos;
+        if (!stream.body.empty() && !stream.body.front().shared && !stream.body.front().file) {
+            end = stream.body.front().data.find("\r\n\r\n");
+        }
+        if (end == std::string_view::npos || end < 12) {
+            reset_stream(out, id, H2_INTERNAL_ERROR);
+            streams_.erase(id);
+            return;
+        }
+        OutputChunk& head_chunk = stream.body.front();
+        std::string_view head(head_chunk.data.data(), end + 2);
+
+        response_block_.clear();
+        encoder_.begin_block(response_block_);
+        encoder_.encode(response_block_, ":status", head.substr(9, 3), true);
+        size_t line = head.find("\r\n") + 2;
+        while (line < head.size()) {
+            size_t eol = head.find("\r\n", line);
+            std::string_view field = head.substr(line, eol - line);
+            line = eol + 2;
+            size_t colon = field.find(':');
+            if (colon == std::string_view::npos) {
+                continue;
+            }
+            name_.assign(field.data(), colon);
+            http2_lowercase(name_);
+            std::string_view value = field.substr(colon + 1);
+            while (!value.empty() && value.front() == ' ') {
+                value.remove_prefix(1);
+            }
+            if (connection_specific(name_)) {
+                continue;
+            }
+            // Per-response values would only push reusable entries out of the table
+            bool indexable = name_ != "content-length" && name_ != "content-range" && name_ != "etag" &&
+                             name_ != "last-modified";
+            encoder_.encode(response_block_, name_, value, indexable);
+        }
+
+        head_chunk.sent = end + 4;
+        if (head_chunk.sent == head_chunk.data.size()) {
+            stream.body.pop_front();
+        }
+
+        // Header blocks are not flow controlled; split them into HEADERS + CONTINUATION frames
+        bool end_stream = stream.body.empty();
+        size_t offset = 0;
+        do {
+            size_t n = std::min<size_t>(response_block_.size() - offset, peer_max_frame_size_);
+            bool last = offset + n == response_block_.size();
+            uint8_t flags = (last ? H2_FLAG_END_HEADERS : 0) | (offset == 0 && end_stream ? H2_FLAG_END_STREAM : 0);
+            write_frame_header(out, n, offset == 0 ? H2_HEADERS : H2_CONTINUATION, flags, id);
+            out.append(response_block_.data() + offset, n);
+            offset += n;
+        } while (offset < response_block_.size());
+
+        if (end_stream) {
+            streams_.erase(id);
+        }
+    }
+
+    // One DATA frame from the front body chunk, referencing shared buffers and file ranges
+    // instead of copying them. Returns the bytes queued.
+    size_t send_data(OutputQueue& out, uint32_t id, Http2Stream& stream) {
+        OutputChunk& chunk = stream.body.front();
+        if (chunk.source && chunk.sent == chunk.data.size() && !chunk.source_done) {
+            chunk.refill();
+        }
+        size_t available = chunk.file ? chunk.file_remaining : chunk.memory_size() - chunk.sent;
+        size_t n = std::min<uint64_t>({available, peer_max_frame_size_, static_cast<uint64_t>(stream.send_window),
+                                       static_cast<uint64_t>(send_window_)});
+        // A generated body only ends with its last piece, possibly in an empty frame
+        bool drained = n == available && (!chunk.source || chunk.source_done);
+        bool end_stream = drained && stream.body.size() == 1;
+        write_frame_header(out, n, H2_DATA, end_stream ? H2_FLAG_END_STREAM : 0, id);
+        if (chunk.file) {
+            out.append_file(chunk.file, chunk.file_offset, n);
+            chunk.file_offset += n;
+            chunk.file_remaining -= n;
+        } else if (chunk.shared) {
+            out.append_shared(chunk.shared, chunk.shared_offset + chunk.sent, n);
+            chunk.sent += n;
+        } else {
+            out.append(chunk.data.data() + chunk.sent, n);
+            chunk.sent += n;
+        }
+        if (drained) {
+            stream.body.pop_front();
+        }
+        stream.send_window -= n;
+        send_window_ -= n;
+        return H2_FRAME_HEADER_SIZE + n;
+    }
+
+    void send_settings(OutputQueue& out) {
+        const uint8_t settings[] = {0, H2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_CONCURRENT_STREAMS};
+        write_frame_header(out, sizeof(settings), H2_SETTINGS, 0, 0);
+        out.append(reinterpret_cast<const char*>(settings), sizeof(settings));
+    }
+
+    void send_window_update(OutputQueue& out, uint32_t stream_id, uint32_t increment) {
+        write_frame_header(out, 4, H2_WINDOW_UPDATE, 0, stream_id);
+        write_u32(out, increment);
+    }
+
+    void reset_stream(OutputQueue& out, uint32_t stream_id, Http2Error error) {
+        write_frame_header(out, 4, H2_RST_STREAM, 0, stream_id);
+        write_u32(out, error);
+    }
+
+    // Queue GOAWAY and stop processing; the connection closes once it is written
+    bool connection_error(OutputQueue& out, Http2Error error) {
+        write_frame_header(out, 8, H2_GOAWAY, 0, 0);
+        write_u32(out, last_stream_id_);
+        write_u32(out, error);
+        dead_ = true;
+        return false;
+    }
+
+    static void write_u32(OutputQueue& out, uint32_t value) {
+        const char bytes[4] = {static_cast<char>(value >> 24), static_cast<char>(value >> 16),
+                               static_cast<char>(value >> 8), static_cast<char>(value)};
+        out.append(bytes, 4);
+    }
+
+    static void write_frame_header(OutputQueue& out, uint32_t length, uint8_t type, uint8_t flags, uint32_t stream_id) {
+        const char header[H2_FRAME_HEADER_SIZE] = {
+            static_cast<char>(length >> 16), static_cast<char>(length >> 8), static_cast<char>(length),
+            static_cast<char>(type), static_cast<char>(flags),
+            static_cast<char>(stream_id >> 24), static_cast<char>(stream_id >> 16),
+            static_cast<char>(stream_id >> 8), static_cast<char>(stream_id)};
+        out.append(header, H2_FRAME_HEADER_SIZE);
+    }
+
+    Http2Handler handler_;
+    HpackDecoder decoder_;
+    HpackEncoder encoder_;
+    std::map<uint32_t, Http2Stream> streams_; // open streams by id, iterated round robin
+    uint32_t last_stream_id_ = 0;             // highest stream id the client opened
+    uint32_t last_served_ = 0;                // stream that got the previous DATA frame
+    bool preface_received_ = false;
+    bool settings_received_ = false;
+    bool goaway_received_ = false;
+    bool dead_ = false;
+
+    // Header block being received, possibly across CONTINUATION frames
+    std::string header_block_;
+    uint32_t header_stream_ = 0;
+    bool header_end_stream_ = false;
+    uint32_t continuation_stream_ = 0;
+    std::string response_block_; // HPACK block of the response being sent
+    std::string name_;           // lowercased response header name
+
+    int64_t send_window_ = H2_DEFAULT_WINDOW;
+    int64_t peer_initial_window_ = H2_DEFAULT_WINDOW;
+    uint64_t peer_max_frame_size_ = H2_DEFAULT_FRAME_SIZE;
+};
+
+#endif // HTTP2_H
@@ -0,0 +1,575 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "http_parser.h"
+
+// wrk-style load generator for simple_http_server.
+// Usage: http_load [-c connections] [-t threads] [-d seconds] [-a address] [-p port] [--close]
+//                  [--mix index=1,text=4,jpg=2,mp4range=2] [--server-pid PID]
+// Every connection runs one request at a time; in keep-alive mode it is reused, with --close a
+// new connection is opened per request. Request kinds are drawn from the weighted mix.
+
+#define DEFAULT_PORT 8080
+#define RECV_BUFFER_SIZE 65536
+#define RANGE_LENGTH 65536 // Bytes per mp4range request
+
+// Log-linear latency histogram in nanoseconds: 32 linear sub-buckets per power of two,
+// so any percentile is within about 3% of the exact value
+struct LatencyHistogram {
+    static constexpr int SUB_BITS = 5;
+    static constexpr int BUCKETS = 64 << SUB_BITS;
+    std::vector<uint64_t> counts = std::vector<uint64_t>(BUCKETS);
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    static int index(uint64_t ns) {
+        if (ns < (1u << SUB_BITS)) {
+            return static_cast<int>(ns);
+        }
+        int msb = 63 - __builtin_clzll(ns);
+        int sub = static_cast<int>((ns >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+        return ((msb - SUB_BITS + 1) << SUB_BITS) | sub;
+    }
+
+    // Upper bound of a bucket
+    static uint64_t value(int idx) {
+        if (idx < (1 << SUB_BITS)) {
+            return idx;
+        }
+        int msb = (idx >> SUB_BITS) + SUB_BITS - 1;
+        uint64_t sub = idx & ((1 << SUB_BITS) - 1);
+        return ((uint64_t(1) << SUB_BITS | sub) + 1) << (msb - SUB_BITS);
+    }
+
+    void record(uint64_t ns) {
+        ++counts[index(ns)];
+        ++total;
+        max = std::max(max, ns);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (int i = 0; i < BUCKETS; ++i) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        max = std::max(max, other.max);
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = static_cast<uint64_t>(p / 100.0 * total);
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen > rank) {
+                return std::min(value(i), max);
+            }
+        }
+        return max;
+    }
+};
+
+struct RequestKind {
+    std::string name;
+    std::string path;
+    bool range = false; // random RANGE_LENGTH window of the file
+    int weight = 0;
+};
+
+struct KindStats {
+    uint64_t responses = 0;
+    uint64_t bytes = 0;
+    LatencyHistogram latency;
+};
+
+struct Stats {
+    uint64_t status_2xx_3xx = 0;
+    uint64_t status_4xx = 0;
+    uint64_t status_5xx = 0;
+    uint64_t errors = 0; // connect failures, resets, malformed responses
+    std::vector<KindStats> kinds;
+};
+
+struct Options {
+    int connections = 64;
+    int threads = 2;
+    int seconds = 10;
+    std::string address = "127.0.0.1";
+    int port = DEFAULT_PORT;
+    bool keep_alive = true;
+    std::string mix = "index=1,text=4,jpg=2,mp4range=2";
+    int server_pid = 0;
+};
+
+Options options;
+std::vector<RequestKind> kinds;
+uint64_t mp4_size = 0;
+std::atomic<bool> running{true};
+
+// Size of a file on the server, learned from the Content-Range of a one-byte range request
+uint64_t probe_size(const std::string& path) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options.port);
+    inet_pton(AF_INET, options.address.c_str(), &addr.sin_addr);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    std::string req = "GET " + path + " HTTP/1.1\r\nHost: " + options.address + "\r\nRange: bytes=0-0\r\nConnection: close\r\n\r\n";
+    send(fd, req.data(), req.size(), 0);
+    std::string response;
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        response.append(buf, n);
+    }
+    close(fd);
+    size_t slash = response.find("Content-Range: bytes 0-0/");
+    return slash == std::string::npos ? 0 : strtoull(response.c_str() + slash + 25, nullptr, 10);
+}
+
+bool parse_mix(const std::string& mix) {
+    const std::vector<RequestKind> known = {
+        {"index", "/", false, 0},
+        {"text", "/test.txt", false, 0},
+        {"jpg", "/2.jpg", false, 0},
+        {"mp4", "/1.mp4", false, 0},
+        {"mp4range", "/1.mp4", true, 0},
+    };
+    std::stringstream ss(mix);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        // The weight follows the last '=', a path may carry a query string of its own
+        size_t eq = item.rfind('=');
+        if (eq != std::string::npos && item.find_first_not_of("0123456789", eq + 1) != std::string::npos) {
+            eq = std::string::npos;
+        }
+        std::string name = item.substr(0, eq);
+        int weight = eq == std::string::npos ? 1 : atoi(item.c_str() + eq + 1);
+        bool found = false;
+        for (RequestKind kind : known) {
+            if (kind.name == name) {
+                kind.weight = weight;
+                kinds.push_back(kind);
+                found = true;
+            }
+        }
+        if (!found && !name.empty() && name[0] == '/') {
+            kinds.push_back({name, name, false, weight}); // any path can be part of the mix
+            found = true;
+        }
+        if (!found || weight <= 0) {
+            std::cerr << "Unknown mix entry: " << item << std::endl;
+            return false;
+        }
+    }
+    return !kinds.empty();
+}
+
+// One client connection: a single outstanding request and the parse state of its response
+struct ClientConnection {
+    int fd = -1;
+    size_t kind = 0;
+    std::string request;
+    size_t request_sent = 0;
+    std::string head; // response header bytes seen so far
+    bool in_body = false;
+    uint64_t body_remaining = 0;
+    bool body_chunked = false; // ... or framed by chunks, ended when the decoder says so
+    ChunkedDecoder body_decoder;
+    uint64_t body_bytes = 0;
+    bool server_closes = false;
+    std::chrono::steady_clock::time_point started;
+};
+
+class LoadThread {
+public:
+    LoadThread(int connections, unsigned seed) : connections_(connections), rng_(seed) {
+        stats_.kinds.resize(kinds.size());
+        int total_weight = 0;
+        for (const RequestKind& kind : kinds) {
+            total_weight += kind.weight;
+        }
+        total_weight_ = total_weight;
+    }
+
+    void run() {
+        epoll_fd_ = epoll_create1(0);
+        conns_.resize(connections_);
+        for (ClientConnection& conn : conns_) {
+            open_connection(conn);
+        }
+
+        struct epoll_event events[256];
+        while (running.load(std::memory_order_relaxed)) {
+            int n = epoll_wait(epoll_fd_, events, 256, 100);
+            for (int i = 0; i < n; ++i) {
+                ClientConnection& conn = conns_[events[i].data.u32];
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    fail(conn);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    write_request(conn);
+                }
+                if (events[i].events & EPOLLIN) {
+                    read_response(conn);
+                }
+            }
+        }
+        for (ClientConnection& conn : conns_) {
+            if (conn.fd >= 0) {
+                close(conn.fd);
+            }
+        }
+        close(epoll_fd_);
+    }
+
+    const Stats& stats() const {
+        return stats_;
+    }
+
+private:
+    void open_connection(ClientConnection& conn) {
+        conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int opt = 1;
+        setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(options.port);
+        inet_pton(AF_INET, options.address.c_str(), &addr.sin_addr);
+        if (connect(conn.fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+            ++stats_.errors;
+            close(conn.fd);
+            conn.fd = -1;
+            return;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u32 = static_cast<uint32_t>(&conn - conns_.data());
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, conn.fd, &ev);
+        start_request(conn);
+    }
+
+    size_t pick_kind() {
+        int r = std::uniform_int_distribution<int>(0, total_weight_ - 1)(rng_);
+        for (size_t i = 0; i < kinds.size(); ++i) {
+            r -= kinds[i].weight;
+            if (r < 0) {
+                return i;
+            }
+        }
+        return 0;
+    }
+
+    void start_request(ClientConnection& conn) {
+        conn.kind = pick_kind();
+        const RequestKind& kind = kinds[conn.kind];
+        conn.request = "GET " + kind.path + " HTTP/1.1\r\nHost: " + options.address + "\r\n";
+        if (kind.range && mp4_size > RANGE_LENGTH) {
+            uint64_t first = std::uniform_int_distribution<uint64_t>(0, mp4_size - RANGE_LENGTH)(rng_);
+            conn.request += "Range: bytes=" + std::to_string(first) + "-" + std::to_string(first + RANGE_LENGTH - 1) + "\r\n";
+        }
+        conn.request += options.keep_alive ? "\r\n" : "Connection: close\r\n\r\n";
+        conn.request_sent = 0;
+        conn.head.clear();
+        conn.in_body = false;
+        conn.body_bytes = 0;
+        conn.server_closes = !options.keep_alive;
+        conn.started = std::chrono::steady_clock::now();
+        write_request(conn);
+    }
+
+    void write_request(ClientConnection& conn) {
+        while (conn.fd >= 0 && conn.request_sent < conn.request.size()) {
+            ssize_t n = send(conn.fd, conn.request.data() + conn.request_sent, conn.request.size() - conn.request_sent,
+                             MSG_NOSIGNAL);
+            if (n > 0) {
+                conn.request_sent += n;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)) {
+                return; // still connecting, or socket buffer full: EPOLLOUT resumes
+            } else {
+                fail(conn);
+                return;
+            }
+        }
+    }
+
+    void read_response(ClientConnection& conn) {
+        char buf[RECV_BUFFER_SIZE];
+        while (conn.fd >= 0) {
+            ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+            if (n == 0) {
+                fail(conn); // closed before the response was complete
+                return;
+            }
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    fail(conn);
+                }
+                return;
+            }
+            const char* p = buf;
+            size_t len = n;
+            while (len > 0 && conn.fd >= 0) {
+                if (!conn.in_body) {
+                    size_t old = conn.head.size();
+                    conn.head.append(p, len);
+                    size_t end = conn.head.find("\r\n\r\n");
+                    if (end == std::string::npos) {
+                        len = 0;
+                        continue;
+                    }
+                    size_t used = end + 4 - old;
+                    p += used;
+                    len -= used;
+                    conn.head.resize(end + 4);
+                    if (!parse_head(conn)) {
+                        fail(conn);
+                        return;
+                    }
+                } else if (conn.body_chunked) {
+                    size_t consumed = 0;
+                    ChunkedStatus status = conn.body_decoder.feed(p, len, consumed, [&](const char*, size_t n) {
+                        conn.body_bytes += n;
+                    });
+                    if (status == ChunkedStatus::Error) {
+                        fail(conn);
+                        return;
+                    }
+                    p += consumed;
+                    len -= consumed;
+                    conn.body_chunked = status != ChunkedStatus::Done;
+                } else {
+                    size_t take = std::min<uint64_t>(len, conn.body_remaining);
+                    conn.body_remaining -= take;
+                    conn.body_bytes += take;
+                    p += take;
+                    len -= take;
+                }
+                if (conn.in_body && conn.body_remaining == 0 && !conn.body_chunked) {
+                    complete(conn);
+                }
+            }
+        }
+    }
+
+    bool parse_head(ClientConnection& conn) {
+        if (conn.head.compare(0, 9, "HTTP/1.1 ") != 0) {
+            return false;
+        }
+        int status = atoi(conn.head.c_str() + 9);
+        if (status >= 500) {
+            ++stats_.status_5xx;
+        } else if (status >= 400) {
+            ++stats_.status_4xx;
+        } else {
+            ++stats_.status_2xx_3xx;
+        }
+        conn.body_remaining = 0;
+        conn.body_chunked = false;
+        const char* cl = strcasestr(conn.head.c_str(), "\r\nContent-Length:");
+        if (strcasestr(conn.head.c_str(), "\r\nTransfer-Encoding: chunked")) {
+            // Directory listings and proxied responses of unknown length
+            conn.body_chunked = status != 204 && status != 304;
+            conn.body_decoder.reset();
+        } else if (cl) {
+            conn.body_remaining = strtoull(cl + 17, nullptr, 10);
+        }
+        if (strcasestr(conn.head.c_str(), "\r\nConnection: close")) {
+            conn.server_closes = true;
+        }
+        conn.in_body = true;
+        return true;
+    }
+
+    void complete(ClientConnection& conn) {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - conn.started).count();
+        KindStats& kind = stats_.kinds[conn.kind];
+        ++kind.responses;
+        kind.bytes += conn.body_bytes;
+        kind.latency.record(ns);
+        if (conn.server_closes) {
+            close(conn.fd);
+            open_connection(conn);
+        } else {
+            start_request(conn);
+        }
+    }
+
+    void fail(ClientConnection& conn) {
+        ++stats_.errors;
+        close(conn.fd);
+        conn.fd = -1;
+        if (running.load(std::memory_order_relaxed)) {
+            open_connection(conn);
+        }
+    }
+
+    int connections_;
+    std::mt19937_64 rng_;
+    int total_weight_ = 0;
+    int epoll_fd_ = -1;
+    std::vector<ClientConnection> conns_;
+    Stats stats_;
+};
+
+// utime + stime of a process in seconds, -1 if it can't be read
+double process_cpu_seconds(int pid) {
+    std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat;
+    if (!std::getline(in, stat)) {
+        return -1;
+    }
+    // Fields after the parenthesised command name; utime and stime are fields 14 and 15
+    std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+    std::string field;
+    unsigned long long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; ++i) {
+        if (i == 14) utime = std::stoull(field);
+        if (i == 15) stime = std::stoull(field);
+    }
+    return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+double self_cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [-c connections] [-t threads] [-d seconds] [-a address] [-p port] [--close]\n"
+              << "       [--mix index=1,text=4,jpg=2,mp4=1,mp4range=2,/any/path=1] [--server-pid PID]" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto next = [&]() -> const char* {
+            if (i + 1 >= argc) usage(argv[0]);
+            return argv[++i];
+        };
+        if (arg == "-c") options.connections = std::max(1, atoi(next()));
+        else if (arg == "-t") options.threads = std::max(1, atoi(next()));
+        else if (arg == "-d") options.seconds = std::max(1, atoi(next()));
+        else if (arg == "-a") options.address = next();
+        else if (arg == "-p") options.port = atoi(next());
+        else if (arg == "--close") options.keep_alive = false;
+        else if (arg == "--mix") options.mix = next();
+        else if (arg == "--server-pid") options.server_pid = atoi(next());
+        else usage(argv[0]);
+    }
+    if (!parse_mix(options.mix)) {
+        usage(argv[0]);
+    }
+    options.threads = std::min(options.threads, options.connections);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (const RequestKind& kind : kinds) {
+        if (kind.range) {
+            mp4_size = probe_size(kind.path);
+            if (mp4_size <= RANGE_LENGTH) {
+                std::cerr << "Cannot determine the size of " << kind.path << ", range requests fall back to full GETs" << std::endl;
+            }
+            break;
+        }
+    }
+
+    std::cout << "Running " << options.seconds << "s test @ http://" << options.address << ":" << options.port << "\n  "
+              << options.threads << " threads and " << options.connections << " "
+              << (options.keep_alive ? "keep-alive" : "close") << " connections, mix " << options.mix << std::endl;
+
+    std::vector<std::unique_ptr<LoadThread>> workers;
+    for (int t = 0; t < options.threads; ++t) {
+        int conns = options.connections / options.threads + (t < options.connections % options.threads ? 1 : 0);
+        workers.emplace_back(new LoadThread(conns, 0x9e3779b9u * (t + 1)));
+    }
+
+    double server_cpu_before = options.server_pid ? process_cpu_seconds(options.server_pid) : -1;
+    double self_cpu_before = self_cpu_seconds();
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back(&LoadThread::run, worker.get());
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+    running = false;
+    for (auto& t : threads) {
+        t.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double server_cpu_after = options.server_pid ? process_cpu_seconds(options.server_pid) : -1;
+    double self_cpu = self_cpu_seconds() - self_cpu_before;
+
+    Stats total;
+    total.kinds.resize(kinds.size());
+    LatencyHistogram all;
+    uint64_t responses = 0, bytes = 0;
+    for (auto& worker : workers) {
+        const Stats& s = worker->stats();
+        total.status_2xx_3xx += s.status_2xx_3xx;
+        total.status_4xx += s.status_4xx;
+        total.status_5xx += s.status_5xx;
+        total.errors += s.errors;
+        for (size_t k = 0; k < kinds.size(); ++k) {
+            total.kinds[k].responses += s.kinds[k].responses;
+            total.kinds[k].bytes += s.kinds[k].bytes;
+            total.kinds[k].latency.merge(s.kinds[k].latency);
+            all.merge(s.kinds[k].latency);
+            responses += s.kinds[k].responses;
+            bytes += s.kinds[k].bytes;
+        }
+    }
+
+    auto us = [](uint64_t ns) { return ns / 1000.0; };
+    printf("  Latency (us)   p50 %9.1f   p90 %9.1f   p99 %9.1f   p99.9 %9.1f   max %9.1f\n", us(all.percentile(50)),
+           us(all.percentile(90)), us(all.percentile(99)), us(all.percentile(99.9)), us(all.max));
+    for (size_t k = 0; k < kinds.size(); ++k) {
+        const KindStats& kind = total.kinds[k];
+        printf("  %-10s %10llu responses   p50 %9.1f us   p99 %9.1f us\n", kinds[k].name.c_str(),
+               static_cast<unsigned long long>(kind.responses), us(kind.latency.percentile(50)), us(kind.latency.percentile(99)));
+    }
+    printf("  %llu responses in %.2fs, %.1f MB body\n", static_cast<unsigned long long>(responses), elapsed, bytes / 1e6);
+    printf("  Status 2xx/3xx %llu   4xx %llu   5xx %llu   errors %llu\n",
+           static_cast<unsigned long long>(total.status_2xx_3xx), static_cast<unsigned long long>(total.status_4xx),
+           static_cast<unsigned long long>(total.status_5xx), static_cast<unsigned long long>(total.errors));
+    printf("Requests/sec: %.1f\n", responses / elapsed);
+    printf("Transfer/sec: %.2f MB\n", bytes / elapsed / 1e6);
+    if (responses > 0) {
+        printf("Client CPU/request: %.2f us\n", self_cpu * 1e6 / responses);
+        if (server_cpu_before >= 0 && server_cpu_after >= 0) {
+            printf("Server CPU/request: %.2f us (%.0f%% of one core)\n", (server_cpu_after - server_cpu_before) * 1e6 / responses,
+                   (server_cpu_after - server_cpu_before) / elapsed * 100);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,427 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_HEADER_BYTES 65536
+
+// First occurrence of c in [p, end), or end. Scans 16 bytes per step with SSE2.
+inline const char* http_find_byte(const char* p, const char* end, char c) {
+#ifdef __SSE2__
+    const __m128i needle = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && *p != c) {
+        ++p;
+    }
+    return p;
+}
+
+// RFC 7230 tchar
+inline bool http_is_token_char(unsigned char c) {
+    static const bool table[256] = {
+        // 0x00-0x1f: controls
+        0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+        // ' ' ! " # $ % & ' ( ) * + , - . /
+        0,1,0,1,1,1,1,1,0,0,1,1,0,1,1,0,
+        // 0-9 : ; < = > ?
+        1,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,
+        // @ A-O
+        0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+        // P-Z [ \ ] ^ _
+        1,1,1,1,1,1,1,1,1,1,1,0,0,0,1,1,
+        // ` a-o
+        1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+        // p-z { | } ~ DEL
+        1,1,1,1,1,1,1,1,1,1,1,0,1,0,1,0,
+    };
+    return table[c];
+}
+
+inline bool http_iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+struct HttpHeader {
+    std::string_view name;
+    std::string_view value;
+};
+
+// A parsed request head. Every view points into the connection's receive buffer and is only
+// valid until that buffer is consumed; nothing here allocates.
+struct HttpRequest {
+    std::string_view method;
+    std::string_view path; // request target as sent, including any query string
+    std::string_view http_version;
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    size_t header_count = 0;
+    uint64_t content_length = 0;
+    bool chunked = false;
+
+    // Case-insensitive header lookup, returns nullptr when absent
+    const std::string_view* header(std::string_view name) const {
+        for (size_t i = 0; i < header_count; ++i) {
+            if (http_iequals(headers[i].name, name)) {
+                return &headers[i].value;
+            }
+        }
+        return nullptr;
+    }
+
+    bool has_body() const {
+        return chunked || content_length > 0;
+    }
+
+    // HTTP/1.1 defaults to keep-alive, HTTP/1.0 to close
+    bool keep_alive() const {
+        const std::string_view* connection = header("Connection");
+        if (http_version == "HTTP/1.1") {
+            return !connection || !http_iequals(*connection, "close");
+        }
+        return connection && http_iequals(*connection, "keep-alive");
+    }
+};
+
+enum class HttpParseStatus {
+    Complete,
+    Incomplete,      // need more bytes
+    BadRequest,      // 400
+    HeadersTooLarge, // 431
+    NotImplemented,  // 501: a transfer coding other than chunked
+};
+
+// Incremental request head parser. Feed it the unconsumed input each time more bytes arrive;
+// the end-of-headers scan resumes where the previous call stopped, so a head that trickles in
+// one byte at a time is still scanned only once. Call reset() after each complete request.
+class HttpRequestParser {
+public:
+    explicit HttpRequestParser(size_t max_header_bytes = HTTP_MAX_HEADER_BYTES)
+        : max_header_bytes_(max_header_bytes) {}
+
+    void reset() {
+        scanned_ = 0;
+    }
+
+    // On Complete, head_size is the number of bytes of data taken by the request head
+    HttpParseStatus parse(const char* data, size_t len, HttpRequest& req, size_t& head_size) {
+        // Tolerate empty lines before the request line (RFC 7230 section 3.5)
+        size_t start = 0;
+        while (start < len && (data[start] == '\r' || data[start] == '\n')) {
+            ++start;
+        }
+
+        const char* end = data + len;
+        const char* p = data + std::max(scanned_, start);
+        const char* head_end = nullptr;
+        while (p < end) {
+            const char* lf = http_find_byte(p, end, '\n');
+            if (lf == end) {
+                break;
+            }
+            size_t at = lf - data;
+            if (at > start && (data[at - 1] == '\n' || (at >= start + 2 && data[at - 1] == '\r' && data[at - 2] == '\n'))) {
+                head_end = lf + 1;
+                break;
+            }
+            p = lf + 1;
+        }
+
+        if (!head_end) {
+            scanned_ = len;
+            return len - start > max_header_bytes_ ? HttpParseStatus::HeadersTooLarge : HttpParseStatus::Incomplete;
+        }
+        if (static_cast<size_t>(head_end - data) - start > max_header_bytes_) {
+            return HttpParseStatus::HeadersTooLarge;
+        }
+
+        head_size = head_end - data;
+        return parse_head(data + start, head_end, req);
+    }
+
+private:
+    // Next line in [p, end) without its line terminator; p advances past the terminator
+    static std::string_view next_line(const char*& p, const char* end) {
+        const char* lf = http_find_byte(p, end, '\n');
+        const char* line_end = (lf > p && lf[-1] == '\r') ? lf - 1 : lf;
+        std::string_view line(p, line_end - p);
+        p = lf < end ? lf + 1 : end;
+        return line;
+    }
+
+    static std::string_view trim(std::string_view s) {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+            s.remove_prefix(1);
+        }
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+            s.remove_suffix(1);
+        }
+        return s;
+    }
+
+    static HttpParseStatus parse_head(const char* p, const char* end, HttpRequest& req) {
+        req.header_count = 0;
+        req.content_length = 0;
+        req.chunked = false;
+
+        // Request line: method SP request-target SP HTTP-version
+        std::string_view line = next_line(p, end);
+        size_t sp1 = line.find(' ');
+        size_t sp2 = sp1 == std::string_view::npos ? sp1 : line.find(' ', sp1 + 1);
+        if (sp1 == 0 || sp2 == std::string_view::npos || sp2 == sp1 + 1 ||
+            line.find(' ', sp2 + 1) != std::string_view::npos) {
+            return HttpParseStatus::BadRequest;
+        }
+        req.method = line.substr(0, sp1);
+        req.path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+        req.http_version = line.substr(sp2 + 1);
+        for (char c : req.method) {
+            if (!http_is_token_char(c)) {
+                return HttpParseStatus::BadRequest;
+            }
+        }
+        for (unsigned char c : req.path) {
+            if (c <= 0x20 || c == 0x7f) {
+                return HttpParseStatus::BadRequest;
+            }
+        }
+        if (req.http_version != "HTTP/1.1" && req.http_version != "HTTP/1.0") {
+            return HttpParseStatus::BadRequest;
+        }
+
+        bool has_content_length = false;
+        while (p < end) {
+            line = next_line(p, end);
+            if (line.empty()) {
+                break; // blank line ends the head
+            }
+            if (line.front() == ' ' || line.front() == '\t') {
+                return HttpParseStatus::BadRequest; // obsolete line folding
+            }
+            const char* colon = http_find_byte(line.data(), line.data() + line.size(), ':');
+            size_t name_len = colon - line.data();
+            if (name_len == 0 || name_len == line.size()) {
+                return HttpParseStatus::BadRequest;
+            }
+            std::string_view name = line.substr(0, name_len);
+            for (char c : name) {
+                if (!http_is_token_char(c)) {
+                    return HttpParseStatus::BadRequest; // includes whitespace before the colon
+                }
+            }
+            if (req.header_count == HTTP_MAX_HEADERS) {
+                return HttpParseStatus::HeadersTooLarge;
+            }
+            std::string_view value = trim(line.substr(name_len + 1));
+            req.headers[req.header_count++] = {name, value};
+
+            if (http_iequals(name, "Content-Length")) {
+                uint64_t n = 0;
+                if (value.empty() || value.size() > 18) {
+                    return HttpParseStatus::BadRequest;
+                }
+                for (char c : value) {
+                    if (c < '0' || c > '9') {
+                        return HttpParseStatus::BadRequest;
+                    }
+                    n = n * 10 + (c - '0');
+                }
+                if (has_content_length && n != req.content_length) {
+                    return HttpParseStatus::BadRequest;
+                }
+                has_content_length = true;
+                req.content_length = n;
+            } else if (http_iequals(name, "Transfer-Encoding")) {
+                // Only "chunked" as the final (and here only) coding is supported
+                if (!http_iequals(value, "chunked")) {
+                    return HttpParseStatus::NotImplemented;
+                }
+                req.chunked = true;
+            }
+        }
+
+        // Both framings at once is a request smuggling vector (RFC 7230 section 3.3.3)
+        if (req.chunked && has_content_length) {
+            return HttpParseStatus::BadRequest;
+        }
+        return HttpParseStatus::Complete;
+    }
+
+    size_t max_header_bytes_;
+    size_t scanned_ = 0; // bytes already known not to contain the end of the head
+};
+
+enum class ChunkedStatus {
+    Done,
+    NeedMore,
+    Error,
+};
+
+// Resumable decoder for a chunked request body. Payload bytes are handed to the callback as
+// views into the input, never copied; chunk extensions and trailers are skipped.
+class ChunkedDecoder {
+public:
+    void reset() {
+        state_ = State::Size;
+        remaining_ = 0;
+        size_digits_ = 0;
+    }
+
+    // The terminating chunk and trailers have been consumed
+    bool done() const {
+        return state_ == State::Finished;
+    }
+
+    // Consume as much of [data, data + len) as possible. consumed is how many bytes were used;
+    // after Done, any bytes past consumed belong to the next request.
+    template <typename F>
+    ChunkedStatus feed(const char* data, size_t len, size_t& consumed, F&& on_data) {
+        size_t i = 0;
+        while (i < len) {
+            char c = data[i];
+            switch (state_) {
+                case State::Size: {
+                    int digit = hex_value(c);
+                    if (digit >= 0) {
+                        if (++size_digits_ > 15) {
+                            return fail(consumed, i);
+                        }
+                        remaining_ = remaining_ * 16 + digit;
+                        ++i;
+                    } else if (size_digits_ == 0) {
+                        return fail(consumed, i);
+                    } else if (c == ';' || c == ' ' || c == '\t') {
+                        state_ = State::Extension;
+                        ++i;
+                    } else if (c == '\r') {
+                        state_ = State::SizeLf;
+                        ++i;
+                    } else if (c == '\n') {
+                        size_line_done();
+                        ++i;
+                    } else {
+                        return fail(consumed, i);
+                    }
+                    break;
+                }
+                case State::Extension: {
+                    const char* lf = http_find_byte(data + i, data + len, '\n');
+                    i = lf - data;
+                    if (i < len) {
+                        size_line_done();
+                        ++i;
+                    }
+                    break;
+                }
+                case State::SizeLf:
+                    if (c != '\n') {
+                        return fail(consumed, i);
+                    }
+                    size_line_done();
+                    ++i;
+                    break;
+                case State::Data: {
+                    size_t n = std::min<uint64_t>(remaining_, len - i);
+                    on_data(data + i, n);
+                    remaining_ -= n;
+                    i += n;
+                    if (remaining_ == 0) {
+                        state_ = State::DataCr;
+                    }
+                    break;
+                }
+                case State::DataCr:
+                    if (c == '\r') {
+                        state_ = State::DataLf;
+                    } else if (c == '\n') {
+                        state_ = State::Size;
+                    } else {
+                        return fail(consumed, i);
+                    }
+                    ++i;
+                    break;
+                case State::DataLf:
+                    if (c != '\n') {
+                        return fail(consumed, i);
+                    }
+                    state_ = State::Size;
+                    ++i;
+                    break;
+                case State::TrailerStart:
+                    if (c == '\r') {
+                        state_ = State::FinalLf;
+                        ++i;
+                    } else if (c == '\n') {
+                        state_ = State::Finished;
+                        consumed = i + 1;
+                        return ChunkedStatus::Done;
+                    } else {
+                        state_ = State::Trailer;
+                    }
+                    break;
+                case State::Trailer: {
+                    const char* lf = http_find_byte(data + i, data + len, '\n');
+                    i = lf - data;
+                    if (i < len) {
+                        state_ = State::TrailerStart;
+                        ++i;
+                    }
+                    break;
+                }
+                case State::FinalLf:
+                    if (c != '\n') {
+                        return fail(consumed, i);
+                    }
+                    state_ = State::Finished;
+                    consumed = i + 1;
+                    return ChunkedStatus::Done;
+                case State::Finished:
+                    consumed = i;
+                    return ChunkedStatus::Done;
+            }
+        }
+        consumed = i;
+        return state_ == State::Finished ? ChunkedStatus::Done : ChunkedStatus::NeedMore;
+    }
+
+private:
+    enum class State { Size, Extension, SizeLf, Data, DataCr, DataLf, TrailerStart, Trailer, FinalLf, Finished };
+
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    // The size line is complete: a zero size starts the trailer section
+    void size_line_done() {
+        state_ = remaining_ == 0 ? State::TrailerStart : State::Data;
+        size_digits_ = 0;
+    }
+
+    ChunkedStatus fail(size_t& consumed, size_t at) {
+        consumed = at;
+        return ChunkedStatus::Error;
+    }
+
+    State state_ = State::Size;
+    uint64_t remaining_ = 0;
+    int size_digits_ = 0;
+};
+
+#endif // HTTP_PARSER_H
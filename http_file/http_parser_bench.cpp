@@ -0,0 +1,104 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+
+#include "http_parser.h"
+
+// Parser micro-benchmark: a typical browser request parsed in one piece, in a pipelined batch,
+// and fed in small slices the way a slow client delivers it. Usage: http_parser_bench [iterations]
+
+static const std::string REQUEST =
+    "GET /images/photo-2024-05-17.jpg?size=large&format=webp HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0 Safari/537.36\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,zh-CN;q=0.8\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; tracking=off\r\n"
+    "Referer: https://www.example.com/gallery/2024/\r\n"
+    "If-None-Match: \"5f3c-63a1b2c4\"\r\n"
+    "\r\n";
+
+// Returns nanoseconds per request
+template <typename F>
+double measure(const char* name, size_t iterations, size_t bytes_per_iteration, size_t requests_per_iteration, F&& body) {
+    auto start = std::chrono::steady_clock::now();
+    size_t checksum = 0;
+    for (size_t i = 0; i < iterations; ++i) {
+        checksum += body();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double requests = static_cast<double>(iterations) * requests_per_iteration;
+    double ns = seconds * 1e9 / requests;
+    std::cout << name << ": " << ns << " ns/request, " << requests / seconds / 1e6 << " M requests/s, "
+              << static_cast<double>(iterations) * bytes_per_iteration / seconds / 1e9 << " GB/s"
+              << " (checksum " << checksum << ")" << std::endl;
+    return ns;
+}
+
+int main(int argc, char* argv[]) {
+    size_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2000000;
+
+    measure("single", iterations, REQUEST.size(), 1, [] {
+        HttpRequestParser parser;
+        HttpRequest req;
+        size_t head_size = 0;
+        if (parser.parse(REQUEST.data(), REQUEST.size(), req, head_size) != HttpParseStatus::Complete) {
+            std::cerr << "parse failed" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return req.header_count + head_size;
+    });
+
+    const size_t batch = 16;
+    std::string pipelined;
+    for (size_t i = 0; i < batch; ++i) {
+        pipelined += REQUEST;
+    }
+    measure("pipelined", iterations / batch, pipelined.size(), batch, [&] {
+        HttpRequestParser parser;
+        HttpRequest req;
+        size_t offset = 0, headers = 0;
+        while (offset < pipelined.size()) {
+            size_t head_size = 0;
+            if (parser.parse(pipelined.data() + offset, pipelined.size() - offset, req, head_size) != HttpParseStatus::Complete) {
+                std::cerr << "parse failed" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            parser.reset();
+            offset += head_size;
+            headers += req.header_count;
+        }
+        return headers;
+    });
+
+    // Slices of 64 bytes: the end-of-head scan must resume rather than restart on each arrival
+    const size_t slice = 64;
+    measure("sliced", iterations / 4, REQUEST.size(), 1, [&] {
+        HttpRequestParser parser;
+        HttpRequest req;
+        size_t head_size = 0;
+        HttpParseStatus status = HttpParseStatus::Incomplete;
+        for (size_t len = slice; status == HttpParseStatus::Incomplete; len += slice) {
+            status = parser.parse(REQUEST.data(), std::min(len, REQUEST.size()), req, head_size);
+        }
+        return req.header_count + head_size;
+    });
+
+    std::string chunked_body;
+    for (int i = 0; i < 64; ++i) {
+        chunked_body += "400\r\n" + std::string(1024, 'x') + "\r\n";
+    }
+    chunked_body += "0\r\n\r\n";
+    measure("chunked body", iterations / 64, chunked_body.size(), 1, [&] {
+        ChunkedDecoder decoder;
+        size_t consumed = 0, payload = 0;
+        decoder.feed(chunked_body.data(), chunked_body.size(), consumed, [&](const char*, size_t n) { payload += n; });
+        return payload;
+    });
+    return 0;
+}
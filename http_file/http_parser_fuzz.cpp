@@ -0,0 +1,145 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "http_parser.h"
+
+// Fuzz target for the request parser and chunked decoder.
+//   libFuzzer:  clang++ -std=c++17 -g -O1 -fsanitize=fuzzer,address,undefined http_parser_fuzz.cpp
+//   standalone: g++ -std=c++17 -DHTTP_PARSER_FUZZ_STANDALONE -fsanitize=address,undefined http_parser_fuzz.cpp
+// Besides memory errors it checks that feeding the input in two pieces gives the same result
+// as feeding it at once, which is what the resumable scan relies on.
+
+static void check(bool condition, const char* what) {
+    if (!condition) {
+        fprintf(stderr, "invariant violated: %s\n", what);
+        abort();
+    }
+}
+
+static bool same_request(const HttpRequest& a, const HttpRequest& b) {
+    if (a.method != b.method || a.path != b.path || a.http_version != b.http_version ||
+        a.header_count != b.header_count || a.content_length != b.content_length || a.chunked != b.chunked) {
+        return false;
+    }
+    for (size_t i = 0; i < a.header_count; ++i) {
+        if (a.headers[i].name != b.headers[i].name || a.headers[i].value != b.headers[i].value) {
+            return false;
+        }
+    }
+    return true;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    // Copy into an exactly sized heap buffer so any over-read is caught by ASan
+    char* buf = static_cast<char*>(malloc(size ? size : 1));
+    memcpy(buf, data, size);
+
+    HttpRequestParser whole(4096);
+    HttpRequest req;
+    size_t head_size = 0;
+    HttpParseStatus status = whole.parse(buf, size, req, head_size);
+
+    if (status == HttpParseStatus::Complete) {
+        check(head_size <= size, "head size within input");
+        check(req.header_count <= HTTP_MAX_HEADERS, "header count bounded");
+        for (size_t i = 0; i < req.header_count; ++i) {
+            check(!req.headers[i].name.empty(), "non-empty header name");
+            check(req.headers[i].name.data() >= buf && req.headers[i].value.data() + req.headers[i].value.size() <= buf + size,
+                  "header views inside input");
+        }
+    }
+
+    // Same input delivered as a prefix, then in full
+    size_t split = size ? data[0] % (size + 1) : 0;
+    HttpRequestParser pieces(4096);
+    HttpRequest req2;
+    size_t head_size2 = 0;
+    HttpParseStatus first = pieces.parse(buf, split, req2, head_size2);
+    if (first == HttpParseStatus::Incomplete) {
+        HttpParseStatus second = pieces.parse(buf, size, req2, head_size2);
+        check(second == status, "split parse status matches");
+        if (status == HttpParseStatus::Complete) {
+            check(head_size2 == head_size && same_request(req, req2), "split parse result matches");
+        }
+    }
+
+    // Whatever follows the head, treated as a chunked body, at once and byte by byte
+    size_t body_offset = status == HttpParseStatus::Complete ? head_size : 0;
+    ChunkedDecoder at_once;
+    size_t consumed = 0, payload = 0;
+    ChunkedStatus chunked = at_once.feed(buf + body_offset, size - body_offset, consumed,
+                                         [&](const char* p, size_t n) {
+                                             check(p >= buf && p + n <= buf + size, "payload inside input");
+                                             payload += n;
+                                         });
+    check(consumed <= size - body_offset, "chunked consumed within input");
+
+    ChunkedDecoder bytewise;
+    size_t payload2 = 0;
+    ChunkedStatus chunked2 = ChunkedStatus::NeedMore;
+    size_t offset = body_offset;
+    while (offset < size && chunked2 == ChunkedStatus::NeedMore) {
+        size_t used = 0;
+        chunked2 = bytewise.feed(buf + offset, 1, used, [&](const char*, size_t n) { payload2 += n; });
+        offset += used;
+    }
+    if (chunked != ChunkedStatus::NeedMore) {
+        check(chunked2 == chunked, "bytewise chunked status matches");
+    }
+    if (chunked == ChunkedStatus::Done) {
+        check(payload2 == payload && offset - body_offset == consumed, "bytewise chunked result matches");
+    }
+
+    free(buf);
+    return 0;
+}
+
+#ifdef HTTP_PARSER_FUZZ_STANDALONE
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+// Without libFuzzer: run the files given on the command line, or random mutations of a seed corpus
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            std::ifstream in(argv[i], std::ios::binary);
+            std::stringstream ss;
+            ss << in.rdbuf();
+            std::string input = ss.str();
+            LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(input.data()), input.size());
+        }
+        return 0;
+    }
+
+    const std::vector<std::string> seeds = {
+        "GET / HTTP/1.1\r\nHost: a\r\n\r\n",
+        "GET /x?page=2 HTTP/1.0\r\nConnection: keep-alive\r\nRange: bytes=0-9,20-\r\n\r\n",
+        "POST /up HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5;ext=1\r\nhello\r\n0\r\nTrailer: x\r\n\r\n",
+        "PUT /f HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\nhello",
+        "\r\n\nGET / HTTP/1.1\n\n",
+    };
+    const char alphabet[] = "\r\n :;-0123456789abcdefHTTP/1.GETchunked\t";
+    std::mt19937 rng(12345);
+    for (int iteration = 0; iteration < 2000000; ++iteration) {
+        std::string input = seeds[rng() % seeds.size()];
+        int mutations = 1 + rng() % 4;
+        for (int m = 0; m < mutations; ++m) {
+            size_t pos = input.empty() ? 0 : rng() % input.size();
+            switch (rng() % 4) {
+                case 0: if (!input.empty()) input.erase(pos, 1 + rng() % 4); break;
+                case 1: input.insert(pos, 1, alphabet[rng() % (sizeof(alphabet) - 1)]); break;
+                case 2: if (!input.empty()) input[pos] = static_cast<char>(rng()); break;
+                case 3: input.insert(pos, input.substr(rng() % (input.size() + 1), rng() % 16)); break;
+            }
+        }
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(input.data()), input.size());
+    }
+    std::cout << "standalone fuzzing finished without findings" << std::endl;
+    return 0;
+}
+#endif
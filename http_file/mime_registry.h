@@ -0,0 +1,277 @@
+#ifndef MIME_REGISTRY_H
+#define MIME_REGISTRY_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+
+#define DEFAULT_MIME_TYPE "application/octet-stream"
+
+// Extension (lowercase, without the dot) to MIME type
+struct MimeMapping {
+    std::string_view extension;
+    std::string_view type;
+};
+
+// Types known without a mime.types file
+constexpr MimeMapping BUILTIN_MIME_TYPES[] = {
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"png", "image/png"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"svg", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"mp4", "video/mp4"},
+    {"m4s", "video/iso.segment"},
+    {"webm", "video/webm"},
+    {"mp3", "audio/mpeg"},
+    {"m3u8", "application/vnd.apple.mpegurl"},
+    {"mpd", "application/dash+xml"},
+    {"txt", "text/plain"},
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "application/javascript"},
+    {"json", "application/json"},
+    {"xml", "application/xml"},
+    {"pdf", "application/pdf"},
+    {"wasm", "application/wasm"},
+    {"woff2", "font/woff2"},
+    {"zip", "application/zip"},
+};
+
+constexpr char ascii_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+constexpr bool ascii_iequals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (ascii_lower(a[i]) != ascii_lower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Case-insensitive FNV-1a with a seed and a final mix, so different seeds give unrelated hashes
+constexpr uint32_t mime_hash(std::string_view key, uint32_t seed) {
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (char c : key) {
+        h ^= static_cast<unsigned char>(ascii_lower(c));
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+constexpr size_t next_power_of_two(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+#define MIME_MAX_BUCKET_SIZE 32
+
+// Hash-and-displace perfect hash construction. Keys are split into buckets by mime_hash(key, 0);
+// buckets are placed largest first, each searching for a seed that sends all of its keys to free
+// slots. Lookup is then two hashes and one comparison: slots[mime_hash(key, seeds[bucket]) & mask].
+// Written against indexable containers so the same code builds the constexpr built-in table and
+// the table loaded from mime.types at runtime. slots hold key index + 1, 0 meaning empty.
+template <typename Mappings, typename Seeds, typename Slots>
+constexpr bool build_perfect_hash(const Mappings& mappings, size_t count, Seeds& seeds, size_t bucket_count,
+                                  Slots& slots, size_t slot_count) {
+    size_t max_bucket_size = 0;
+    for (size_t b = 0; b < bucket_count; ++b) {
+        size_t size = 0;
+        for (size_t i = 0; i < count; ++i) {
+            size += mime_hash(mappings[i].extension, 0) % bucket_count == b;
+        }
+        max_bucket_size = size > max_bucket_size ? size : max_bucket_size;
+    }
+    if (max_bucket_size > MIME_MAX_BUCKET_SIZE) {
+        return false;
+    }
+
+    for (size_t size = max_bucket_size; size > 0; --size) {
+        for (size_t b = 0; b < bucket_count; ++b) {
+            size_t members[MIME_MAX_BUCKET_SIZE] = {};
+            size_t member_count = 0;
+            for (size_t i = 0; i < count && member_count <= size; ++i) {
+                if (mime_hash(mappings[i].extension, 0) % bucket_count == b) {
+                    if (member_count < size) {
+                        members[member_count] = i;
+                    }
+                    ++member_count;
+                }
+            }
+            if (member_count != size) {
+                continue;
+            }
+
+            uint32_t seed = 1;
+            for (; seed < (1u << 20); ++seed) {
+                size_t placed[MIME_MAX_BUCKET_SIZE] = {};
+                bool ok = true;
+                for (size_t m = 0; m < size && ok; ++m) {
+                    placed[m] = mime_hash(mappings[members[m]].extension, seed) & (slot_count - 1);
+                    ok = slots[placed[m]] == 0;
+                    for (size_t k = 0; k < m && ok; ++k) {
+                        ok = placed[k] != placed[m];
+                    }
+                }
+                if (ok) {
+                    seeds[b] = seed;
+                    for (size_t m = 0; m < size; ++m) {
+                        slots[placed[m]] = static_cast<uint32_t>(members[m] + 1);
+                    }
+                    break;
+                }
+            }
+            if (seed == (1u << 20)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The built-in table, hashed at compile time
+template <size_t N>
+struct StaticMimeTable {
+    static constexpr size_t BUCKETS = N;
+    static constexpr size_t SLOTS = next_power_of_two(2 * N);
+
+    uint32_t seeds[BUCKETS] = {};
+    uint32_t slots[SLOTS] = {};
+    bool built = false;
+
+    constexpr StaticMimeTable(const MimeMapping (&mappings)[N]) {
+        built = build_perfect_hash(mappings, N, seeds, BUCKETS, slots, SLOTS);
+    }
+};
+
+constexpr StaticMimeTable<sizeof(BUILTIN_MIME_TYPES) / sizeof(BUILTIN_MIME_TYPES[0])> BUILTIN_MIME_TABLE(BUILTIN_MIME_TYPES);
+static_assert(BUILTIN_MIME_TABLE.built, "no perfect hash found for the built-in MIME types");
+
+// MIME type lookup by file extension: the compile-time table, or once load() succeeded a table
+// rebuilt at startup from a mime.types file plus the built-ins it doesn't mention. Lookups never
+// allocate; load() must finish before lookups start on other threads.
+class MimeRegistry {
+public:
+    // Parse an Apache/nginx-style mime.types file ("type ext1 ext2 ...", '#' comments).
+    // The first mapping of an extension wins.
+    bool load(const std::string& path) {
+        std::ifstream in(path);
+        if (!in) {
+            return false;
+        }
+
+        // Keep all text in one arena so the views stay valid; offsets until it stops growing
+        std::string arena;
+        std::vector<std::pair<size_t, size_t>> ext_spans, type_spans;
+        std::set<std::string> seen;
+        auto add = [&](const std::string& ext, const std::string& type) {
+            std::string key;
+            for (char c : ext) {
+                key += ascii_lower(c);
+            }
+            if (key.empty() || !seen.insert(key).second) {
+                return;
+            }
+            ext_spans.emplace_back(arena.size(), key.size());
+            arena += key;
+            type_spans.emplace_back(arena.size(), type.size());
+            arena += type;
+        };
+
+        std::string line;
+        while (std::getline(in, line)) {
+            line = line.substr(0, line.find('#'));
+            std::vector<std::string> words;
+            size_t pos = 0;
+            while ((pos = line.find_first_not_of(" \t;\r", pos)) != std::string::npos) {
+                size_t end = line.find_first_of(" \t;\r", pos);
+                words.push_back(line.substr(pos, end == std::string::npos ? std::string::npos : end - pos));
+                pos = end;
+            }
+            if (words.size() < 2 || words[0].find('/') == std::string::npos) {
+                continue; // blank line, or nginx's "types {" / "}"
+            }
+            for (size_t i = 1; i < words.size(); ++i) {
+                add(words[i], words[0]);
+            }
+        }
+        for (const MimeMapping& builtin : BUILTIN_MIME_TYPES) {
+            add(std::string(builtin.extension), std::string(builtin.type));
+        }
+
+        arena_ = std::move(arena);
+        entries_.clear();
+        for (size_t i = 0; i < ext_spans.size(); ++i) {
+            entries_.push_back({std::string_view(arena_).substr(ext_spans[i].first, ext_spans[i].second),
+                                std::string_view(arena_).substr(type_spans[i].first, type_spans[i].second)});
+        }
+
+        // A load factor of 1/2 with buckets of about four keys places every bucket quickly
+        bucket_count_ = entries_.size() / 4 + 1;
+        for (slot_count_ = next_power_of_two(2 * entries_.size()); ; slot_count_ *= 2) {
+            seeds_.assign(bucket_count_, 0);
+            slots_.assign(slot_count_, 0);
+            if (build_perfect_hash(entries_, entries_.size(), seeds_, bucket_count_, slots_, slot_count_)) {
+                break;
+            }
+        }
+        loaded_ = true;
+        return true;
+    }
+
+    size_t size() const {
+        return loaded_ ? entries_.size() : sizeof(BUILTIN_MIME_TYPES) / sizeof(BUILTIN_MIME_TYPES[0]);
+    }
+
+    // MIME type of a file name or path, DEFAULT_MIME_TYPE for unknown extensions
+    std::string_view lookup(std::string_view filename) const {
+        size_t dot = filename.find_last_of("./");
+        if (dot == std::string_view::npos || filename[dot] != '.') {
+            return DEFAULT_MIME_TYPE;
+        }
+        std::string_view ext = filename.substr(dot + 1);
+        const MimeMapping* mapping = loaded_ ? find(ext, entries_.data(), seeds_.data(), bucket_count_, slots_.data(), slot_count_)
+                                             : find(ext, BUILTIN_MIME_TYPES, BUILTIN_MIME_TABLE.seeds, BUILTIN_MIME_TABLE.BUCKETS,
+                                                    BUILTIN_MIME_TABLE.slots, BUILTIN_MIME_TABLE.SLOTS);
+        return mapping ? mapping->type : DEFAULT_MIME_TYPE;
+    }
+
+private:
+    static const MimeMapping* find(std::string_view ext, const MimeMapping* mappings, const uint32_t* seeds,
+                                   size_t bucket_count, const uint32_t* slots, size_t slot_count) {
+        uint32_t seed = seeds[mime_hash(ext, 0) % bucket_count];
+        uint32_t index = slots[mime_hash(ext, seed) & (slot_count - 1)];
+        if (index == 0 || !ascii_iequals(mappings[index - 1].extension, ext)) {
+            return nullptr;
+        }
+        return &mappings[index - 1];
+    }
+
+    bool loaded_ = false;
+    std::string arena_;
+    std::vector<MimeMapping> entries_;
+    std::vector<uint32_t> seeds_;
+    std::vector<uint32_t> slots_;
+    size_t bucket_count_ = 1;
+    size_t slot_count_ = 1;
+};
+
+#endif // MIME_REGISTRY_H
@@ -0,0 +1,1089 @@
+#ifndef MP4_INDEX_H
+#define MP4_INDEX_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cctype>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "output_queue.h"
+
+#define MP4_SEGMENT_DURATION 4               // Seconds aimed for per segment, cut at the next keyframe
+// Indexing runs on the reactor of the first request, these bound how long it can stall it.
+// A two-hour film's moov is a few MiB and a few hundred thousand samples per track.
+#define MP4_MAX_HEADER_SIZE (8 * 1024 * 1024) // Larger moov (or moof) boxes are not indexed
+#define MP4_MAX_SAMPLES (1024 * 1024)         // Samples per track
+#define MP4_INDEX_CACHE_ENTRIES 64           // Indexed files kept in memory
+
+constexpr uint32_t mp4_fourcc(const char* s) {
+    return static_cast<uint32_t>(static_cast<uint8_t>(s[0])) << 24 | static_cast<uint32_t>(static_cast<uint8_t>(s[1])) << 16 |
+           static_cast<uint32_t>(static_cast<uint8_t>(s[2])) << 8 | static_cast<uint8_t>(s[3]);
+}
+
+// Big-endian fields of a box payload. Reading past the end clears ok() and yields zeros,
+// so a parser checks once after a run of reads instead of before each one.
+class Mp4Reader {
+public:
+    Mp4Reader(const uint8_t* data, size_t size) : p_(data), end_(data + size) {}
+
+    uint8_t u8() {
+        return static_cast<uint8_t>(read(1));
+    }
+    uint16_t u16() {
+        return static_cast<uint16_t>(read(2));
+    }
+    uint32_t u32() {
+        return static_cast<uint32_t>(read(4));
+    }
+    uint64_t u64() {
+        return read(8);
+    }
+
+    void skip(size_t n) {
+        if (n > left()) {
+            ok_ = false;
+            p_ = end_;
+        } else {
+            p_ += n;
+        }
+    }
+
+    size_t left() const {
+        return static_cast<size_t>(end_ - p_);
+    }
+
+    bool ok() const {
+        return ok_;
+    }
+
+private:
+    uint64_t read(size_t n) {
+        if (n > left()) {
+            ok_ = false;
+            p_ = end_;
+            return 0;
+        }
+        uint64_t value = 0;
+        for (size_t i = 0; i < n; ++i) {
+            value = value << 8 | *p_++;
+        }
+        return value;
+    }
+
+    const uint8_t* p_;
+    const uint8_t* end_;
+    bool ok_ = true;
+};
+
+// A box inside a buffer: start and size include the header
+struct Mp4Box {
+    uint32_t type = 0;
+    const uint8_t* start = nullptr;
+    size_t size = 0;
+    const uint8_t* payload = nullptr;
+    size_t payload_size = 0;
+
+    explicit operator bool() const {
+        return start != nullptr;
+    }
+};
+
+// Call f for each box in data, in order; stops at a header that doesn't fit
+template <typename F>
+void mp4_for_each(const uint8_t* data, size_t size, F f) {
+    size_t pos = 0;
+    while (size - pos >= 8) {
+        Mp4Reader reader(data + pos, size - pos);
+        uint64_t box_size = reader.u32();
+        uint32_t type = reader.u32();
+        size_t header = 8;
+        if (box_size == 1) {
+            box_size = reader.u64();
+            header = 16;
+        } else if (box_size == 0) {
+            box_size = size - pos;
+        }
+        if (!reader.ok() || box_size < header || box_size > size - pos) {
+            return;
+        }
+        Mp4Box box;
+        box.type = type;
+        box.start = data + pos;
+        box.size = static_cast<size_t>(box_size);
+        box.payload = box.start + header;
+        box.payload_size = box.size - header;
+        f(box);
+        pos += box.size;
+    }
+}
+
+inline Mp4Box mp4_find(const uint8_t* data, size_t size, uint32_t type) {
+    Mp4Box found;
+    mp4_for_each(data, size, [&](const Mp4Box& box) {
+        if (!found && box.type == type) {
+            found = box;
+        }
+    });
+    return found;
+}
+
+inline Mp4Box mp4_find(const Mp4Box& parent, uint32_t type) {
+    return parent ? mp4_find(parent.payload, parent.payload_size, type) : Mp4Box();
+}
+
+// Appends boxes to a byte string; a box's size is filled in when it is closed
+class Mp4Writer {
+public:
+    size_t open(uint32_t type) {
+        size_t at = out.size();
+        u32(0);
+        u32(type);
+        return at;
+    }
+
+    size_t open_full(uint32_t type, uint8_t version, uint32_t flags) {
+        size_t at = open(type);
+        u32(static_cast<uint32_t>(version) << 24 | flags);
+        return at;
+    }
+
+    void close(size_t at) {
+        patch32(at, static_cast<uint32_t>(out.size() - at));
+    }
+
+    void u8(uint8_t v) {
+        out.push_back(static_cast<char>(v));
+    }
+    void u32(uint32_t v) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            out.push_back(static_cast<char>(v >> shift));
+        }
+    }
+    void u64(uint64_t v) {
+        u32(static_cast<uint32_t>(v >> 32));
+        u32(static_cast<uint32_t>(v));
+    }
+
+    void box(const Mp4Box& box) {
+        out.append(reinterpret_cast<const char*>(box.start), box.size);
+    }
+
+    void patch32(size_t at, uint32_t v) {
+        for (int i = 0; i < 4; ++i) {
+            out[at + i] = static_cast<char>(v >> (24 - 8 * i));
+        }
+    }
+
+    std::string out;
+};
+
+// One fragment listed by the manifests. A fragmented file is served as it is, the fragment
+// being its moof and mdat boxes. For a progressive file it is a generated header (moof and
+// mdat header) followed by the fragment's sample bytes, which stay where they are in the file.
+struct Mp4Segment {
+    uint64_t start = 0;    // decode time, in the index timescale
+    uint64_t duration = 0;
+    uint64_t offset = 0;   // file bytes of the fragment
+    uint64_t length = 0;
+    std::string header;    // progressive files only
+
+    uint64_t size() const {
+        return header.size() + length;
+    }
+};
+
+// Segment index of one version of an MP4 file, with the HLS and DASH manifests built from it
+struct Mp4Index {
+    ino_t ino = 0;
+    off_t size = 0;
+    struct timespec mtime = {};
+    uint32_t timescale = 0;  // of segment times: the reference (first video) track's
+    bool fragmented = false;
+    uint64_t init_length = 0; // fragmented: ftyp and moov, the first bytes of the file
+    std::shared_ptr<const std::string> init; // progressive: generated ftyp and moov
+    std::vector<Mp4Segment> segments; // empty: not an MP4 that can be indexed
+    std::shared_ptr<const std::string> hls;
+    std::shared_ptr<const std::string> dash;
+
+    bool describes(const struct stat& st) const {
+        return ino == st.st_ino && size == st.st_size && mtime.tv_sec == st.st_mtim.tv_sec &&
+               mtime.tv_nsec == st.st_mtim.tv_nsec;
+    }
+};
+
+// A track of the moov box, with its sample tables expanded to one entry per sample. The
+// boxes point into the moov buffer and are copied into a generated init segment as they are.
+struct Mp4Track {
+    uint32_t id = 0;
+    uint32_t handler = 0;   // 'vide', 'soun', ...
+    uint32_t timescale = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t default_duration = 0; // trex, for fragments that don't give one
+    std::string codec;      // RFC 6381 codecs parameter
+    Mp4Box tkhd, edts, mdhd, hdlr, media_header, dinf, stsd;
+    // Per sample, in decode order
+    std::vector<uint32_t> sizes;
+    std::vector<uint64_t> offsets;
+    std::vector<uint64_t> times;     // decode time
+    std::vector<uint32_t> durations;
+    std::vector<int32_t> composition_offsets; // empty without ctts
+    std::vector<bool> sync;                   // empty: every sample is a sync sample
+
+    bool is_sync(size_t i) const {
+        return sync.empty() || sync[i];
+    }
+};
+
+// Codecs parameter from the first sample description: avc1/avc3 profile and level from avcC,
+// mp4a object and audio object type from esds; other formats are named by their four-cc only
+inline std::string mp4_codec(const Mp4Box& stsd) {
+    Mp4Box entry;
+    if (stsd.payload_size > 8) {
+        mp4_for_each(stsd.payload + 8, stsd.payload_size - 8, [&](const Mp4Box& box) {
+            if (!entry) {
+                entry = box;
+            }
+        });
+    }
+    if (!entry) {
+        return "";
+    }
+    char name[5] = {static_cast<char>(entry.type >> 24), static_cast<char>(entry.type >> 16),
+                    static_cast<char>(entry.type >> 8), static_cast<char>(entry.type), 0};
+    char codec[32];
+    if ((entry.type == mp4_fourcc("avc1") || entry.type == mp4_fourcc("avc3")) && entry.payload_size > 78) {
+        Mp4Box avcc = mp4_find(entry.payload + 78, entry.payload_size - 78, mp4_fourcc("avcC"));
+        if (avcc && avcc.payload_size >= 4) {
+            snprintf(codec, sizeof(codec), "%s.%02x%02x%02x", name, avcc.payload[1], avcc.payload[2], avcc.payload[3]);
+            return codec;
+        }
+    }
+    if (entry.type == mp4_fourcc("mp4a") && entry.payload_size > 28) {
+        // QuickTime sound descriptions of version 1 and 2 carry extra fields before the children
+        uint16_t version = static_cast<uint16_t>(entry.payload[8] << 8 | entry.payload[9]);
+        size_t children = 28 + (version == 1 ? 16 : version == 2 ? 36 : 0);
+        Mp4Box esds = children < entry.payload_size
+            ? mp4_find(entry.payload + children, entry.payload_size - children, mp4_fourcc("esds")) : Mp4Box();
+        if (esds && esds.payload_size > 4) {
+            // Descriptors: tag, size in 7-bit groups, body. ES_Descriptor > DecoderConfig > DecoderSpecificInfo
+            Mp4Reader reader(esds.payload + 4, esds.payload_size - 4);
+            auto descriptor = [&reader](uint8_t tag) {
+                if (reader.u8() != tag) {
+                    return false;
+                }
+                for (int i = 0; i < 4 && (reader.u8() & 0x80); ++i) {
+                }
+                return reader.ok();
+            };
+            if (descriptor(0x03)) {
+                reader.skip(2);
+                uint8_t flags = reader.u8();
+                if (flags & 0x80) {
+                    reader.skip(2);
+                }
+                if (flags & 0x40) {
+                    reader.skip(reader.u8());
+                }
+                if (flags & 0x20) {
+                    reader.skip(2);
+                }
+                if (descriptor(0x04)) {
+                    uint8_t object_type = reader.u8();
+                    reader.skip(12);
+                    if (object_type == 0x40 && descriptor(0x05)) {
+                        uint8_t first = reader.u8();
+                        int audio_object_type = first >> 3;
+                        if (audio_object_type == 31) {
+                            audio_object_type = 32 + ((first & 0x07) << 3 | reader.u8() >> 5);
+                        }
+                        if (reader.ok()) {
+                            snprintf(codec, sizeof(codec), "mp4a.40.%d", audio_object_type);
+                            return codec;
+                        }
+                    } else if (reader.ok()) {
+                        snprintf(codec, sizeof(codec), "mp4a.%02x", object_type);
+                        return codec;
+                    }
+                }
+            }
+        }
+    }
+    return name;
+}
+
+// Expand the sample tables of stbl into per-sample vectors; false if they are malformed
+inline bool mp4_read_samples(const Mp4Box& stbl, Mp4Track& track) {
+    Mp4Box stsz = mp4_find(stbl, mp4_fourcc("stsz"));
+    Mp4Box stts = mp4_find(stbl, mp4_fourcc("stts"));
+    Mp4Box stsc = mp4_find(stbl, mp4_fourcc("stsc"));
+    Mp4Box stco = mp4_find(stbl, mp4_fourcc("stco"));
+    Mp4Box co64 = mp4_find(stbl, mp4_fourcc("co64"));
+    if (!stsz || !stts || !stsc || (!stco && !co64)) {
+        return false;
+    }
+
+    Mp4Reader sizes(stsz.payload, stsz.payload_size);
+    sizes.skip(4);
+    uint32_t sample_size = sizes.u32();
+    uint32_t count = sizes.u32();
+    if (!sizes.ok() || count > MP4_MAX_SAMPLES || (sample_size == 0 && sizes.left() / 4 < count)) {
+        return false;
+    }
+    track.sizes.resize(count, sample_size);
+    for (uint32_t i = 0; sample_size == 0 && i < count; ++i) {
+        track.sizes[i] = sizes.u32();
+    }
+
+    Mp4Reader deltas(stts.payload, stts.payload_size);
+    deltas.skip(4);
+    uint32_t entries = deltas.u32();
+    track.times.reserve(count);
+    track.durations.reserve(count);
+    uint64_t time = 0;
+    for (uint32_t i = 0; i < entries && deltas.ok() && track.times.size() < count; ++i) {
+        uint32_t run = deltas.u32();
+        uint32_t delta = deltas.u32();
+        for (uint32_t j = 0; j < run && track.times.size() < count; ++j) {
+            track.times.push_back(time);
+            track.durations.push_back(delta);
+            time += delta;
+        }
+    }
+    if (!deltas.ok() || track.times.size() != count) {
+        return false;
+    }
+
+    if (Mp4Box ctts = mp4_find(stbl, mp4_fourcc("ctts"))) {
+        // Version 0 offsets are unsigned on paper, but negative ones are written that way too
+        Mp4Reader offsets(ctts.payload, ctts.payload_size);
+        offsets.skip(4);
+        entries = offsets.u32();
+        track.composition_offsets.reserve(count);
+        for (uint32_t i = 0; i < entries && offsets.ok() && track.composition_offsets.size() < count; ++i) {
+            uint32_t run = offsets.u32();
+            int32_t offset = static_cast<int32_t>(offsets.u32());
+            for (uint32_t j = 0; j < run && track.composition_offsets.size() < count; ++j) {
+                track.composition_offsets.push_back(offset);
+            }
+        }
+        track.composition_offsets.resize(count, 0);
+    }
+
+    if (Mp4Box stss = mp4_find(stbl, mp4_fourcc("stss"))) {
+        Mp4Reader syncs(stss.payload, stss.payload_size);
+        syncs.skip(4);
+        entries = syncs.u32();
+        track.sync.assign(count, false);
+        for (uint32_t i = 0; i < entries && syncs.ok(); ++i) {
+            uint32_t sample = syncs.u32();
+            if (sample >= 1 && sample <= count) {
+                track.sync[sample - 1] = true;
+            }
+        }
+    }
+
+    // Chunk offsets, then the samples of each chunk laid out back to back from its offset
+    std::vector<uint64_t> chunks;
+    Mp4Reader chunk_offsets(co64 ? co64.payload : stco.payload, co64 ? co64.payload_size : stco.payload_size);
+    chunk_offsets.skip(4);
+    uint32_t chunk_count = chunk_offsets.u32();
+    if (chunk_offsets.left() / (co64 ? 8 : 4) < chunk_count) {
+        return false;
+    }
+    chunks.reserve(chunk_count);
+    for (uint32_t i = 0; i < chunk_count; ++i) {
+        chunks.push_back(co64 ? chunk_offsets.u64() : chunk_offsets.u32());
+    }
+
+    Mp4Reader runs(stsc.payload, stsc.payload_size);
+    runs.skip(4);
+    entries = runs.u32();
+    if (!runs.ok() || runs.left() / 12 < entries) {
+        return false;
+    }
+    track.offsets.reserve(count);
+    for (uint32_t i = 0; i < entries; ++i) {
+        uint32_t first_chunk = runs.u32();
+        uint32_t per_chunk = runs.u32();
+        runs.skip(4); // sample description index, only the first description is used
+        Mp4Reader next = runs;
+        uint32_t end_chunk = i + 1 < entries ? next.u32() : chunk_count + 1;
+        if (first_chunk == 0 || end_chunk > chunk_count + 1) {
+            return false;
+        }
+        for (uint32_t chunk = first_chunk; chunk < end_chunk; ++chunk) {
+            uint64_t offset = chunks[chunk - 1];
+            for (uint32_t j = 0; j < per_chunk && track.offsets.size() < count; ++j) {
+                track.offsets.push_back(offset);
+                offset += track.sizes[track.offsets.size() - 1];
+            }
+        }
+    }
+    return track.offsets.size() == count;
+}
+
+// The tracks of a moov box; with_samples also expands their sample tables
+inline bool mp4_read_tracks(const Mp4Box& moov, bool with_samples, std::vector<Mp4Track>& tracks) {
+    Mp4Box mvex = mp4_find(moov, mp4_fourcc("mvex"));
+    bool ok = true;
+    mp4_for_each(moov.payload, moov.payload_size, [&](const Mp4Box& trak) {
+        if (trak.type != mp4_fourcc("trak") || !ok) {
+            return;
+        }
+        Mp4Track track;
+        Mp4Box mdia = mp4_find(trak, mp4_fourcc("mdia"));
+        Mp4Box minf = mp4_find(mdia, mp4_fourcc("minf"));
+        Mp4Box stbl = mp4_find(minf, mp4_fourcc("stbl"));
+        track.tkhd = mp4_find(trak, mp4_fourcc("tkhd"));
+        track.edts = mp4_find(trak, mp4_fourcc("edts"));
+        track.mdhd = mp4_find(mdia, mp4_fourcc("mdhd"));
+        track.hdlr = mp4_find(mdia, mp4_fourcc("hdlr"));
+        track.dinf = mp4_find(minf, mp4_fourcc("dinf"));
+        track.stsd = mp4_find(stbl, mp4_fourcc("stsd"));
+        for (const char* type : {"vmhd", "smhd", "sthd", "nmhd", "hmhd"}) {
+            if (!track.media_header) {
+                track.media_header = mp4_find(minf, mp4_fourcc(type));
+            }
+        }
+        if (!track.tkhd || !track.mdhd || !track.hdlr || !track.media_header || !track.dinf || !track.stsd) {
+            ok = false;
+            return;
+        }
+
+        Mp4Reader tkhd(track.tkhd.payload, track.tkhd.payload_size);
+        uint8_t version = tkhd.u8();
+        tkhd.skip(3 + (version == 1 ? 16 : 8));
+        track.id = tkhd.u32();
+        if (track.tkhd.payload_size >= 8) {
+            Mp4Reader size(track.tkhd.payload + track.tkhd.payload_size - 8, 8);
+            track.width = size.u32() >> 16;
+            track.height = size.u32() >> 16;
+        }
+        Mp4Reader mdhd(track.mdhd.payload, track.mdhd.payload_size);
+        version = mdhd.u8();
+        mdhd.skip(3 + (version == 1 ? 16 : 8));
+        track.timescale = mdhd.u32();
+        Mp4Reader hdlr(track.hdlr.payload, track.hdlr.payload_size);
+        hdlr.skip(8);
+        track.handler = hdlr.u32();
+        if (!tkhd.ok() || !mdhd.ok() || !hdlr.ok() || track.timescale == 0) {
+            ok = false;
+            return;
+        }
+        mp4_for_each(mvex.payload, mvex ? mvex.payload_size : 0, [&](const Mp4Box& trex) {
+            Mp4Reader reader(trex.payload, trex.payload_size);
+            reader.skip(4);
+            if (trex.type == mp4_fourcc("trex") && reader.u32() == track.id) {
+                reader.skip(4);
+                track.default_duration = reader.u32();
+            }
+        });
+        track.codec = mp4_codec(track.stsd);
+        if (with_samples && !mp4_read_samples(stbl, track)) {
+            ok = false;
+            return;
+        }
+        tracks.push_back(std::move(track));
+    });
+    return ok && !tracks.empty();
+}
+
+// Segments are timed and cut on the first video track, or the first track of an audio file
+inline size_t mp4_reference_track(const std::vector<Mp4Track>& tracks) {
+    for (size_t i = 0; i < tracks.size(); ++i) {
+        if (tracks[i].handler == mp4_fourcc("vide")) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+// ftyp and moov of a fragmented rendition of a progressive file: the original track
+// descriptions with empty sample tables, plus mvex announcing that fragments follow
+inline std::string mp4_init_segment(const Mp4Box& moov, const std::vector<Mp4Track>& tracks) {
+    Mp4Writer w;
+    size_t ftyp = w.open(mp4_fourcc("ftyp"));
+    w.u32(mp4_fourcc("iso6"));
+    w.u32(0);
+    for (const char* brand : {"iso6", "iso5", "mp41"}) {
+        w.u32(mp4_fourcc(brand));
+    }
+    w.close(ftyp);
+
+    size_t box = w.open(mp4_fourcc("moov"));
+    Mp4Box mvhd = mp4_find(moov, mp4_fourcc("mvhd"));
+    w.box(mvhd);
+    for (const Mp4Track& track : tracks) {
+        size_t trak = w.open(mp4_fourcc("trak"));
+        w.box(track.tkhd);
+        if (track.edts) {
+            w.box(track.edts);
+        }
+        size_t mdia = w.open(mp4_fourcc("mdia"));
+        w.box(track.mdhd);
+        w.box(track.hdlr);
+        size_t minf = w.open(mp4_fourcc("minf"));
+        w.box(track.media_header);
+        w.box(track.dinf);
+        size_t stbl = w.open(mp4_fourcc("stbl"));
+        w.box(track.stsd);
+        for (const char* type : {"stts", "stsc", "stco"}) {
+            size_t empty = w.open_full(mp4_fourcc(type), 0, 0);
+            w.u32(0);
+            w.close(empty);
+        }
+        size_t stsz = w.open_full(mp4_fourcc("stsz"), 0, 0);
+        w.u64(0); // sample size, sample count
+        w.close(stsz);
+        w.close(stbl);
+        w.close(minf);
+        w.close(mdia);
+        w.close(trak);
+    }
+    size_t mvex = w.open(mp4_fourcc("mvex"));
+    for (const Mp4Track& track : tracks) {
+        size_t trex = w.open_full(mp4_fourcc("trex"), 0, 0);
+        w.u32(track.id);
+        w.u32(1); // sample description index
+        w.u32(0); // duration, size and flags are given per sample
+        w.u32(0);
+        w.u32(0);
+        w.close(trex);
+    }
+    w.close(mvex);
+    w.close(box);
+    return std::move(w.out);
+}
+
+// moof and mdat header of one segment: every track's samples in [first[i], last[i]). The mdat
+// payload is the file range [span_start, span_end) holding them, unused bytes included when
+// the tracks are interleaved with samples of neighbouring segments. Empty if too large to address.
+inline std::string mp4_fragment_header(const std::vector<Mp4Track>& tracks, const std::vector<size_t>& first,
+                                       const std::vector<size_t>& last, uint32_t sequence,
+                                       uint64_t span_start, uint64_t span_end) {
+    Mp4Writer w;
+    std::vector<std::pair<size_t, uint64_t>> data_offsets; // trun field, offset in the span
+    size_t moof = w.open(mp4_fourcc("moof"));
+    size_t mfhd = w.open_full(mp4_fourcc("mfhd"), 0, 0);
+    w.u32(sequence);
+    w.close(mfhd);
+    for (size_t t = 0; t < tracks.size(); ++t) {
+        const Mp4Track& track = tracks[t];
+        if (first[t] == last[t]) {
+            continue;
+        }
+        size_t traf = w.open(mp4_fourcc("traf"));
+        size_t tfhd = w.open_full(mp4_fourcc("tfhd"), 0, 0x020000); // default-base-is-moof
+        w.u32(track.id);
+        w.close(tfhd);
+        size_t tfdt = w.open_full(mp4_fourcc("tfdt"), 1, 0);
+        w.u64(track.times[first[t]]);
+        w.close(tfdt);
+        // One run per stretch of samples stored back to back
+        bool composition = !track.composition_offsets.empty();
+        for (size_t i = first[t]; i < last[t]; ) {
+            size_t end = i + 1;
+            while (end < last[t] && track.offsets[end] == track.offsets[end - 1] + track.sizes[end - 1]) {
+                ++end;
+            }
+            size_t trun = w.open_full(mp4_fourcc("trun"), composition ? 1 : 0,
+                                      0x000001 | 0x000100 | 0x000200 | 0x000400 | (composition ? 0x000800 : 0));
+            w.u32(static_cast<uint32_t>(end - i));
+            data_offsets.emplace_back(w.out.size(), track.offsets[i] - span_start);
+            w.u32(0);
+            for (size_t j = i; j < end; ++j) {
+                w.u32(track.durations[j]);
+                w.u32(track.sizes[j]);
+                // sample_depends_on: 2 (independent) for sync samples, else 1 plus non-sync
+                w.u32(track.is_sync(j) ? 0x02000000 : 0x01010000);
+                if (composition) {
+                    w.u32(static_cast<uint32_t>(track.composition_offsets[j]));
+                }
+            }
+            w.close(trun);
+            i = end;
+        }
+        w.close(traf);
+    }
+    w.close(moof);
+
+    uint64_t length = span_end - span_start;
+    bool large = length > UINT32_MAX - 8;
+    uint64_t payload_start = w.out.size() + (large ? 16 : 8);
+    if (payload_start + length > INT32_MAX) {
+        return "";
+    }
+    for (const auto& [field, offset] : data_offsets) {
+        w.patch32(field, static_cast<uint32_t>(payload_start + offset));
+    }
+    if (large) {
+        w.u32(1);
+        w.u32(mp4_fourcc("mdat"));
+        w.u64(length + 16);
+    } else {
+        w.u32(static_cast<uint32_t>(length + 8));
+        w.u32(mp4_fourcc("mdat"));
+    }
+    return std::move(w.out);
+}
+
+// Cut a progressive file at the first keyframe of the reference track past every
+// MP4_SEGMENT_DURATION seconds; other tracks are split at the same times
+inline bool mp4_index_progressive(const Mp4Box& moov, const std::vector<Mp4Track>& tracks, Mp4Index& index) {
+    const Mp4Track& ref = tracks[mp4_reference_track(tracks)];
+    if (ref.times.empty()) {
+        return false;
+    }
+    index.timescale = ref.timescale;
+    std::vector<uint64_t> starts;
+    uint64_t target = static_cast<uint64_t>(MP4_SEGMENT_DURATION) * ref.timescale;
+    for (size_t i = 0; i < ref.times.size(); ++i) {
+        if (i == 0 || (ref.is_sync(i) && ref.times[i] - starts.back() >= target)) {
+            starts.push_back(ref.times[i]);
+        }
+    }
+    uint64_t end_time = ref.times.back() + ref.durations.back();
+
+    std::vector<size_t> first(tracks.size(), 0);
+    std::vector<size_t> last(tracks.size(), 0);
+    for (size_t s = 0; s < starts.size(); ++s) {
+        uint64_t end = s + 1 < starts.size() ? starts[s + 1] : UINT64_MAX;
+        uint64_t span_start = UINT64_MAX;
+        uint64_t span_end = 0;
+        for (size_t t = 0; t < tracks.size(); ++t) {
+            const Mp4Track& track = tracks[t];
+            first[t] = last[t];
+            // Samples before the reference time end, compared across timescales
+            while (last[t] < track.times.size() &&
+                   (end == UINT64_MAX || static_cast<unsigned __int128>(track.times[last[t]]) * ref.timescale <
+                                             static_cast<unsigned __int128>(end) * track.timescale)) {
+                span_start = std::min(span_start, track.offsets[last[t]]);
+                span_end = std::max(span_end, track.offsets[last[t]] + track.sizes[last[t]]);
+                ++last[t];
+            }
+        }
+        if (span_start >= span_end) {
+            continue;
+        }
+        Mp4Segment segment;
+        segment.start = starts[s];
+        segment.duration = (s + 1 < starts.size() ? starts[s + 1] : end_time) - starts[s];
+        segment.offset = span_start;
+        segment.length = span_end - span_start;
+        segment.header = mp4_fragment_header(tracks, first, last, static_cast<uint32_t>(index.segments.size() + 1),
+                                             span_start, span_end);
+        if (segment.header.empty() || span_end > static_cast<uint64_t>(index.size)) {
+            return false;
+        }
+        index.segments.push_back(std::move(segment));
+    }
+    index.init = std::make_shared<const std::string>(mp4_init_segment(moov, tracks));
+    return true;
+}
+
+// Duration of the reference track's samples in one moof, and its decode time if tfdt gives it
+inline bool mp4_fragment_time(const Mp4Box& moof, const Mp4Track& ref, uint64_t& start, uint64_t& duration) {
+    bool found = false;
+    duration = 0;
+    mp4_for_each(moof.payload, moof.payload_size, [&](const Mp4Box& traf) {
+        Mp4Box tfhd = mp4_find(traf, mp4_fourcc("tfhd"));
+        if (traf.type != mp4_fourcc("traf") || !tfhd) {
+            return;
+        }
+        Mp4Reader header(tfhd.payload, tfhd.payload_size);
+        uint32_t flags = header.u32() & 0xffffff;
+        if (header.u32() != ref.id) {
+            return;
+        }
+        header.skip((flags & 0x01 ? 8 : 0) + (flags & 0x02 ? 4 : 0));
+        uint32_t default_duration = flags & 0x08 ? header.u32() : ref.default_duration;
+        found = true;
+        if (Mp4Box tfdt = mp4_find(traf, mp4_fourcc("tfdt"))) {
+            Mp4Reader reader(tfdt.payload, tfdt.payload_size);
+            bool wide = reader.u32() >> 24 == 1;
+            start = wide ? reader.u64() : reader.u32();
+        }
+        mp4_for_each(traf.payload, traf.payload_size, [&](const Mp4Box& trun) {
+            if (trun.type != mp4_fourcc("trun")) {
+                return;
+            }
+            Mp4Reader reader(trun.payload, trun.payload_size);
+            uint32_t run_flags = reader.u32() & 0xffffff;
+            uint32_t count = reader.u32();
+            reader.skip((run_flags & 0x01 ? 4 : 0) + (run_flags & 0x04 ? 4 : 0));
+            if (!(run_flags & 0x100)) {
+                duration += static_cast<uint64_t>(count) * default_duration;
+                return;
+            }
+            size_t per_sample = 4 * (1 + !!(run_flags & 0x200) + !!(run_flags & 0x400) + !!(run_flags & 0x800));
+            for (uint32_t i = 0; i < count && reader.ok(); ++i) {
+                duration += reader.u32();
+                reader.skip(per_sample - 4);
+            }
+        });
+    });
+    return found;
+}
+
+// A top level box of the file: type, offset and size
+struct Mp4FileBox {
+    uint32_t type;
+    uint64_t offset;
+    uint64_t size;
+};
+
+inline bool mp4_read_box(int fd, uint64_t offset, std::string& out, uint64_t size) {
+    if (size > MP4_MAX_HEADER_SIZE) {
+        return false;
+    }
+    out.resize(size);
+    return pread(fd, &out[0], size, static_cast<off_t>(offset)) == static_cast<ssize_t>(size);
+}
+
+// A fragmented file is listed as it is: the init segment is its ftyp and moov, each segment
+// a moof with the mdat boxes up to the next one
+inline bool mp4_index_fragmented(int fd, const std::vector<Mp4FileBox>& boxes, const std::vector<Mp4Track>& tracks,
+                                 uint64_t moov_end, Mp4Index& index) {
+    const Mp4Track& ref = tracks[mp4_reference_track(tracks)];
+    index.timescale = ref.timescale;
+    index.fragmented = true;
+    index.init_length = moov_end;
+    std::string buffer;
+    uint64_t time = 0;
+    for (const Mp4FileBox& box : boxes) {
+        if (box.type == mp4_fourcc("mdat") && !index.segments.empty()) {
+            Mp4Segment& segment = index.segments.back();
+            segment.length = box.offset + box.size - segment.offset;
+        }
+        if (box.type != mp4_fourcc("moof")) {
+            continue;
+        }
+        if (box.offset < moov_end || !mp4_read_box(fd, box.offset, buffer, box.size)) {
+            return false;
+        }
+        Mp4Box moof;
+        mp4_for_each(reinterpret_cast<const uint8_t*>(buffer.data()), buffer.size(), [&](const Mp4Box& b) { moof = b; });
+        uint64_t start = time;
+        uint64_t duration = 0;
+        if (!moof || !mp4_fragment_time(moof, ref, start, duration)) {
+            continue; // no samples of the reference track, it travels with the previous segment
+        }
+        Mp4Segment segment;
+        segment.start = start;
+        segment.duration = duration;
+        segment.offset = box.offset;
+        segment.length = box.size;
+        index.segments.push_back(std::move(segment));
+        time = start + duration;
+    }
+    return true;
+}
+
+// Percent-encode a file name for use as a relative URI in the manifests
+inline std::string mp4_uri(std::string_view name) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string uri;
+    for (unsigned char c : name) {
+        if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+            uri += static_cast<char>(c);
+        } else {
+            uri += '%';
+            uri += hex[c >> 4];
+            uri += hex[c & 15];
+        }
+    }
+    return uri;
+}
+
+// HLS media playlist of fMP4 segments: byte ranges of a fragmented file, or the generated
+// "?segment=" pieces of a progressive one
+inline std::string mp4_hls_playlist(const Mp4Index& index, const std::string& uri) {
+    double longest = 0;
+    for (const Mp4Segment& segment : index.segments) {
+        longest = std::max(longest, static_cast<double>(segment.duration) / index.timescale);
+    }
+    // Names are appended as strings, snprintf only formats the numbers: a long percent-encoded
+    // uri would be cut off at the end of the line buffer
+    char line[160];
+    std::string m3u8 = "#EXTM3U\n#EXT-X-VERSION:7\n";
+    snprintf(line, sizeof(line), "#EXT-X-TARGETDURATION:%d\n", std::max(1, static_cast<int>(longest + 0.5)));
+    m3u8 += line;
+    m3u8 += "#EXT-X-MEDIA-SEQUENCE:0\n#EXT-X-PLAYLIST-TYPE:VOD\n#EXT-X-INDEPENDENT-SEGMENTS\n";
+    m3u8 += "#EXT-X-MAP:URI=\"" + uri;
+    if (index.fragmented) {
+        snprintf(line, sizeof(line), "\",BYTERANGE=\"%llu@0\"\n", static_cast<unsigned long long>(index.init_length));
+        m3u8 += line;
+    } else {
+        m3u8 += "?segment=init\"\n";
+    }
+    for (size_t i = 0; i < index.segments.size(); ++i) {
+        const Mp4Segment& segment = index.segments[i];
+        snprintf(line, sizeof(line), "#EXTINF:%.3f,\n", static_cast<double>(segment.duration) / index.timescale);
+        m3u8 += line;
+        if (index.fragmented) {
+            snprintf(line, sizeof(line), "#EXT-X-BYTERANGE:%llu@%llu\n", static_cast<unsigned long long>(segment.length),
+                     static_cast<unsigned long long>(segment.offset));
+            m3u8 += line;
+            m3u8 += uri;
+        } else {
+            m3u8 += uri;
+            m3u8 += "?segment=";
+            m3u8 += std::to_string(i);
+        }
+        m3u8 += '\n';
+    }
+    m3u8 += "#EXT-X-ENDLIST\n";
+    return m3u8;
+}
+
+// DASH MPD with one multiplexed representation, segments listed with a SegmentTimeline
+inline std::string mp4_dash_manifest(const Mp4Index& index, const std::vector<Mp4Track>& tracks, const std::string& uri) {
+    uint64_t total = 0;
+    double bandwidth = 0;
+    for (const Mp4Segment& segment : index.segments) {
+        total += segment.duration;
+        if (segment.duration) {
+            bandwidth = std::max(bandwidth, segment.size() * 8.0 * index.timescale / segment.duration);
+        }
+    }
+    const Mp4Track& ref = tracks[mp4_reference_track(tracks)];
+    std::string codecs;
+    for (const Mp4Track& track : tracks) {
+        if (!track.codec.empty()) {
+            codecs += (codecs.empty() ? "" : ",") + track.codec;
+        }
+    }
+    bool video = ref.handler == mp4_fourcc("vide");
+
+    // As in the playlist, only numbers go through snprintf
+    char line[256];
+    std::string mpd = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+    snprintf(line, sizeof(line),
+             "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-main:2011\" "
+             "type=\"static\" mediaPresentationDuration=\"PT%.3fS\" minBufferTime=\"PT%dS\">\n",
+             static_cast<double>(total) / index.timescale, MP4_SEGMENT_DURATION);
+    mpd += line;
+    mpd += "  <Period start=\"PT0S\">\n    <AdaptationSet segmentAlignment=\"true\">\n";
+    mpd += "      <Representation id=\"0\" mimeType=\"";
+    mpd += video ? "video/mp4" : "audio/mp4";
+    mpd += "\" codecs=\"" + codecs;
+    snprintf(line, sizeof(line), "\" bandwidth=\"%llu\"", static_cast<unsigned long long>(bandwidth));
+    mpd += line;
+    if (video && ref.width && ref.height) {
+        snprintf(line, sizeof(line), " width=\"%u\" height=\"%u\"", ref.width, ref.height);
+        mpd += line;
+    }
+    snprintf(line, sizeof(line), ">\n        <SegmentList timescale=\"%u\">\n", index.timescale);
+    mpd += line;
+    mpd += "          <Initialization sourceURL=\"" + uri;
+    if (index.fragmented) {
+        snprintf(line, sizeof(line), "\" range=\"0-%llu\"/>\n", static_cast<unsigned long long>(index.init_length - 1));
+        mpd += line;
+    } else {
+        mpd += "?segment=init\"/>\n";
+    }
+    mpd += "          <SegmentTimeline>\n";
+    for (size_t i = 0; i < index.segments.size(); ) {
+        // Runs of equal durations collapse into one entry with a repeat count
+        size_t run = 1;
+        while (i + run < index.segments.size() && index.segments[i + run].duration == index.segments[i].duration) {
+            ++run;
+        }
+        snprintf(line, sizeof(line), "            <S t=\"%llu\" d=\"%llu\"", static_cast<unsigned long long>(index.segments[i].start),
+                 static_cast<unsigned long long>(index.segments[i].duration));
+        mpd += line;
+        mpd += run > 1 ? " r=\"" + std::to_string(run - 1) + "\"/>\n" : "/>\n";
+        i += run;
+    }
+    mpd += "          </SegmentTimeline>\n";
+    for (size_t i = 0; i < index.segments.size(); ++i) {
+        const Mp4Segment& segment = index.segments[i];
+        mpd += "          <SegmentURL media=\"" + uri;
+        if (index.fragmented) {
+            snprintf(line, sizeof(line), "\" mediaRange=\"%llu-%llu\"/>\n", static_cast<unsigned long long>(segment.offset),
+                     static_cast<unsigned long long>(segment.offset + segment.length - 1));
+        } else {
+            snprintf(line, sizeof(line), "?segment=%zu\"/>\n", i);
+        }
+        mpd += line;
+    }
+    mpd += "        </SegmentList>\n      </Representation>\n    </AdaptationSet>\n  </Period>\n</MPD>\n";
+    return mpd;
+}
+
+// Index the MP4 file open as fd, with manifests referring to it by name. The index of a
+// file that isn't an MP4 this understands has no segments.
+inline std::shared_ptr<Mp4Index> build_mp4_index(int fd, const struct stat& st, std::string_view name) {
+    auto index = std::make_shared<Mp4Index>();
+    index->ino = st.st_ino;
+    index->size = st.st_size;
+    index->mtime = st.st_mtim;
+
+    // Top level boxes, read header by header; box bodies (mdat) are never read
+    std::vector<Mp4FileBox> boxes;
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    for (uint64_t offset = 0; size - offset >= 8; ) {
+        uint8_t header[16];
+        ssize_t n = pread(fd, header, sizeof(header), static_cast<off_t>(offset));
+        if (n < 8) {
+            break;
+        }
+        Mp4Reader reader(header, static_cast<size_t>(n));
+        uint64_t box_size = reader.u32();
+        uint32_t type = reader.u32();
+        if (box_size == 1) {
+            box_size = reader.u64();
+        } else if (box_size == 0) {
+            box_size = size - offset;
+        }
+        if (!reader.ok() || box_size < 8 || box_size > size - offset) {
+            break;
+        }
+        boxes.push_back({type, offset, box_size});
+        offset += box_size;
+    }
+
+    std::string moov_bytes;
+    uint64_t moov_end = 0;
+    bool fragmented = false;
+    for (const Mp4FileBox& box : boxes) {
+        if (box.type == mp4_fourcc("moov") && moov_bytes.empty()) {
+            if (!mp4_read_box(fd, box.offset, moov_bytes, box.size)) {
+                return index;
+            }
+            moov_end = box.offset + box.size;
+        }
+        fragmented = fragmented || box.type == mp4_fourcc("moof");
+    }
+    Mp4Box moov;
+    mp4_for_each(reinterpret_cast<const uint8_t*>(moov_bytes.data()), moov_bytes.size(), [&](const Mp4Box& box) { moov = box; });
+    if (!moov) {
+        return index;
+    }
+
+    // Sample tables are only needed to cut a progressive file; a fragmented one has none
+    std::vector<Mp4Track> tracks;
+    bool indexed = mp4_read_tracks(moov, !fragmented, tracks) &&
+                   (fragmented ? mp4_index_fragmented(fd, boxes, tracks, moov_end, *index)
+                               : mp4_index_progressive(moov, tracks, *index));
+    if (!indexed || index->segments.empty()) {
+        index->segments.clear();
+        return index;
+    }
+    std::string uri = mp4_uri(name);
+    index->hls = std::make_shared<const std::string>(mp4_hls_playlist(*index, uri));
+    index->dash = std::make_shared<const std::string>(mp4_dash_manifest(*index, tracks, uri));
+    return index;
+}
+
+// Indexes by path, built on first use and shared by all reactors. Few files are streamed at
+// once, so one lock and a small LRU do; an entry is used only while it describes the file
+// as currently opened, and inotify drops it once the file changes. Reactors that miss on a
+// file another one is indexing wait for that build instead of parsing the file again.
+class Mp4IndexCache {
+public:
+    // The index of file, which was opened from path; nullptr if it can't be indexed
+    std::shared_ptr<const Mp4Index> get(const std::string& path, const OpenFile& file) {
+        std::promise<std::shared_ptr<const Mp4Index>> built;
+        std::shared_future<std::shared_ptr<const Mp4Index>> pending;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            std::shared_ptr<const Mp4Index> index = lookup(path);
+            if (index && index->describes(file.st)) {
+                return usable(std::move(index));
+            }
+            auto it = building_.find(path);
+            if (it == building_.end()) {
+                building_.emplace(path, built.get_future().share());
+            } else {
+                pending = it->second;
+            }
+        }
+        if (pending.valid()) {
+            std::shared_ptr<const Mp4Index> index = pending.get();
+            if (index->describes(file.st)) {
+                return usable(std::move(index));
+            }
+            // That build was of an older version of the file, this one is indexed on its own
+            return usable(build(path, file));
+        }
+
+        std::shared_ptr<const Mp4Index> index = build(path, file);
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            building_.erase(path);
+            insert(path, index);
+        }
+        built.set_value(index);
+        return usable(std::move(index));
+    }
+
+    // Drop path and, if it names a directory, everything below it
+    void invalidate(const std::string& path, bool is_dir) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::string prefix = path + "/";
+        for (auto it = lru_.begin(); it != lru_.end(); ) {
+            auto next = std::next(it);
+            if (it->first == path || (is_dir && it->first.compare(0, prefix.size(), prefix) == 0)) {
+                index_.erase(it->first);
+                lru_.erase(it);
+            }
+            it = next;
+        }
+    }
+
+private:
+    using Lru = std::list<std::pair<std::string, std::shared_ptr<const Mp4Index>>>;
+
+    static std::shared_ptr<const Mp4Index> build(const std::string& path, const OpenFile& file) {
+        std::string_view name = std::string_view(path).substr(path.find_last_of('/') + 1);
+        return build_mp4_index(file.fd, file.st, name);
+    }
+
+    // Files that can't be indexed are cached too, as an index without segments
+    static std::shared_ptr<const Mp4Index> usable(std::shared_ptr<const Mp4Index> index) {
+        return index->segments.empty() ? nullptr : index;
+    }
+
+    // lookup and insert: callers hold mtx_
+    std::shared_ptr<const Mp4Index> lookup(const std::string& path) {
+        auto it = index_.find(path);
+        if (it == index_.end()) {
+            return nullptr;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+    }
+
+    void insert(const std::string& path, std::shared_ptr<const Mp4Index> index) {
+        auto it = index_.find(path);
+        if (it != index_.end()) {
+            lru_.erase(it->second);
+            index_.erase(it);
+        }
+        while (lru_.size() >= MP4_INDEX_CACHE_ENTRIES) {
+            index_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+        lru_.emplace_front(path, std::move(index));
+        index_[path] = lru_.begin();
+    }
+
+    std::mutex mtx_;
+    Lru lru_; // most recently used first
+    std::unordered_map<std::string, Lru::iterator> index_;
+    std::unordered_map<std::string, std::shared_future<std::shared_ptr<const Mp4Index>>> building_;
+};
+
+#endif // MP4_INDEX_H
@@ -0,0 +1,249 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// An open regular file, shared by every queued response that sends from it
+struct OpenFile {
+    int fd = -1;
+    struct stat st;
+
+    ~OpenFile() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+// Open a regular file for sending, returns nullptr if missing or not a regular file
+inline std::shared_ptr<OpenFile> open_file(const std::string& path) {
+    auto file = std::make_shared<OpenFile>();
+    file->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0 || fstat(file->fd, &file->st) < 0 || !S_ISREG(file->st.st_mode)) {
+        return nullptr;
+    }
+    return file;
+}
+
+// A pipe that socket data is spliced into and out of, so it never enters user space.
+// Whoever fills it counts what is inside; queued pipe chunks drain it in order.
+struct PipeBuffer {
+    int read_fd = -1;
+    int write_fd = -1;
+    size_t capacity = 0;
+    size_t buffered = 0; // bytes currently in the pipe
+
+    ~PipeBuffer() {
+        if (read_fd >= 0) {
+            close(read_fd);
+            close(write_fd);
+        }
+    }
+};
+
+#define BODY_PIECE_SIZE 16384 // Generated body bytes produced per pull
+
+// A response body generated on demand, for content whose length isn't known up front.
+// Pieces are pulled only as the connection drains, so a slow reader holds one piece in
+// memory rather than the whole body.
+class BodySource {
+public:
+    virtual ~BodySource() = default;
+
+    // Append up to about max_bytes of the body to out; false once the body is complete.
+    // Each call that returns true must append something.
+    virtual bool next(std::string& out, size_t max_bytes) = 0;
+};
+
+// A pending piece of output: bytes in memory (owned, or a slice of an immutable shared
+// buffer such as a cached file body), a byte range of a file sent with sendfile, bytes
+// waiting in a pipe sent with splice, or a generated body whose current piece sits in data
+struct OutputChunk {
+    std::string data;
+    std::shared_ptr<const std::string> shared;
+    size_t shared_offset = 0;
+    size_t shared_length = 0;
+    size_t sent = 0; // memory bytes already written
+    std::shared_ptr<OpenFile> file;
+    off_t file_offset = 0;
+    size_t file_remaining = 0;
+    std::shared_ptr<PipeBuffer> pipe;
+    size_t pipe_remaining = 0;
+    std::shared_ptr<BodySource> source;
+    bool source_done = false; // the last piece, and terminator if chunked, is in data
+    bool chunked = false;     // frame pieces with the HTTP/1.1 chunked transfer coding
+
+    const char* memory() const {
+        return shared ? shared->data() + shared_offset : data.data();
+    }
+
+    size_t memory_size() const {
+        return shared ? shared_length : data.size();
+    }
+
+    // Replace a fully written piece of a generated body with the next one
+    void refill() {
+        // Chunk sizes may have leading zeros, so the size line is reserved at full width and
+        // patched afterwards instead of formatting the piece into a second buffer
+        static const char size_line[] = "00000000\r\n";
+        const size_t prefix = chunked ? sizeof(size_line) - 1 : 0;
+        data.assign(size_line, prefix);
+        sent = 0;
+        bool more = source->next(data, BODY_PIECE_SIZE);
+        size_t length = data.size() - prefix;
+        if (chunked) {
+            if (length > 0) {
+                static const char hex[] = "0123456789abcdef";
+                for (int i = 7; i >= 0; --i, length >>= 4) {
+                    data[i] = hex[length & 15];
+                }
+                data += "\r\n";
+            } else {
+                data.clear();
+            }
+        }
+        if (!more) {
+            source_done = true;
+            if (chunked) {
+                data += "0\r\n\r\n";
+            }
+        }
+    }
+};
+
+// Responses queued on a connection, in the order they must reach the socket.
+// File bodies are referenced, not copied, so memory per response stays constant
+// whatever the file size. Chunks live in a ring of slots that keep their string
+// capacity when freed, so once a connection is warmed up queuing output allocates nothing.
+struct OutputQueue {
+    std::vector<OutputChunk> slots; // power-of-two sized ring
+    size_t head = 0;
+    size_t count = 0;
+    size_t buffered = 0; // bytes held in owned memory chunks, what a slow reader costs us
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    OutputChunk& operator[](size_t i) {
+        return slots[(head + i) & (slots.size() - 1)];
+    }
+
+    OutputChunk& front() {
+        return (*this)[0];
+    }
+
+    OutputChunk& back() {
+        return (*this)[count - 1];
+    }
+
+    void pop_front() {
+        OutputChunk& chunk = front();
+        if (!chunk.source) {
+            buffered -= chunk.data.size();
+        }
+        chunk.data.clear();
+        chunk.shared.reset();
+        chunk.shared_offset = chunk.shared_length = chunk.sent = 0;
+        chunk.file.reset();
+        chunk.file_offset = 0;
+        chunk.file_remaining = 0;
+        chunk.pipe.reset();
+        chunk.pipe_remaining = 0;
+        chunk.source.reset();
+        chunk.source_done = false;
+        chunk.chunked = false;
+        head = (head + 1) & (slots.size() - 1);
+        --count;
+    }
+
+    // A cleared slot at the back of the queue
+    OutputChunk& push_back() {
+        if (count == slots.size()) {
+            std::vector<OutputChunk> grown(std::max<size_t>(8, slots.size() * 2));
+            for (size_t i = 0; i < count; ++i) {
+                grown[i] = std::move((*this)[i]);
+            }
+            slots.swap(grown);
+            head = 0;
+        }
+        ++count;
+        return back();
+    }
+
+    void append(const char* data, size_t len) {
+        if (len == 0) {
+            return;
+        }
+        // Coalesce consecutive memory output (headers, small pipelined responses)
+        if (empty() || back().file || back().shared || back().pipe || back().source) {
+            push_back();
+        }
+        back().data.append(data, len);
+        buffered += len;
+    }
+
+    void append(std::string_view data) {
+        append(data.data(), data.size());
+    }
+
+    void append_number(uint64_t value) {
+        char buf[24];
+        char* end = std::to_chars(buf, buf + sizeof(buf), value).ptr;
+        append(buf, end - buf);
+    }
+
+    // Reference part of a shared buffer without copying it
+    void append_shared(std::shared_ptr<const std::string> buffer, size_t offset, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        OutputChunk& chunk = push_back();
+        chunk.shared = std::move(buffer);
+        chunk.shared_offset = offset;
+        chunk.shared_length = length;
+    }
+
+    void append_file(std::shared_ptr<OpenFile> file, off_t offset, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        OutputChunk& chunk = push_back();
+        chunk.file = std::move(file);
+        chunk.file_offset = offset;
+        chunk.file_remaining = length;
+    }
+
+    // length bytes just spliced into pipe; consecutive ones share a chunk
+    void append_pipe(const std::shared_ptr<PipeBuffer>& pipe, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        if (empty() || back().pipe != pipe) {
+            push_back().pipe = pipe;
+        }
+        back().pipe_remaining += length;
+    }
+
+    // A generated body, pulled piece by piece as the socket drains
+    void append_source(std::shared_ptr<BodySource> source, bool chunked) {
+        OutputChunk& chunk = push_back();
+        chunk.source = std::move(source);
+        chunk.chunked = chunked;
+    }
+};
+
+#endif // OUTPUT_QUEUE_H
@@ -0,0 +1,216 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <string>
+#include <string_view>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "output_queue.h"
+
+#define PATH_CACHE_SHARDS 16
+#define PATH_CACHE_CAPACITY 1024 // Open descriptors kept, files and directories together
+#define PATH_CACHE_TOMBSTONES 256 // Invalidated paths remembered per shard to turn away stale inserts
+
+// Open path relative to dir_fd without ever leaving dir_fd: "..", absolute symlinks and
+// symlinks pointing outside fail with EXDEV. Magic links (/proc/self/fd/...) are refused.
+// On kernels without openat2 (before 5.6) symlinks are not followed at all instead.
+inline int open_beneath(int dir_fd, const char* path, int flags) {
+    static std::atomic<bool> unsupported{false};
+    if (!unsupported.load(std::memory_order_relaxed)) {
+        struct open_how how = {};
+        how.flags = flags | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = static_cast<int>(syscall(SYS_openat2, dir_fd, path, &how, sizeof(how)));
+        if (fd >= 0 || errno != ENOSYS) {
+            return fd;
+        }
+        unsupported.store(true, std::memory_order_relaxed);
+    }
+    // Only the last component can be guarded here; normalized request paths carry no ".."
+    return openat(dir_fd, path, flags | O_CLOEXEC | O_NOFOLLOW);
+}
+
+// Open descriptors and stat results by path, so a hot tree is walked once rather than on
+// every request. Directories are kept as O_PATH descriptors and files are opened relative
+// to their cached parent: a miss resolves one component. Misses are cached as well, which
+// keeps repeated 404s and absent precompressed siblings off the disk. Entries are dropped
+// by inotify like the file cache; descriptors stay valid for responses still sending from
+// them after eviction. Keys are the document root followed by the normalized request path.
+class PathCache {
+public:
+    explicit PathCache(size_t capacity) : shard_capacity_(capacity / PATH_CACHE_SHARDS) {}
+
+    // Without inotify nothing would tell a cached descriptor went stale
+    void disable() {
+        shard_capacity_ = 0;
+    }
+
+    // The regular file at key, whose first root_len bytes are the document root opened as
+    // root_fd; nullptr if missing, not a regular file or outside the root
+    std::shared_ptr<OpenFile> open_file(int root_fd, const std::string& key, size_t root_len) {
+        std::shared_ptr<OpenFile> file = open(root_fd, key, root_len, O_RDONLY);
+        return file && S_ISREG(file->st.st_mode) ? file : nullptr;
+    }
+
+    // Drop path and, if it names a directory, everything below it
+    void invalidate(const std::string& path, bool is_dir) {
+        uint64_t generation = generation_.fetch_add(1, std::memory_order_acq_rel) + 1;
+        if (!is_dir) {
+            Shard& shard = shard_for(path);
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            remember_invalidated(shard, path, generation);
+            auto it = shard.index.find(path);
+            if (it != shard.index.end()) {
+                erase(shard, it->second);
+            }
+            return;
+        }
+        std::string prefix = path + "/";
+        // Directories change rarely: everything being loaded anywhere is turned away
+        for (Shard& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            shard.stale_before = generation;
+            shard.invalidated.clear();
+            for (auto it = shard.lru.begin(); it != shard.lru.end(); ) {
+                auto next = std::next(it);
+                if (it->first == path || it->first.compare(0, prefix.size(), prefix) == 0) {
+                    erase(shard, it);
+                }
+                it = next;
+            }
+        }
+    }
+
+private:
+    using Lru = std::list<std::pair<std::string, std::shared_ptr<OpenFile>>>;
+
+    struct Shard {
+        std::mutex mtx;
+        Lru lru; // most recently used first
+        std::unordered_map<std::string, Lru::iterator> index;
+        // Generation at which each recently invalidated path was dropped; loads started
+        // before stale_before are turned away whatever their path
+        std::unordered_map<std::string, uint64_t> invalidated;
+        uint64_t stale_before = 0;
+    };
+
+    // A cached or freshly opened descriptor for key; flags is O_RDONLY for files and
+    // O_PATH | O_DIRECTORY for parents. nullptr (cached too) when it doesn't exist.
+    std::shared_ptr<OpenFile> open(int root_fd, const std::string& key, size_t root_len, int flags) {
+        std::shared_ptr<OpenFile> cached;
+        if (lookup(key, cached)) {
+            return cached;
+        }
+        uint64_t generation = generation_.load(std::memory_order_acquire);
+
+        // Relative to the parent directory; a symlink leading out of it but not out of the
+        // root (EXDEV) is resolved again from the root
+        size_t slash = key.find_last_of('/');
+        int dir_fd = root_fd;
+        std::shared_ptr<OpenFile> parent;
+        const char* name = key.c_str() + root_len + 1;
+        if (slash > root_len) {
+            parent = open(root_fd, key.substr(0, slash), root_len, O_PATH | O_DIRECTORY);
+            if (!parent) {
+                return nullptr;
+            }
+            dir_fd = parent->fd;
+            name = key.c_str() + slash + 1;
+        }
+        auto file = std::make_shared<OpenFile>();
+        file->fd = open_beneath(dir_fd, name, flags);
+        if (file->fd < 0 && errno == EXDEV && dir_fd != root_fd) {
+            file->fd = open_beneath(root_fd, key.c_str() + root_len + 1, flags);
+        }
+        if (file->fd < 0) {
+            // Absent is worth remembering; running out of descriptors or memory is not
+            if (errno == ENOENT || errno == ENOTDIR || errno == EXDEV || errno == ELOOP || errno == EACCES) {
+                insert(key, nullptr, generation);
+            }
+            return nullptr;
+        }
+        if (fstat(file->fd, &file->st) < 0) {
+            return nullptr;
+        }
+        // A directory opened as a file still works as a parent, a file can't be one
+        if ((flags & O_DIRECTORY) && !S_ISDIR(file->st.st_mode)) {
+            file = nullptr;
+        }
+        insert(key, file, generation);
+        return file;
+    }
+
+    bool lookup(const std::string& key, std::shared_ptr<OpenFile>& file) {
+        Shard& shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            return false;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        file = it->second->second;
+        return true;
+    }
+
+    void insert(const std::string& key, std::shared_ptr<OpenFile> file, uint64_t generation) {
+        Shard& shard = shard_for(key);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        if (shard_capacity_ == 0 || stale(shard, key, generation)) {
+            return;
+        }
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            erase(shard, it->second);
+        }
+        while (shard.lru.size() >= shard_capacity_) {
+            erase(shard, std::prev(shard.lru.end()));
+        }
+        shard.lru.emplace_front(key, std::move(file));
+        shard.index[key] = shard.lru.begin();
+    }
+
+    Shard& shard_for(const std::string& key) {
+        return shards_[std::hash<std::string>()(key) % PATH_CACHE_SHARDS];
+    }
+
+    // Whether a copy of key loaded at generation may predate a change to it
+    static bool stale(const Shard& shard, const std::string& key, uint64_t generation) {
+        if (generation < shard.stale_before) {
+            return true;
+        }
+        auto it = shard.invalidated.find(key);
+        return it != shard.invalidated.end() && generation < it->second;
+    }
+
+    static void remember_invalidated(Shard& shard, const std::string& key, uint64_t generation) {
+        if (shard.invalidated.size() >= PATH_CACHE_TOMBSTONES && shard.invalidated.find(key) == shard.invalidated.end()) {
+            // Too many to remember one by one: forget them for one shard-wide cutoff
+            shard.stale_before = generation;
+            shard.invalidated.clear();
+            return;
+        }
+        shard.invalidated[key] = generation;
+    }
+
+    void erase(Shard& shard, Lru::iterator it) {
+        shard.index.erase(it->first);
+        shard.lru.erase(it);
+    }
+
+    Shard shards_[PATH_CACHE_SHARDS];
+    size_t shard_capacity_;
+    std::atomic<uint64_t> generation_{0};
+};
+
+#endif // PATH_CACHE_H
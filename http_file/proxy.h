@@ -0,0 +1,437 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "http_parser.h"
+#include "output_queue.h"
+
+#define UPSTREAM_POOL_SIZE 32          // Idle keep-alive connections kept per upstream by each reactor
+#define UPSTREAM_IDLE_TIMEOUT 30       // Seconds an idle pooled connection is kept
+#define UPSTREAM_TIMEOUT 30            // Seconds to wait for the head of an upstream response
+#define UPSTREAM_HEALTH_INTERVAL 2     // Seconds between active health checks
+#define UPSTREAM_CHECK_TIMEOUT_MS 1000 // Connect (and health request) timeout of a check
+#define PROXY_PIPE_SIZE (256 * 1024)   // Pipe capacity asked for response bodies relayed with splice
+#define PROXY_REQUEST_BUFFER (256 * 1024) // Request bytes held for the upstream before the client is paused
+
+// One backend, reached over TCP ("127.0.0.1:9000") or a Unix socket ("unix:/run/app.sock").
+// Shared by all reactors: health and load are atomics, everything else is set at startup.
+struct Upstream {
+    std::string name;
+    struct sockaddr_storage addr = {};
+    socklen_t addr_len = 0;
+    std::atomic<bool> healthy{true};
+    std::atomic<int> outstanding{0}; // requests in flight, all reactors together
+
+    bool parse(const std::string& spec) {
+        name = spec;
+        if (spec.compare(0, 5, "unix:") == 0) {
+            auto* un = reinterpret_cast<struct sockaddr_un*>(&addr);
+            std::string path = spec.substr(5);
+            if (path.empty() || path.size() >= sizeof(un->sun_path)) {
+                return false;
+            }
+            un->sun_family = AF_UNIX;
+            memcpy(un->sun_path, path.c_str(), path.size() + 1);
+            addr_len = sizeof(struct sockaddr_un);
+            return true;
+        }
+        size_t colon = spec.rfind(':');
+        if (colon == std::string::npos) {
+            return false;
+        }
+        auto* in = reinterpret_cast<struct sockaddr_in*>(&addr);
+        in->sin_family = AF_INET;
+        in->sin_port = htons(static_cast<uint16_t>(atoi(spec.c_str() + colon + 1)));
+        std::string host = spec.substr(0, colon);
+        if (host == "localhost") {
+            host = "127.0.0.1";
+        }
+        if (in->sin_port == 0 || inet_pton(AF_INET, host.c_str(), &in->sin_addr) != 1) {
+            return false;
+        }
+        addr_len = sizeof(struct sockaddr_in);
+        return true;
+    }
+
+    // A non-blocking socket connecting (or connected) to the upstream, -1 on failure
+    int connect_nonblocking() const {
+        int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (addr.ss_family == AF_INET) {
+            int opt = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        }
+        if (connect(fd, reinterpret_cast<const struct sockaddr*>(&addr), addr_len) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+};
+
+// The upstreams requests under the proxied prefix are balanced over: each goes to the
+// healthy upstream with the fewest requests in flight. A checker thread probes every
+// upstream periodically; a failed connect from a reactor marks one down at once and only
+// a passing check brings it back.
+class UpstreamGroup {
+public:
+    bool add(const std::string& spec) {
+        auto upstream = std::make_unique<Upstream>();
+        if (!upstream->parse(spec)) {
+            return false;
+        }
+        upstreams_.push_back(std::move(upstream));
+        return true;
+    }
+
+    bool enabled() const {
+        return !upstreams_.empty();
+    }
+
+    // nullptr when every upstream is down. Ties are broken round robin, so an idle group
+    // doesn't send everything to the first upstream.
+    Upstream* pick() {
+        thread_local size_t rotation = 0;
+        size_t n = upstreams_.size();
+        size_t start = rotation++ % n;
+        Upstream* best = nullptr;
+        int best_load = 0;
+        for (size_t i = 0; i < n; ++i) {
+            Upstream* upstream = upstreams_[(start + i) % n].get();
+            if (!upstream->healthy.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            int load = upstream->outstanding.load(std::memory_order_relaxed);
+            if (!best || load < best_load) {
+                best = upstream;
+                best_load = load;
+            }
+        }
+        return best;
+    }
+
+    void mark_down(Upstream& upstream) {
+        if (upstream.healthy.exchange(false, std::memory_order_relaxed)) {
+            std::cerr << "Upstream " << upstream.name << " is down" << std::endl;
+        }
+    }
+
+    // Probe with a connect, or with "GET health_path" expecting a 2xx or 3xx when one is given
+    void start_health_checks(std::string health_path) {
+        std::thread([this, path = std::move(health_path)] {
+            while (true) {
+                for (auto& upstream : upstreams_) {
+                    bool ok = check(*upstream, path);
+                    if (ok && !upstream->healthy.exchange(true, std::memory_order_relaxed)) {
+                        std::cerr << "Upstream " << upstream->name << " is up" << std::endl;
+                    } else if (!ok) {
+                        mark_down(*upstream);
+                    }
+                }
+                std::this_thread::sleep_for(std::chrono::seconds(UPSTREAM_HEALTH_INTERVAL));
+            }
+        }).detach();
+    }
+
+private:
+    static bool wait(int fd, short events) {
+        struct pollfd p = {fd, events, 0};
+        return poll(&p, 1, UPSTREAM_CHECK_TIMEOUT_MS) == 1 && !(p.revents & (POLLERR | POLLNVAL));
+    }
+
+    static bool check(const Upstream& upstream, const std::string& path) {
+        int fd = upstream.connect_nonblocking();
+        if (fd < 0) {
+            return false;
+        }
+        int error = 0;
+        socklen_t len = sizeof(error);
+        bool ok = wait(fd, POLLOUT) && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0;
+        if (ok && !path.empty()) {
+            std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + upstream.name + "\r\nConnection: close\r\n\r\n";
+            char status[16] = {};
+            ok = send(fd, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size()) &&
+                 wait(fd, POLLIN) && recv(fd, status, sizeof(status) - 1, 0) >= 12 &&
+                 strncmp(status, "HTTP/1.", 7) == 0 && (status[9] == '2' || status[9] == '3');
+        }
+        close(fd);
+        return ok;
+    }
+
+    std::vector<std::unique_ptr<Upstream>> upstreams_;
+};
+
+// Idle keep-alive connections to the upstreams, owned by one reactor
+class UpstreamPool {
+public:
+    ~UpstreamPool() {
+        for (const Idle& idle : idle_) {
+            close(idle.fd);
+        }
+    }
+
+    // The most recently used idle connection that is still open, -1 if there is none. An
+    // upstream closing it right now is still possible and caught when it is used.
+    int take(Upstream* upstream) {
+        for (size_t i = idle_.size(); i-- > 0; ) {
+            if (idle_[i].upstream != upstream) {
+                continue;
+            }
+            int fd = idle_[i].fd;
+            idle_.erase(idle_.begin() + i);
+            char c;
+            if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return fd;
+            }
+            close(fd); // closed by the upstream, or sending unsolicited bytes
+        }
+        return -1;
+    }
+
+    void put(Upstream* upstream, int fd, std::chrono::steady_clock::time_point now) {
+        size_t kept = 0;
+        for (const Idle& idle : idle_) {
+            kept += idle.upstream == upstream;
+        }
+        if (kept >= UPSTREAM_POOL_SIZE) {
+            close(fd);
+            return;
+        }
+        idle_.push_back({upstream, fd, now});
+    }
+
+    void expire(std::chrono::steady_clock::time_point now) {
+        size_t out = 0;
+        for (const Idle& idle : idle_) {
+            if (now - idle.since >= std::chrono::seconds(UPSTREAM_IDLE_TIMEOUT)) {
+                close(idle.fd);
+            } else {
+                idle_[out++] = idle;
+            }
+        }
+        idle_.resize(out);
+    }
+
+private:
+    struct Idle {
+        Upstream* upstream;
+        int fd;
+        std::chrono::steady_clock::time_point since;
+    };
+    std::vector<Idle> idle_; // least recently used first
+};
+
+// Pipes for splicing response bodies, reused by one reactor once drained
+class PipePool {
+public:
+    std::shared_ptr<PipeBuffer> take() {
+        if (!free_.empty()) {
+            std::shared_ptr<PipeBuffer> pipe = std::move(free_.back());
+            free_.pop_back();
+            return pipe;
+        }
+        int fds[2];
+        if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+            return nullptr;
+        }
+        auto pipe = std::make_shared<PipeBuffer>();
+        pipe->read_fd = fds[0];
+        pipe->write_fd = fds[1];
+        fcntl(fds[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+        int capacity = fcntl(fds[1], F_GETPIPE_SZ);
+        pipe->capacity = capacity > 0 ? capacity : 65536;
+        return pipe;
+    }
+
+    // A pipe still referenced by queued output is left to close with it
+    void give_back(std::shared_ptr<PipeBuffer> pipe) {
+        if (pipe && pipe->buffered == 0 && pipe.use_count() == 1 && free_.size() < UPSTREAM_POOL_SIZE) {
+            free_.push_back(std::move(pipe));
+        }
+    }
+
+private:
+    std::vector<std::shared_ptr<PipeBuffer>> free_;
+};
+
+// A parsed upstream response head; views point into the buffer it was parsed from
+struct HttpResponseHead {
+    std::string_view status;    // "404 Not Found"
+    int code = 0;
+    bool http11 = false;
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    size_t header_count = 0;
+    bool has_content_length = false;
+    uint64_t content_length = 0;
+    bool chunked = false;
+    bool close = false;         // Connection: close
+};
+
+enum class ResponseParseStatus {
+    Complete,
+    Incomplete,
+    Invalid,
+};
+
+// Parse the response head at the start of [data, data + len); head_size is set on Complete
+inline ResponseParseStatus parse_response_head(const char* data, size_t len, HttpResponseHead& head, size_t& head_size) {
+    const char* end = data + len;
+    const char* head_end = nullptr;
+    for (const char* p = data; (p = http_find_byte(p, end, '\n')) < end; ++p) {
+        if (p > data && (p[-1] == '\n' || (p - data >= 2 && p[-1] == '\r' && p[-2] == '\n'))) {
+            head_end = p + 1;
+            break;
+        }
+    }
+    if (!head_end) {
+        return len > HTTP_MAX_HEADER_BYTES ? ResponseParseStatus::Invalid : ResponseParseStatus::Incomplete;
+    }
+    head_size = head_end - data;
+
+    auto next_line = [&](const char*& p) {
+        const char* lf = http_find_byte(p, head_end, '\n');
+        std::string_view line(p, (lf > p && lf[-1] == '\r' ? lf - 1 : lf) - p);
+        p = lf + 1;
+        return line;
+    };
+    const char* p = data;
+    std::string_view line = next_line(p);
+    if (line.size() < 12 || line.compare(0, 7, "HTTP/1.") != 0 || line[8] != ' ' ||
+        !isdigit(static_cast<unsigned char>(line[9])) || !isdigit(static_cast<unsigned char>(line[10])) ||
+        !isdigit(static_cast<unsigned char>(line[11]))) {
+        return ResponseParseStatus::Invalid;
+    }
+    head = HttpResponseHead();
+    head.http11 = line[7] == '1';
+    head.status = line.substr(9);
+    head.code = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+    head.close = !head.http11;
+    while (p < head_end) {
+        line = next_line(p);
+        if (line.empty()) {
+            break;
+        }
+        size_t colon = line.find(':');
+        if (colon == 0 || colon == std::string_view::npos || head.header_count == HTTP_MAX_HEADERS) {
+            return ResponseParseStatus::Invalid;
+        }
+        std::string_view name = line.substr(0, colon);
+        std::string_view value = line.substr(colon + 1);
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+            value.remove_prefix(1);
+        }
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+            value.remove_suffix(1);
+        }
+        head.headers[head.header_count++] = {name, value};
+        if (http_iequals(name, "Content-Length")) {
+            uint64_t n = 0;
+            if (value.empty() || value.size() > 18) {
+                return ResponseParseStatus::Invalid;
+            }
+            for (char c : value) {
+                if (c < '0' || c > '9') {
+                    return ResponseParseStatus::Invalid;
+                }
+                n = n * 10 + (c - '0');
+            }
+            if (head.has_content_length && n != head.content_length) {
+                return ResponseParseStatus::Invalid;
+            }
+            head.has_content_length = true;
+            head.content_length = n;
+        } else if (http_iequals(name, "Transfer-Encoding")) {
+            if (!http_iequals(value, "chunked")) {
+                return ResponseParseStatus::Invalid;
+            }
+            head.chunked = true;
+        } else if (http_iequals(name, "Connection")) {
+            if (http_iequals(value, "close")) {
+                head.close = true;
+            } else if (http_iequals(value, "keep-alive")) {
+                head.close = false;
+            }
+        }
+    }
+    if (head.chunked && head.has_content_length) {
+        return ResponseParseStatus::Invalid; // ambiguous framing, a response splitting vector
+    }
+    return ResponseParseStatus::Complete;
+}
+
+// Hop-by-hop headers, meaningful for one connection only and never forwarded (RFC 7230 6.1).
+// Expect is answered by the proxy itself, which relays the body without waiting upstream.
+inline bool is_hop_by_hop(std::string_view name) {
+    return http_iequals(name, "Connection") || http_iequals(name, "Keep-Alive") ||
+           http_iequals(name, "Proxy-Connection") || http_iequals(name, "TE") ||
+           http_iequals(name, "Upgrade") || http_iequals(name, "HTTP2-Settings") || http_iequals(name, "Expect");
+}
+
+// Methods whose effect is the same however often they are sent (RFC 9110 9.2.2): only these
+// are sent again after the upstream may already have received them
+inline bool is_idempotent(std::string_view method) {
+    return method == "GET" || method == "HEAD" || method == "OPTIONS" || method == "PUT" || method == "DELETE" ||
+           method == "TRACE";
+}
+
+// How the end of an upstream response body is found
+enum class ResponseFraming {
+    None,       // HEAD, 1xx, 204 and 304 responses
+    Length,     // Content-Length: relayed with splice
+    Chunked,    // relayed through user space, the decoder finds the last chunk
+    UntilClose, // the upstream closes the connection: relayed with splice, the client connection closes too
+};
+
+// A request forwarded upstream on behalf of one client connection. Only one is in flight per
+// connection; pipelined requests behind it wait, so responses stay in order.
+struct ProxyExchange {
+    Upstream* upstream = nullptr;
+    int fd = -1;
+    bool reused = false;     // taken from the pool, the upstream may have closed it meanwhile
+    bool connecting = false;
+    bool retryable = false;  // the whole request is still in request, it can be sent again
+    bool idempotent = false; // ... even when the upstream may have acted on it already
+    bool want_read = false;  // EPOLLIN registered on fd
+    bool want_write = false; // EPOLLOUT registered on fd
+    std::string request;     // bytes for the upstream; those before request_sent are written
+    size_t request_sent = 0;
+    uint64_t body_remaining = 0; // Content-Length request body bytes still to come from the client
+    bool body_chunked = false;   // ... or a chunked body, ended when the decoder says so
+    ChunkedDecoder body_decoder;
+    bool head_request = false;
+    bool keep_alive = false;     // of the client connection, after this response
+    std::string head;            // response head received so far
+    bool head_done = false;
+    ResponseFraming framing = ResponseFraming::None;
+    uint64_t response_remaining = 0;
+    ChunkedDecoder response_decoder;
+    bool upstream_keep_alive = false;
+    std::shared_ptr<PipeBuffer> pipe;
+    std::chrono::steady_clock::time_point started;
+
+    bool request_complete() const {
+        return body_remaining == 0 && !body_chunked && request_sent == request.size();
+    }
+};
+
+#endif // PROXY_H
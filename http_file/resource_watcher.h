@@ -0,0 +1,118 @@
+#ifndef RESOURCE_WATCHER_H
+#define RESOURCE_WATCHER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <unordered_map>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+
+// Watches a document root (and its subdirectories) with inotify and reports every path
+// that changed. Subscribers use it to drop cached state. is_dir is set when the path is a
+// directory, meaning "anything below here may have changed"; a queue overflow reports the root.
+class ResourceWatcher {
+public:
+    using Callback = std::function<void(const std::string& path, bool is_dir)>;
+
+    // Subscribe before start(); callbacks run on the watcher thread
+    void subscribe(Callback callback) {
+        callbacks_.push_back(std::move(callback));
+    }
+
+    bool start(const std::string& root) {
+        root_ = root;
+        fd_ = inotify_init1(IN_CLOEXEC);
+        if (fd_ < 0) {
+            perror("inotify_init1");
+            return false;
+        }
+        if (!add_watch_recursive(root_)) {
+            close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        std::thread(&ResourceWatcher::run, this).detach();
+        return true;
+    }
+
+private:
+    static constexpr uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                           IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+    bool add_watch_recursive(const std::string& dir) {
+        int wd = inotify_add_watch(fd_, dir.c_str(), WATCH_MASK | IN_ONLYDIR);
+        if (wd < 0) {
+            perror(("inotify_add_watch " + dir).c_str());
+            return false;
+        }
+        dirs_[wd] = dir;
+
+        DIR* d = opendir(dir.c_str());
+        if (!d) {
+            return true;
+        }
+        while (struct dirent* ent = readdir(d)) {
+            if (ent->d_type == DT_DIR && strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+                add_watch_recursive(dir + "/" + ent->d_name);
+            }
+        }
+        closedir(d);
+        return true;
+    }
+
+    void notify(const std::string& path, bool is_dir) {
+        for (const auto& callback : callbacks_) {
+            callback(path, is_dir);
+        }
+    }
+
+    void run() {
+        alignas(struct inotify_event) char buffer[64 * 1024];
+        while (true) {
+            ssize_t len = read(fd_, buffer, sizeof(buffer));
+            if (len <= 0) {
+                if (len < 0 && errno == EINTR) {
+                    continue;
+                }
+                perror("inotify read");
+                return;
+            }
+
+            for (char* p = buffer; p < buffer + len; ) {
+                auto* ev = reinterpret_cast<struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + ev->len;
+
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    notify(root_, true);
+                    continue;
+                }
+                auto it = dirs_.find(ev->wd);
+                if (it == dirs_.end()) {
+                    continue;
+                }
+                std::string path = ev->len ? it->second + "/" + ev->name : it->second;
+                bool is_dir = (ev->mask & IN_ISDIR) || ev->len == 0;
+                if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    add_watch_recursive(path);
+                }
+                if (ev->mask & IN_IGNORED) {
+                    dirs_.erase(it);
+                }
+                notify(path, is_dir);
+            }
+        }
+    }
+
+    int fd_ = -1;
+    std::string root_;
+    std::unordered_map<int, std::string> dirs_; // watch descriptor -> directory path
+    std::vector<Callback> callbacks_;
+};
+
+#endif // RESOURCE_WATCHER_H
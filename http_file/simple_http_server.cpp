@@ -1,186 +1,2615 @@
 #include <iostream>
-#include <fstream>
-#include <sstream>
+#include <string_view>
 #include <string>
 #include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <ctime>
+#include <algorithm>
+#include <csignal>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <dirent.h>
 #include <map>
 #include <thread>
 #include <vector>
+#include <unordered_map>
+#include <memory>
+#include <strings.h>
+#include <charconv>
+
+#include "file_cache.h"
+#include "path_cache.h"
+#include "virtual_host.h"
+#include "resource_watcher.h"
+#include "dir_index.h"
+#include "http_parser.h"
+#include "content_encoding.h"
+#include "mime_registry.h"
+#include "output_queue.h"
+#include "http2.h"
+#include "admission.h"
+#include "tls.h"
+#include "proxy.h"
+#include "upload.h"
+#include "mp4_index.h"
+#include "trace.h"
+#include "../common/metrics.h"
 
 #define PORT 8080
+#define TLS_PORT 8443                // HTTPS, served when a certificate is given
+#define DOCUMENT_ROOT "resources"    // Default site, served for any Host without a --vhost of its own
 #define BUFFER_SIZE 4096
+#define MAX_EVENTS 1024
+#define MAX_REQUEST_SIZE 65536       // Reject requests whose headers are still incomplete past this size
+#define READ_BYTES_PER_WAKEUP (MAX_REQUEST_SIZE + BUFFER_SIZE) // Read per readiness event, a fast sender can't starve the reactor
+#define IDLE_TIMEOUT 15              // Seconds before an idle keep-alive connection is closed
+#define MAX_KEEPALIVE_REQUESTS 10000 // Requests per connection before answering Connection: close
+#define MAX_IOVECS 64                // Memory chunks gathered into one writev
+#define SEND_QUEUE_HIGH_WATER (256 * 1024) // Buffered response bytes at which a connection stops reading
+#define SEND_QUEUE_LOW_WATER (64 * 1024)   // ... and resumes once the client has drained it to here
+#define SEND_QUEUE_MAX_CHUNKS 4096         // Queued chunks (file references, memory pieces) per connection
+#define MAX_RANGES 16                // Range requests with more parts are answered with the full file
+#define MULTIPART_BOUNDARY "SIMPLE_HTTP_SERVER_BYTERANGES"
+#define CACHE_CAPACITY (64 * 1024 * 1024) // Memory cap of the hot file cache
+#define CACHE_MAX_ENTRY_SIZE (1024 * 1024) // Larger files are always sent from disk with sendfile
+#define DIR_PAGE_SIZE 1000                 // Entries per page of the directory listing
+#define MAX_ACCEPTS_PER_WAKEUP 64          // Connections accepted before serving the ready ones again
+#define STREAM_SOURCE_SUFFIX ".mp4"         // Files offered as HLS (".mp4.m3u8") and DASH (".mp4.mpd") too
+#define PROXY_PREFIX "/api/"               // Requests below it go to the upstreams, see --upstream
+#define TRACE_SAMPLE_RATE 100              // One request in this many is traced, see --trace-sample
+
+// MIME types by extension: a compile-time perfect hash, replaced at startup by --mime-types
+MimeRegistry mime_registry;
+
+#define DEFAULT_CACHE_CONTROL "public, max-age=3600"
+
+// Cache-Control policy per MIME type, a "type/" key covers a whole top-level type.
+// HTML is revalidated on every use so new pages show up at once; it is cheap thanks to 304s.
+std::map<std::string, std::string, std::less<>> cache_policies = {
+    {"text/html", "no-cache"},
+    {"text/css", "public, max-age=86400"},
+    {"text/javascript", "public, max-age=86400"},
+    {"application/javascript", "public, max-age=86400"},
+    {"image/", "public, max-age=604800"},
+    {"video/", "public, max-age=604800"}
+};
+
+std::string_view get_cache_control(std::string_view mime_type) {
+    auto it = cache_policies.find(mime_type);
+    if (it == cache_policies.end()) {
+        it = cache_policies.find(mime_type.substr(0, mime_type.find('/') + 1));
+    }
+    return it != cache_policies.end() ? std::string_view(it->second) : DEFAULT_CACHE_CONTROL;
+}
+
+FileCache file_cache(CACHE_CAPACITY, CACHE_MAX_ENTRY_SIZE);
+TlsContext tls_context; // HTTPS is off until main loads a certificate
+AdmissionController admission{AdmissionConfig()}; // limits are set from the command line before reactors start
+PathCache path_cache(PATH_CACHE_CAPACITY);
+Mp4IndexCache mp4_index_cache;
+VirtualHosts virtual_hosts; // set up by main before reactors start
+UpstreamGroup upstreams;    // reverse proxy backends, none unless --upstream is given
+uint64_t max_upload_size = 0; // largest PUT/POST body stored; 0: uploads refused, see --uploads
+
+// Drop everything cached about a path below a document root: called by the inotify watcher,
+// and by a reactor for the files it stores itself so the next request already sees them
+void invalidate_cached(const std::string& path, bool is_dir) {
+    file_cache.invalidate(path, is_dir);
+    path_cache.invalidate(path, is_dir);
+    mp4_index_cache.invalidate(path, is_dir);
+    // A precompressed sibling changed: the cached entry of the file it belongs to embeds it
+    for (int encoding = 0; encoding < ENCODING_COUNT; ++encoding) {
+        size_t suffix = strlen(encoding_suffix(encoding));
+        if (!is_dir && path.size() > suffix && path.compare(path.size() - suffix, suffix, encoding_suffix(encoding)) == 0) {
+            file_cache.invalidate(path.substr(0, path.size() - suffix), false);
+        }
+    }
+}
+
+// Code of a status line such as "404 Not Found"
+int status_code(const char* status) {
+    return (status[0] - '0') * 100 + (status[1] - '0') * 10 + (status[2] - '0');
+}
+
+// Everything the server counts, exported at /metrics. Registered once at startup; recording
+// is a relaxed add on the reactor thread's own slot, cheap enough for every request and write.
+struct ServerMetrics {
+    Counter& accepted = metrics().counter("http_connections_accepted_total", "Connections accepted.");
+    Counter& rejected_server = metrics().counter("http_connections_rejected_total",
+        "Connections refused by admission control.", "reason=\"server_limit\"");
+    Counter& rejected_client = metrics().counter("http_connections_rejected_total",
+        "Connections refused by admission control.", "reason=\"client_limit\"");
+    Gauge& open = metrics().gauge("http_connections_open", "Client connections currently open.");
+    Counter& tls_full = metrics().counter("http_tls_handshakes_total", "Completed TLS handshakes.", "resumed=\"false\"");
+    Counter& tls_resumed = metrics().counter("http_tls_handshakes_total", "Completed TLS handshakes.", "resumed=\"true\"");
+    Counter& tls_kernel = metrics().counter("http_tls_kernel_send_total", "TLS connections whose records the kernel encrypts (kTLS).");
+    Counter& h2 = metrics().counter("http2_connections_total", "Connections that switched to HTTP/2.");
+    Histogram& duration = metrics().histogram("http_request_duration_seconds",
+        "Time to produce a response and queue it, transmission excluded.");
+    Counter& shed = metrics().counter("http_requests_shed_total", "Requests refused by queue-delay shedding.");
+    Counter& rate_limited = metrics().counter("http_requests_rate_limited_total", "Requests refused by the per-address rate limit.");
+    Counter& cache_hit = metrics().counter("http_file_cache_lookups_total", "File cache lookups.", "result=\"hit\"");
+    Counter& cache_miss = metrics().counter("http_file_cache_lookups_total", "File cache lookups.", "result=\"miss\"");
+    Counter& received = metrics().counter("http_received_bytes_total", "Bytes read from clients, after TLS decryption.");
+    Counter& sent = metrics().counter("http_sent_bytes_total", "Bytes written to clients, before TLS encryption.");
+    Counter& proxied = metrics().counter("http_upstream_requests_total", "Requests forwarded to an upstream.", "result=\"ok\"");
+    Counter& proxy_failed = metrics().counter("http_upstream_requests_total", "Requests forwarded to an upstream.", "result=\"error\"");
+    Counter& proxy_reused = metrics().counter("http_upstream_connections_reused_total", "Upstream requests sent on a pooled keep-alive connection.");
+    Counter& uploads = metrics().counter("http_uploads_total", "PUT and POST bodies stored as files.", "result=\"ok\"");
+    Counter& uploads_failed = metrics().counter("http_uploads_total", "PUT and POST bodies stored as files.", "result=\"error\"");
+    Counter& paused = metrics().counter("http_reading_paused_total", "Times a connection stopped reading because its send queue was full.");
+    Counter* responses[600] = {}; // by status code, codes the server never sends count as "other"
+    Counter& other = metrics().counter("http_responses_total", "Responses by status code.", "code=\"other\"");
 
-// MIME types mapping
-std::map<std::string, std::string> mime_types = {
-    {".jpg", "image/jpeg"},
-    {".jpeg", "image/jpeg"},
-    {".png", "image/png"},
-    {".gif", "image/gif"},
-    {".mp4", "video/mp4"},
-    {".txt", "text/plain"},
-    {".html", "text/html"},
-    {".css", "text/css"},
-    {".js", "application/javascript"}
+    ServerMetrics() {
+        for (int code : {200, 201, 206, 304, 400, 403, 404, 405, 409, 413, 414, 416, 421, 429, 431, 500, 501, 502, 503, 504, 507}) {
+            responses[code] = &metrics().counter("http_responses_total", "Responses by status code.",
+                                                 "code=\"" + std::to_string(code) + "\"");
+        }
+    }
+
+    void response(int code) {
+        (code >= 0 && code < 600 && responses[code] ? *responses[code] : other).inc();
+    }
 };
 
-// Function to get the MIME type based on file extension
-std::string get_mime_type(const std::string& filename) {
-    size_t pos = filename.find_last_of('.');
-    if (pos != std::string::npos) {
-        std::string ext = filename.substr(pos);
-        auto it = mime_types.find(ext);
-        if (it != mime_types.end()) {
-            return it->second;
+ServerMetrics server_metrics;
+
+// Sampled request traces, written on SIGUSR1
+TraceCollector trace_collector;
+size_t trace_sample_rate = TRACE_SAMPLE_RATE; // 0: tracing off
+
+// Body of a static response: a cached in-memory copy, or an open file sent with sendfile.
+// With both, the body is the bytes followed by the file from file_offset (an MP4 fragment).
+struct StaticBody {
+    std::shared_ptr<OpenFile> file;
+    std::shared_ptr<const std::string> bytes;
+    uint64_t file_offset = 0;
+    uint64_t size = 0;
+    time_t mtime = 0;
+    // Header text of this representation, owned by the cache entry or the caller
+    std::string_view etag;
+    std::string_view validators;    // ETag and Last-Modified lines
+    std::string_view extra_headers; // Content-Encoding / Vary / Cache-Control lines
+
+    void append_to(OutputQueue& out, uint64_t offset, uint64_t length) const {
+        if (bytes) {
+            uint64_t n = offset < bytes->size() ? std::min<uint64_t>(length, bytes->size() - offset) : 0;
+            if (n > 0) {
+                out.append_shared(bytes, offset, n);
+            }
+            if (!file || length == n) {
+                return;
+            }
+            offset = offset + n - bytes->size();
+            length -= n;
         }
+        out.append_file(file, file_offset + offset, length);
+    }
+};
+
+// Format a timestamp as an HTTP-date (RFC 7231 IMF-fixdate)
+std::string format_http_date(time_t t) {
+    char buf[64];
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+}
+
+// Parse an IMF-fixdate, returns -1 if the value is not a valid date
+time_t parse_http_date(std::string_view value) {
+    char buf[64];
+    if (value.size() >= sizeof(buf)) {
+        return -1;
     }
-    return "application/octet-stream";
+    memcpy(buf, value.data(), value.size());
+    buf[value.size()] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
 }
 
-// Function to read file content into a string
-bool read_file_content(const std::string& path, std::string& content) {
-    std::ifstream file(path, std::ios::binary);
-    if (!file.is_open()) {
+// Parse a non-empty decimal number, false on overflow or stray characters
+bool parse_u64(std::string_view digits, uint64_t& value) {
+    if (digits.empty() || digits.size() > 19 || digits.find_first_not_of("0123456789") != std::string_view::npos) {
         return false;
     }
-    content.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-    file.close();
+    value = 0;
+    for (char c : digits) {
+        value = value * 10 + (c - '0');
+    }
     return true;
 }
 
-// Function to list directory contents
-std::string list_directory_contents(const std::string& dir_path) {
-    DIR* dir;
-    struct dirent* ent;
-    std::ostringstream oss;
+// Inclusive byte range of a representation
+struct ByteRange {
+    uint64_t first;
+    uint64_t last;
+};
 
-    if ((dir = opendir(dir_path.c_str())) != nullptr) {
-        while ((ent = readdir(dir)) != nullptr) {
-            if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-                oss << "<li><a href=\"/" << ent->d_name << "\">" << ent->d_name << "</a></li>";
+// Parse a Range header against a representation of the given size (RFC 7233).
+// Returns false when the header must be ignored (not a bytes range, malformed, too many parts);
+// otherwise ranges holds the satisfiable parts sorted and coalesced, empty meaning 416.
+bool parse_range_header(std::string_view value, uint64_t size, std::vector<ByteRange>& ranges) {
+    if (value.compare(0, 6, "bytes=") != 0) {
+        return false;
+    }
+    std::string_view specs = value.substr(6);
+    size_t parts = 0;
+    while (!specs.empty()) {
+        size_t comma = std::min(specs.find(','), specs.size());
+        std::string_view spec = specs.substr(0, comma);
+        specs.remove_prefix(std::min(comma + 1, specs.size()));
+        while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t')) {
+            spec.remove_prefix(1);
+        }
+        while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t')) {
+            spec.remove_suffix(1);
+        }
+        if (spec.empty()) {
+            continue;
+        }
+        if (++parts > MAX_RANGES) {
+            return false;
+        }
+        size_t dash = spec.find('-');
+        if (dash == std::string_view::npos ||
+            spec.find_first_not_of("0123456789-") != std::string_view::npos ||
+            spec.find('-', dash + 1) != std::string_view::npos) {
+            return false;
+        }
+        std::string_view first = spec.substr(0, dash), last = spec.substr(dash + 1);
+        if (first.empty()) {
+            // Suffix range: the final N bytes
+            uint64_t suffix;
+            if (!parse_u64(last, suffix)) {
+                return false;
+            }
+            if (suffix > 0 && size > 0) {
+                ranges.push_back({size - std::min(suffix, size), size - 1});
             }
+            continue;
         }
-        closedir(dir);
-    } else {
-        oss << "<li>No files found</li>";
+        uint64_t a, b = UINT64_MAX;
+        if (!parse_u64(first, a) || (!last.empty() && !parse_u64(last, b)) || b < a) {
+            return false;
+        }
+        if (a < size) {
+            ranges.push_back({a, std::min(b, size - 1)});
+        }
+    }
+    if (parts == 0) {
+        return false;
+    }
+
+    // Coalesce overlapping or adjacent parts so a client can't make us send the same bytes repeatedly
+    std::sort(ranges.begin(), ranges.end(), [](const ByteRange& x, const ByteRange& y) { return x.first < y.first; });
+    size_t merged = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (merged > 0 && ranges[i].first <= ranges[merged - 1].last + 1) {
+            ranges[merged - 1].last = std::max(ranges[merged - 1].last, ranges[i].last);
+        } else {
+            ranges[merged++] = ranges[i];
+        }
+    }
+    ranges.resize(merged);
+    return true;
+}
+
+// Resolve the request target to a path below the document root: drop the query string,
+// percent-decode, and collapse "." and ".." segments. Returns false if the target escapes
+// the root or is malformed. The result is also the cache key, so equivalent spellings of a
+// path share one entry and inotify invalidation (which reports canonical paths) reaches it.
+// path is rewritten in place, so a reused buffer makes this allocation free.
+bool normalize_request_path(std::string_view target, std::string& path) {
+    size_t end = target.find_first_of("?#");
+    if (end == std::string_view::npos) {
+        end = target.size();
+    }
+    if (end == 0 || target[0] != '/') {
+        return false;
+    }
+    path.clear();
+    for (size_t i = 0; i < end; ++i) {
+        char c = target[i];
+        if (c == '%') {
+            if (i + 2 >= end || !isxdigit(static_cast<unsigned char>(target[i + 1])) ||
+                !isxdigit(static_cast<unsigned char>(target[i + 2]))) {
+                return false;
+            }
+            auto hex = [](char h) { return isdigit(static_cast<unsigned char>(h)) ? h - '0' : (tolower(h) - 'a' + 10); };
+            c = static_cast<char>(hex(target[i + 1]) * 16 + hex(target[i + 2]));
+            i += 2;
+            if (c == '\0') {
+                return false;
+            }
+        }
+        path += c;
+    }
+
+    // Collapse segments in place: the write position never overtakes the read position
+    size_t out = 0, pos = 0;
+    while (pos < path.size()) {
+        while (pos < path.size() && path[pos] == '/') {
+            ++pos;
+        }
+        size_t start = pos;
+        while (pos < path.size() && path[pos] != '/') {
+            ++pos;
+        }
+        size_t len = pos - start;
+        if (len == 0 || (len == 1 && path[start] == '.')) {
+            continue;
+        }
+        if (len == 2 && path[start] == '.' && path[start + 1] == '.') {
+            if (out == 0) {
+                return false;
+            }
+            out = path.find_last_of('/', out - 1);
+            continue;
+        }
+        path[out++] = '/';
+        memmove(&path[out], &path[start], len);
+        out += len;
+    }
+    path.resize(out);
+    if (path.empty()) {
+        path = "/";
+    }
+    return true;
+}
+
+// Value of a query string parameter in the request target, empty if absent
+std::string_view query_param(std::string_view target, std::string_view name) {
+    size_t query = target.find('?');
+    while (query != std::string_view::npos) {
+        size_t start = query + 1;
+        size_t end = target.find_first_of("&#", start);
+        std::string_view pair = target.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start);
+        if (pair.size() > name.size() && pair.compare(0, name.size(), name) == 0 && pair[name.size()] == '=') {
+            return pair.substr(name.size() + 1);
+        }
+        query = (end != std::string_view::npos && target[end] == '&') ? end : std::string_view::npos;
+    }
+    return "";
+}
+
+// If-None-Match: true if any listed entity tag (or "*") matches the current one (weak comparison)
+bool etag_matches(std::string_view header, std::string_view etag) {
+    auto strip_weak = [](std::string_view tag) {
+        return tag.compare(0, 2, "W/") == 0 ? tag.substr(2) : tag;
+    };
+    std::string_view current = strip_weak(etag);
+    size_t pos = 0;
+    while (pos < header.size()) {
+        size_t comma = header.find(',', pos);
+        if (comma == std::string_view::npos) {
+            comma = header.size();
+        }
+        std::string_view tag = header.substr(pos, comma - pos);
+        while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) {
+            tag.remove_prefix(1);
+        }
+        while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) {
+            tag.remove_suffix(1);
+        }
+        if (tag == "*" || strip_weak(tag) == current) {
+            return true;
+        }
+        pos = comma + 1;
+    }
+    return false;
+}
+
+const char* connection_header(bool keep_alive) {
+    return keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+// Responses are written straight into the connection's output queue from preformatted
+// pieces (string literals and header lines precomputed per cached file) instead of being
+// assembled in temporary strings: status line, then header lines, then the Connection line.
+void begin_head(OutputQueue& out, const char* status) {
+    int code = status_code(status);
+    server_metrics.response(code);
+    if (TraceRecord* record = trace_current()) {
+        record->status = code;
+    }
+    out.append("HTTP/1.1 ");
+    out.append(status, strlen(status));
+    out.append("\r\n");
+}
+
+void append_header(OutputQueue& out, std::string_view name, std::string_view value) {
+    out.append(name);
+    out.append(": ");
+    out.append(value);
+    out.append("\r\n");
+}
+
+void append_header(OutputQueue& out, std::string_view name, uint64_t value) {
+    out.append(name);
+    out.append(": ");
+    out.append_number(value);
+    out.append("\r\n");
+}
+
+void end_head(OutputQueue& out, bool keep_alive) {
+    out.append(connection_header(keep_alive));
+}
+
+// Status line plus Content-Type (when given) and Content-Length
+void append_head(OutputQueue& out, const char* status, std::string_view content_type, uint64_t content_length) {
+    begin_head(out, status);
+    if (!content_type.empty()) {
+        append_header(out, "Content-Type", content_type);
+    }
+    append_header(out, "Content-Length", content_length);
+}
+
+// Cheap answer for a request or connection turned away under load
+void append_retry_later(OutputQueue& out, const char* status, bool keep_alive) {
+    append_head(out, status, "", 0);
+    out.append("Retry-After: 1\r\n");
+    end_head(out, keep_alive);
+}
+
+// Queue a complete response whose body is already in memory
+void append_response(OutputQueue& out, const char* status, std::string_view content_type,
+                     std::string_view body, bool keep_alive) {
+    append_head(out, status, content_type, body.size());
+    end_head(out, keep_alive);
+    out.append(body);
+}
+
+// Strong entity tag of a file version from its inode, size and modification time
+std::string file_etag(const struct stat& st) {
+    char buf[96];
+    snprintf(buf, sizeof(buf), "\"%llx-%llx-%llx.%lx\"", static_cast<unsigned long long>(st.st_ino),
+             static_cast<unsigned long long>(st.st_size), static_cast<unsigned long long>(st.st_mtim.tv_sec),
+             static_cast<unsigned long>(st.st_mtim.tv_nsec));
+    return buf;
+}
+
+// Each content coding is a different representation with different bytes, so its own tag
+std::string representation_etag(const std::string& etag, int encoding) {
+    if (encoding == ENCODING_IDENTITY) {
+        return etag;
+    }
+    return etag.substr(0, etag.size() - 1) + "-" + encoding_name(encoding) + "\"";
+}
+
+// If-Range: only honour the Range header when the client's copy is still current.
+// Entity tags use the strong comparison, so a weak tag never matches.
+bool if_range_matches(const HttpRequest& req, const StaticBody& body) {
+    const std::string_view* if_range = req.header("If-Range");
+    if (!if_range) {
+        return true;
+    }
+    if (!if_range->empty() && if_range->front() == '"') {
+        return *if_range == body.etag;
+    }
+    if (if_range->compare(0, 2, "W/") == 0) {
+        return false;
     }
+    time_t date = parse_http_date(*if_range);
+    return date != -1 && date == body.mtime;
+}
+
+// If-None-Match / If-Modified-Since: true if the client's copy is current and a 304 will do.
+// If-None-Match takes precedence when both are present (RFC 7232 section 6).
+bool not_modified(const HttpRequest& req, const StaticBody& body) {
+    if (const std::string_view* if_none_match = req.header("If-None-Match")) {
+        return etag_matches(*if_none_match, body.etag);
+    }
+    if (const std::string_view* if_modified_since = req.header("If-Modified-Since")) {
+        time_t date = parse_http_date(*if_modified_since);
+        return date != -1 && body.mtime <= date;
+    }
+    return false;
+}
+
+// ETag and Last-Modified lines
+std::string validator_headers(time_t mtime, const std::string& etag) {
+    return "ETag: " + etag + "\r\nLast-Modified: " + format_http_date(mtime) + "\r\n";
+}
+
+size_t decimal_digits(uint64_t value) {
+    size_t digits = 1;
+    while (value >= 10) {
+        value /= 10;
+        ++digits;
+    }
+    return digits;
+}
+
+#define PART_HEAD_PREFIX "\r\n--" MULTIPART_BOUNDARY "\r\nContent-Type: "
+#define PART_HEAD_RANGE "\r\nContent-Range: bytes "
+#define MULTIPART_TRAILER "\r\n--" MULTIPART_BOUNDARY "--\r\n"
+
+// Length of one multipart/byteranges part header, known before it is written
+size_t part_head_size(std::string_view mime_type, const ByteRange& r, uint64_t size) {
+    return strlen(PART_HEAD_PREFIX) + mime_type.size() + strlen(PART_HEAD_RANGE) + decimal_digits(r.first) + 1
+           + decimal_digits(r.last) + 1 + decimal_digits(size) + 4;
+}
 
-    return oss.str();
+void append_part_head(OutputQueue& out, std::string_view mime_type, const ByteRange& r, uint64_t size) {
+    out.append(PART_HEAD_PREFIX);
+    out.append(mime_type);
+    out.append(PART_HEAD_RANGE);
+    out.append_number(r.first);
+    out.append("-");
+    out.append_number(r.last);
+    out.append("/");
+    out.append_number(size);
+    out.append("\r\n\r\n");
 }
 
-// Function to handle client requests
-void handle_client(int client_socket) {
-    char buffer[BUFFER_SIZE] = {0};
-    ssize_t bytes_read = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes_read <= 0) {
-        std::cerr << "Failed to read request" << std::endl;
-        close(client_socket);
+// Send a static file, honouring Range requests with 206 single-part or multipart/byteranges responses.
+// full_headers, when given, are the precomputed header lines of the full 200 response.
+void serve_file(const HttpRequest& req, OutputQueue& out, bool keep_alive, const StaticBody& body,
+                std::string_view mime_type, std::string_view full_headers) {
+    uint64_t size = body.size;
+
+    // A 304 repeats the validators and caching headers a 200 would carry, without a body
+    if (not_modified(req, body)) {
+        begin_head(out, "304 Not Modified");
+        out.append(body.validators);
+        out.append(body.extra_headers);
+        end_head(out, keep_alive);
+        return;
+    }
+
+    // Reused per reactor thread, parsing a Range header doesn't allocate once warmed up
+    static thread_local std::vector<ByteRange> ranges;
+    ranges.clear();
+    const std::string_view* range = req.header("Range");
+    if (!range || !if_range_matches(req, body) || !parse_range_header(*range, size, ranges)) {
+        if (!full_headers.empty()) {
+            begin_head(out, "200 OK");
+            out.append(full_headers);
+        } else {
+            append_head(out, "200 OK", mime_type, size);
+            out.append("Accept-Ranges: bytes\r\n");
+            out.append(body.validators);
+            out.append(body.extra_headers);
+        }
+        end_head(out, keep_alive);
+        body.append_to(out, 0, size);
         return;
     }
 
-    std::string request(buffer);
-    std::istringstream iss(request);
-    std::string method, path, http_version;
-    iss >> method >> path >> http_version;
+    if (ranges.empty()) {
+        append_head(out, "416 Range Not Satisfiable", "", 0);
+        out.append("Content-Range: bytes */");
+        out.append_number(size);
+        out.append("\r\n");
+        end_head(out, keep_alive);
+        return;
+    }
 
-    if (method != "GET") {
-        std::string response = "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
-        send(client_socket, response.c_str(), response.size(), 0);
-        close(client_socket);
+    // Ranges address the representation being sent, i.e. the encoded bytes when a coding applies
+    if (ranges.size() == 1) {
+        const ByteRange& r = ranges[0];
+        append_head(out, "206 Partial Content", mime_type, r.last - r.first + 1);
+        out.append("Accept-Ranges: bytes\r\n");
+        out.append(body.validators);
+        out.append(body.extra_headers);
+        out.append("Content-Range: bytes ");
+        out.append_number(r.first);
+        out.append("-");
+        out.append_number(r.last);
+        out.append("/");
+        out.append_number(size);
+        out.append("\r\n");
+        end_head(out, keep_alive);
+        body.append_to(out, r.first, r.last - r.first + 1);
         return;
     }
 
-    // Handle root path
-    if (path == "/") {
-        std::string dir_contents = list_directory_contents("resources");
-        std::ostringstream oss;
-        oss << "HTTP/1.1 200 OK\r\n"
-            << "Content-Type: text/html\r\n"
-            << "Content-Length: " << dir_contents.size() + 75 << "\r\n"
-            << "Connection: close\r\n\r\n"
-            << "<html><body><h1>Resources Directory</h1><ul>"
-            << dir_contents
-            << "</ul></body></html>";
-
-        std::string response = oss.str();
-        send(client_socket, response.c_str(), response.size(), 0);
-        close(client_socket);
+    // Multipart: part headers are small memory chunks, part bodies still go through sendfile
+    uint64_t content_length = strlen(MULTIPART_TRAILER);
+    for (const ByteRange& r : ranges) {
+        content_length += part_head_size(mime_type, r, size) + (r.last - r.first + 1);
+    }
+    append_head(out, "206 Partial Content", "multipart/byteranges; boundary=" MULTIPART_BOUNDARY, content_length);
+    out.append("Accept-Ranges: bytes\r\n");
+    out.append(body.validators);
+    out.append(body.extra_headers);
+    end_head(out, keep_alive);
+    for (const ByteRange& r : ranges) {
+        append_part_head(out, mime_type, r, size);
+        body.append_to(out, r.first, r.last - r.first + 1);
+    }
+    out.append(MULTIPART_TRAILER);
+}
+
+// Content-Encoding, Vary and Cache-Control lines of a static response. Every response for a
+// compressible type varies on Accept-Encoding, including the identity one.
+std::string representation_headers(std::string_view mime_type, int encoding) {
+    std::string headers = "Cache-Control: ";
+    headers += get_cache_control(mime_type);
+    headers += "\r\n";
+    if (encoding != ENCODING_IDENTITY) {
+        headers += "Content-Encoding: ";
+        headers += encoding_name(encoding);
+        headers += "\r\n";
+    }
+    if (is_compressible(mime_type)) {
+        headers += "Vary: Accept-Encoding\r\n";
+    }
+    return headers;
+}
+
+// Preformat every header a cached representation is served with
+CachedRepresentation make_representation(std::shared_ptr<const std::string> body, const std::string& mime_type,
+                                         time_t mtime, const std::string& file_tag, int encoding) {
+    CachedRepresentation representation;
+    representation.etag = representation_etag(file_tag, encoding);
+    representation.validators = validator_headers(mtime, representation.etag);
+    representation.extra_headers = representation_headers(mime_type, encoding);
+    representation.headers = "Content-Type: " + mime_type + "\r\nContent-Length: " + std::to_string(body->size())
+                             + "\r\nAccept-Ranges: bytes\r\n" + representation.validators + representation.extra_headers;
+    representation.body = std::move(body);
+    return representation;
+}
+
+// Read a whole file into memory, nullptr on a read error
+std::shared_ptr<std::string> read_file(const OpenFile& file) {
+    TraceScope trace(TRACE_READ);
+    auto bytes = std::make_shared<std::string>(file.st.st_size, '\0');
+    size_t done = 0;
+    while (done < bytes->size()) {
+        ssize_t n = pread(file.fd, &(*bytes)[done], bytes->size() - done, done);
+        if (n <= 0) {
+            return nullptr;
+        }
+        done += n;
+    }
+    return bytes;
+}
+
+// Precompressed sibling (file.gz, file.br) of a file, ignored when older than the file itself
+std::shared_ptr<OpenFile> open_sibling(const VirtualHost& host, const std::string& path, int encoding, time_t mtime) {
+    std::shared_ptr<OpenFile> sibling = path_cache.open_file(host.root_fd, path + encoding_suffix(encoding), host.root.size());
+    if (!sibling || sibling->st.st_mtime < mtime) {
+        return nullptr;
+    }
+    return sibling;
+}
+
+// Read a small file fully into a cache entry with its 200 response headers precomputed
+std::shared_ptr<const CacheEntry> load_cache_entry(const OpenFile& file, std::string_view mime_type) {
+    std::shared_ptr<std::string> body = read_file(file);
+    if (!body) {
+        return nullptr;
+    }
+
+    auto entry = std::make_shared<CacheEntry>();
+    entry->mime_type = std::string(mime_type);
+    entry->size = file.st.st_size;
+    entry->mtime = file.st.st_mtime;
+    entry->identity = make_representation(std::move(body), entry->mime_type, entry->mtime, file_etag(file.st),
+                                          ENCODING_IDENTITY);
+    return entry;
+}
+
+// Copy of a cache entry extended with one content-coded body: the precompressed sibling when
+// there is a fresh one, otherwise compressed here. The copy replaces the cached entry, so each
+// coding is produced once per file version; generation guards against caching stale bytes.
+std::shared_ptr<const CacheEntry> add_encoding(const VirtualHost& host, const std::string& path, const CacheEntry& base,
+                                               int encoding, uint64_t generation) {
+    auto entry = std::make_shared<CacheEntry>(base);
+    entry->encoded_known[encoding] = true;
+
+    std::shared_ptr<std::string> encoded;
+    if (std::shared_ptr<OpenFile> sibling = open_sibling(host, path, encoding, base.mtime)) {
+        if (static_cast<uint64_t>(sibling->st.st_size) <= file_cache.max_entry_size()) {
+            encoded = read_file(*sibling);
+        }
+    } else {
+        encoded = std::make_shared<std::string>();
+        TraceScope trace(TRACE_COMPRESS);
+        if (!compress_body(encoding, *base.identity.body, *encoded)) {
+            encoded = nullptr;
+        }
+    }
+
+    // Only keep a coding that actually saves bytes
+    if (encoded && encoded->size() < base.size) {
+        entry->encoded[encoding] = make_representation(std::move(encoded), base.mime_type, base.mtime,
+                                                       base.identity.etag, encoding);
+    }
+    file_cache.insert(path, entry, generation);
+    return entry;
+}
+
+void serve_cached(const HttpRequest& req, OutputQueue& out, bool keep_alive, const VirtualHost& host,
+                  const std::string& path, std::shared_ptr<const CacheEntry> entry, int encoding, uint64_t generation) {
+    if (encoding != ENCODING_IDENTITY && !entry->encoded_known[encoding]) {
+        entry = add_encoding(host, path, *entry, encoding, generation);
+    }
+    const CachedRepresentation& representation =
+        encoding != ENCODING_IDENTITY && entry->encoded[encoding].body ? entry->encoded[encoding] : entry->identity;
+
+    StaticBody body;
+    body.bytes = representation.body;
+    body.size = representation.body->size();
+    body.mtime = entry->mtime;
+    body.etag = representation.etag;
+    body.validators = representation.validators;
+    body.extra_headers = representation.extra_headers;
+    serve_file(req, out, keep_alive, body, entry->mime_type, representation.headers);
+}
+
+// Serve the whole directory listing (?page=all) as a generated body: chunked for HTTP/1.1,
+// framed by HTTP/2 itself, and rendered in full for HTTP/1.0 clients, which know neither
+void serve_directory_listing(const HttpRequest& req, OutputQueue& out, bool keep_alive, DirectoryIndex& index) {
+    TraceScope trace(TRACE_LISTING);
+    DirectoryIndex::Listing listing = index.listing();
+    const std::string_view* if_none_match = req.header("If-None-Match");
+    bool current = if_none_match && etag_matches(*if_none_match, listing.etag);
+    std::string body;
+    if (current) {
+        begin_head(out, "304 Not Modified");
+    } else if (req.http_version == "HTTP/1.0") {
+        while (listing.body->next(body, SIZE_MAX)) {
+        }
+        append_head(out, "200 OK", "text/html", body.size());
+    } else {
+        begin_head(out, "200 OK");
+        append_header(out, "Content-Type", "text/html");
+    }
+    append_header(out, "ETag", listing.etag);
+    append_header(out, "Cache-Control", get_cache_control("text/html"));
+    bool chunked = !current && req.http_version == "HTTP/1.1";
+    if (chunked) {
+        out.append("Transfer-Encoding: chunked\r\n");
+    }
+    end_head(out, keep_alive);
+    if (current) {
         return;
     }
+    if (req.http_version == "HTTP/1.0") {
+        out.append(body);
+    } else {
+        out.append_source(std::move(listing.body), chunked);
+    }
+}
 
-    std::string file_path = "resources" + path;
-    std::string content;
-    if (!read_file_content(file_path, content)) {
-        std::string response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
-        send(client_socket, response.c_str(), response.size(), 0);
-        close(client_socket);
+// Serve one page (?page=N) of a cached directory listing, or 304 if the client's copy is current
+void serve_directory_index(const HttpRequest& req, OutputQueue& out, bool keep_alive, DirectoryIndex& index) {
+    std::string_view page_param = query_param(req.path, "page");
+    if (page_param == "all") {
+        serve_directory_listing(req, out, keep_alive, index);
         return;
     }
+    uint64_t number = 1;
+    if (!page_param.empty() && !parse_u64(page_param, number)) {
+        number = 1;
+    }
+    TraceScope trace(TRACE_LISTING);
+    DirectoryIndex::Page page = index.page(number);
 
-    std::string mime_type = get_mime_type(file_path);
-    std::ostringstream oss;
-    oss << "HTTP/1.1 200 OK\r\n"
-        << "Content-Type: " << mime_type << "\r\n"
-        << "Content-Length: " << content.size() << "\r\n"
-        << "Connection: close\r\n\r\n"
-        << content;
+    const std::string_view* if_none_match = req.header("If-None-Match");
+    bool current = if_none_match && etag_matches(*if_none_match, page.etag);
+    if (current) {
+        begin_head(out, "304 Not Modified");
+    } else {
+        append_head(out, "200 OK", "text/html", page.body->size());
+    }
+    append_header(out, "ETag", page.etag);
+    append_header(out, "Cache-Control", get_cache_control("text/html"));
+    end_head(out, keep_alive);
+    if (!current) {
+        out.append_shared(page.body, 0, page.body->size());
+    }
+}
 
-    std::string response = oss.str();
-    send(client_socket, response.c_str(), response.size(), 0);
-    close(client_socket);
+// Requests whose path lies below PROXY_PREFIX go upstream when upstreams are configured
+bool proxied_path(std::string_view target) {
+    static thread_local std::string path;
+    return upstreams.enabled() && normalize_request_path(target, path) &&
+           path.compare(0, strlen(PROXY_PREFIX), PROXY_PREFIX) == 0;
 }
 
-int main() {
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
+// Adaptive streaming views of an MP4 file, from its cached segment index (see mp4_index.h):
+// "<file>.mp4.m3u8" and "<file>.mp4.mpd" are its HLS and DASH manifests. The fragments of a
+// fragmented file are byte ranges of the file itself, fetched with Range like any other;
+// those of a progressive file are "<file>.mp4?segment=N", a generated moof followed by the
+// fragment's sample bytes sent from the file with sendfile, and "?segment=init".
+// Returns false if path is none of these or the MP4 is missing or can't be indexed: the
+// path is then served as a static file, so a real "x.mp4.m3u8" stays reachable
+bool serve_mp4_stream(const HttpRequest& req, OutputQueue& out, bool keep_alive, VirtualHost& host,
+                      const std::string& path) {
+    static thread_local std::string source;
+    std::string_view segment = query_param(req.path, "segment");
+    size_t suffix = strlen(STREAM_SOURCE_SUFFIX);
+    size_t end = path.size();
+    for (const char* manifest : {".m3u8", ".mpd"}) {
+        size_t n = strlen(manifest);
+        if (end > n && path.compare(end - n, n, manifest) == 0) {
+            end -= n;
+            segment = manifest + 1;
+            break;
+        }
+    }
+    if (segment.empty() || end < suffix || path.compare(end - suffix, suffix, STREAM_SOURCE_SUFFIX) != 0) {
+        return false;
+    }
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
+    source.assign(host.root).append(path, 0, end);
+    std::shared_ptr<OpenFile> file;
+    {
+        TraceScope trace(TRACE_OPEN);
+        file = path_cache.open_file(host.root_fd, source, host.root.size());
+    }
+    std::shared_ptr<const Mp4Index> index = file ? mp4_index_cache.get(source, *file) : nullptr;
+    if (!index) {
+        return false; // a real file of that name, if there is one, is served as usual
     }
 
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        perror("setsockopt");
-        exit(EXIT_FAILURE);
+    StaticBody body;
+    if (segment == "m3u8" || segment == "mpd") {
+        body.bytes = segment == "m3u8" ? index->hls : index->dash;
+    } else if (segment == "init" && index->init) {
+        body.bytes = index->init;
+    } else if (!index->fragmented) {
+        size_t n = 0;
+        auto [end_ptr, error] = std::from_chars(segment.data(), segment.data() + segment.size(), n);
+        if (error == std::errc() && end_ptr == segment.data() + segment.size() && n < index->segments.size()) {
+            // The header lives in the index, which the response keeps alive
+            const Mp4Segment& fragment = index->segments[n];
+            body.bytes = std::shared_ptr<const std::string>(index, &fragment.header);
+            body.file = file;
+            body.file_offset = fragment.offset;
+            body.size = fragment.size();
+        }
+    }
+    if (!body.bytes) {
+        append_response(out, "404 Not Found", "", "", keep_alive);
+        return true;
+    }
+    if (!body.file) {
+        body.size = body.bytes->size();
+    }
+    std::string_view mime_type = mime_registry.lookup(segment == "m3u8" || segment == "mpd" ? path : source);
+    std::string etag = file_etag(file->st);
+    etag.insert(etag.size() - 1, "-" + std::string(segment));
+    std::string validators = validator_headers(file->st.st_mtime, etag);
+    std::string extra_headers = representation_headers(mime_type, ENCODING_IDENTITY);
+    body.mtime = file->st.st_mtime;
+    body.etag = etag;
+    body.validators = validators;
+    body.extra_headers = extra_headers;
+    serve_file(req, out, keep_alive, body, mime_type, "");
+    return true;
+}
+
+// PUT and POST store their body as a file of the site, see Reactor::start_upload
+bool is_upload(const HttpRequest& req) {
+    return req.method == "PUT" || req.method == "POST";
+}
+
+// Function to handle one client request, response is appended to out
+void route_request(const HttpRequest& req, OutputQueue& out, bool keep_alive) {
+    // HTTP/1.1 connections store uploads before they get here, HTTP/2 streams carry no body
+    // to us: only GET is offered there
+    if (max_upload_size && is_upload(req)) {
+        append_head(out, "405 Method Not Allowed", "", 0);
+        out.append("Allow: GET\r\n");
+        end_head(out, keep_alive);
+        return;
+    }
+    if (req.method != "GET") {
+        append_response(out, "405 Method Not Allowed", "", "", keep_alive);
+        return;
+    }
+
+    // Reused per reactor thread: resolving a cached file allocates nothing once warmed up
+    static thread_local std::string path;
+    static thread_local std::string file_path;
+    if (!normalize_request_path(req.path, path)) {
+        append_response(out, "400 Bad Request", "", "", keep_alive);
+        return;
     }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    // Paths resolve beneath the document root of the site named by Host
+    VirtualHost& host = virtual_hosts.find(req.header("Host"));
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
+    // Handle root path
+    if (path == "/") {
+        serve_directory_index(req, out, keep_alive, host.index);
+        return;
     }
 
-    if (listen(server_fd, 3) < 0) {
-        perror("listen");
-        exit(EXIT_FAILURE);
+    // HTTP/1.1 connections hand these to the proxy before they get here. The relay writes
+    // upstream bytes straight to the client socket, it has no HTTP/2 framing: a retry can't help
+    if (upstreams.enabled() && path.compare(0, strlen(PROXY_PREFIX), PROXY_PREFIX) == 0) {
+        append_response(out, "501 Not Implemented", "", "", keep_alive);
+        return;
     }
 
-    std::cout << "Server listening on port " << PORT << std::endl;
+    if (path == "/metrics") {
+        append_response(out, "200 OK", "text/plain; version=0.0.4", metrics().render(), keep_alive);
+        return;
+    }
 
-    while (true) {
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("accept");
-            continue;
+    if (serve_mp4_stream(req, out, keep_alive, host, path)) {
+        return;
+    }
+
+    // Content coding, negotiated only for types that compress well
+    file_path.assign(host.root);
+    file_path += path;
+    std::string_view mime_type = mime_registry.lookup(file_path);
+    int encoding = ENCODING_IDENTITY;
+    const std::string_view* accept_encoding = req.header("Accept-Encoding");
+    if (accept_encoding && is_compressible(mime_type)) {
+        encoding = negotiate_encoding(*accept_encoding);
+    }
+
+    // Hot small files are answered straight from memory
+    uint64_t generation = file_cache.generation();
+    std::shared_ptr<const CacheEntry> entry;
+    {
+        TraceScope trace(TRACE_CACHE);
+        entry = file_cache.lookup(file_path);
+    }
+    if (entry) {
+        server_metrics.cache_hit.inc();
+        serve_cached(req, out, keep_alive, host, file_path, std::move(entry), encoding, generation);
+        return;
+    }
+    server_metrics.cache_miss.inc();
+
+    std::shared_ptr<OpenFile> file;
+    {
+        TraceScope trace(TRACE_OPEN);
+        file = path_cache.open_file(host.root_fd, file_path, host.root.size());
+    }
+    if (!file) {
+        append_response(out, "404 Not Found", "", "", keep_alive);
+        return;
+    }
+
+    if (static_cast<uint64_t>(file->st.st_size) <= file_cache.max_entry_size()) {
+        if ((entry = load_cache_entry(*file, mime_type))) {
+            file_cache.insert(file_path, entry, generation);
+            serve_cached(req, out, keep_alive, host, file_path, std::move(entry), encoding, generation);
+            return;
         }
+    }
 
-        // Create a new thread to handle each client request
-        std::thread t(handle_client, new_socket);
-        t.detach(); // Detach the thread so that it runs independently
+    // Too large to compress per request: only a precompressed sibling is sent encoded
+    StaticBody body;
+    body.mtime = file->st.st_mtime;
+    std::string file_tag = file_etag(file->st);
+    if (encoding != ENCODING_IDENTITY) {
+        if (std::shared_ptr<OpenFile> sibling = open_sibling(host, file_path, encoding, file->st.st_mtime)) {
+            file = std::move(sibling);
+        } else {
+            encoding = ENCODING_IDENTITY;
+        }
     }
+    std::string etag = representation_etag(file_tag, encoding);
+    std::string validators = validator_headers(body.mtime, etag);
+    std::string extra_headers = representation_headers(mime_type, encoding);
+    body.size = file->st.st_size;
+    body.file = std::move(file);
+    body.etag = etag;
+    body.validators = validators;
+    body.extra_headers = extra_headers;
+    serve_file(req, out, keep_alive, body, mime_type, "");
+}
 
-    close(server_fd);
-    return 0;
+// Every request enters here, over HTTP/1.1 and HTTP/2 alike
+void handle_request(const HttpRequest& req, OutputQueue& out, bool keep_alive) {
+    TraceScope trace(TRACE_HANDLE);
+    uint64_t start = metrics_now_ns();
+    route_request(req, out, keep_alive);
+    server_metrics.duration.record(metrics_now_ns() - start);
 }
 
+// Per-connection state owned by a single reactor thread
+struct Connection {
+    int fd = -1;
+    uint32_t ip = 0;        // client IPv4 address, host byte order
+    std::string in;         // bytes received but not yet parsed
+    HttpRequestParser parser{MAX_REQUEST_SIZE}; // remembers how far the pending request head was scanned
+    uint64_t body_remaining = 0; // Content-Length body bytes still to skip
+    bool body_chunked = false;   // skipping a chunked body
+    ChunkedDecoder chunked;
+    OutputQueue out;        // responses not yet written to the socket
+    std::unique_ptr<Http2Session> h2; // set once the connection speaks HTTP/2
+    std::unique_ptr<ProxyExchange> proxy; // request being answered by an upstream
+    std::unique_ptr<Upload> upload;       // request whose body is being stored
+    TlsSession tls;              // set on HTTPS connections
+    bool tls_ready = false;      // handshake finished
+    bool tls_kernel_send = false; // kTLS encrypts socket writes, writev and sendfile work as on plain HTTP
+    size_t tls_write_pending = 0; // length of an SSL_write that must be repeated after WANT_WRITE
+    size_t requests = 0;    // requests served on this connection
+    bool close_after_write = false;
+    bool peer_closed = false;    // the client shut down its side
+    bool want_write = false;     // EPOLLOUT currently registered
+    bool reading_paused = false; // EPOLLIN dropped until the send queue drains
+    std::chrono::steady_clock::time_point last_active;
+    // Trace timestamps (trace_ticks)
+    uint64_t accepted_ticks = 0;
+    uint64_t request_ticks = 0;  // first bytes of the pending request read
+    uint64_t read_start = 0;     // last round of reads
+    uint64_t read_end = 0;
+    uint64_t send_ticks = 0;     // oldest response still in the send queue was produced
+    uint64_t trace_id = 0;       // sampled request whose response is in the send queue
+};
+
+// One event loop per thread. Every reactor owns its own SO_REUSEPORT listening socket,
+// so the kernel spreads new connections across reactors and a connection never migrates
+// between threads: no locks on the request path.
+class Reactor {
+public:
+    explicit Reactor(int id)
+        : id_(id), delay_monitor_(admission.config().queue_target, admission.config().queue_interval) {}
+
+    bool init() {
+        epoll_fd_ = epoll_create1(0);
+        if (epoll_fd_ < 0) {
+            perror("epoll_create1");
+            return false;
+        }
+        listen_fd_ = open_listener(PORT);
+        if (listen_fd_ < 0) {
+            return false;
+        }
+        if (tls_context.enabled()) {
+            tls_listen_fd_ = open_listener(TLS_PORT);
+            if (tls_listen_fd_ < 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void run() {
+        struct epoll_event events[MAX_EVENTS];
+        auto last_sweep = std::chrono::steady_clock::now();
+        while (true) {
+            int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, 1000);
+            batch_start_ = std::chrono::steady_clock::now();
+            batch_ticks_ = trace_ticks();
+            uint64_t dump = trace_collector.requested();
+            if (dump != trace_dumped_) {
+                trace_dumped_ = dump;
+                trace_collector.contribute(dump, id_, trace_ring_);
+            }
+            if (n < 0 && errno != EINTR) {
+                perror("epoll_wait");
+                break;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listen_fd_ || fd == tls_listen_fd_) {
+                    accept_connections(fd);
+                    continue;
+                }
 
+                auto it = connections_.find(fd);
+                if (it == connections_.end()) {
+                    auto upstream = upstream_clients_.find(fd);
+                    if (upstream != upstream_clients_.end()) {
+                        handle_upstream(connections_[upstream->second], events[i].events);
+                    }
+                    continue;
+                }
+                Connection& conn = it->second;
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    close_connection(conn);
+                    continue;
+                }
+                if ((events[i].events & EPOLLIN) && !handle_readable(conn)) {
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    handle_writable(conn);
+                }
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_sweep >= std::chrono::seconds(1)) {
+                close_idle_connections(now);
+                if (id_ == 0) {
+                    admission.sweep(now);
+                }
+                last_sweep = now;
+            }
+        }
+    }
+
+private:
+    // A SO_REUSEPORT listening socket of this reactor, registered with its epoll
+    int open_listener(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            perror("socket failed");
+            return -1;
+        }
+
+        int opt = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+            perror("setsockopt");
+            close(fd);
+            return -1;
+        }
+
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+
+        if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            perror("bind failed");
+            close(fd);
+            return -1;
+        }
 
+        if (listen(fd, admission.config().backlog) < 0) {
+            perror("listen");
+            close(fd);
+            return -1;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl: listen");
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
 
+    // Accept a bounded batch so a connection flood can't starve requests already admitted;
+    // the listening socket stays readable and the rest are taken on the next wakeup
+    void accept_connections(int listen_fd) {
+        for (int accepted = 0; accepted < MAX_ACCEPTS_PER_WAKEUP; ++accepted) {
+            struct sockaddr_in addr;
+            socklen_t addr_len = sizeof(addr);
+            int client = accept4(listen_fd, (struct sockaddr*)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    perror("accept");
+                }
+                return;
+            }
+
+            // Over a limit: answer without reading the request and close, cheaper than leaving
+            // the client to time out in the backlog. An HTTPS client can't read a plaintext
+            // answer, it is just closed.
+            uint32_t ip = ntohl(addr.sin_addr.s_addr);
+            Admission verdict = admission.admit_connection(ip);
+            if (verdict != Admission::Accepted && listen_fd == tls_listen_fd_) {
+                (verdict == Admission::TooManyConnections ? server_metrics.rejected_server : server_metrics.rejected_client).inc();
+                close(client);
+                continue;
+            }
+            if (verdict != Admission::Accepted) {
+                static const char busy[] =
+                    "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+                static const char too_many[] =
+                    "HTTP/1.1 429 Too Many Requests\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+                if (verdict == Admission::TooManyConnections) {
+                    server_metrics.rejected_server.inc();
+                    send(client, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+                } else {
+                    server_metrics.rejected_client.inc();
+                    send(client, too_many, sizeof(too_many) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+                }
+                close(client);
+                continue;
+            }
+
+            TlsSession tls;
+            if (listen_fd == tls_listen_fd_ && !(tls = tls_context.accept(client))) {
+                close(client);
+                admission.release_connection(ip);
+                continue;
+            }
+
+            int opt = 1;
+            setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.fd = client;
+            if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client, &ev) < 0) {
+                perror("epoll_ctl: add");
+                close(client);
+                admission.release_connection(ip);
+                continue;
+            }
+
+            Connection& conn = connections_[client];
+            conn.fd = client;
+            conn.ip = ip;
+            conn.tls = std::move(tls);
+            conn.last_active = std::chrono::steady_clock::now();
+            conn.accepted_ticks = trace_ticks();
+            server_metrics.accepted.inc();
+            server_metrics.open.add(1);
+        }
+    }
+
+    // Returns false if the connection was closed
+    bool handle_readable(Connection& conn) {
+        if (conn.tls && !conn.tls_ready) {
+            if (!continue_handshake(conn)) {
+                return false;
+            }
+            if (!conn.tls_ready) {
+                return true;
+            }
+        }
+        // The rest of a spliced upload body bypasses conn.in; what follows it is read as usual
+        if (conn.upload && conn.upload->pipe && conn.in.empty()) {
+            if (!splice_upload(conn)) {
+                return false;
+            }
+            if (conn.upload) {
+                return true;
+            }
+        }
+        char buffer[BUFFER_SIZE];
+        size_t budget = READ_BYTES_PER_WAKEUP;
+        conn.read_start = trace_ticks();
+        // Level-triggered EPOLLIN brings the rest once what was read is handled; only plaintext
+        // OpenSSL already decrypted has to be taken now, the socket won't signal it again
+        while (budget > 0 || (conn.tls && SSL_pending(conn.tls.get()) > 0)) {
+            ssize_t bytes_read = conn.tls ? tls_read(conn, buffer, sizeof(buffer))
+                                          : recv(conn.fd, buffer, sizeof(buffer), 0);
+            if (bytes_read > 0) {
+                if (conn.in.empty()) {
+                    conn.request_ticks = conn.read_start;
+                }
+                conn.in.append(buffer, bytes_read);
+                server_metrics.received.inc(bytes_read);
+                budget -= std::min<size_t>(budget, bytes_read);
+                continue;
+            }
+            if (bytes_read == 0) {
+                conn.peer_closed = true;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                close_connection(conn);
+                return false;
+            }
+            break;
+        }
+        conn.read_end = trace_ticks();
+        conn.last_active = std::chrono::steady_clock::now();
+        return process_input(conn);
+    }
+
+    // Advance a non-blocking TLS handshake. Once it completes OpenSSL has switched the socket
+    // to kTLS where possible. Returns false if the connection was closed
+    bool continue_handshake(Connection& conn) {
+        switch (tls_status(conn.tls.get(), SSL_do_handshake(conn.tls.get()))) {
+            case TlsStatus::Done:
+                conn.tls_ready = true;
+                conn.tls_kernel_send = tls_kernel_send(conn.tls.get());
+                (SSL_session_reused(conn.tls.get()) ? server_metrics.tls_resumed : server_metrics.tls_full).inc();
+                if (conn.tls_kernel_send) {
+                    server_metrics.tls_kernel.inc();
+                }
+                set_want_write(conn, false);
+                return true;
+            case TlsStatus::WantRead:
+                set_want_write(conn, false);
+                return true;
+            case TlsStatus::WantWrite:
+                set_want_write(conn, true);
+                return true;
+            default:
+                close_connection(conn);
+                return false;
+        }
+    }
+
+    // recv() for an HTTPS connection: decrypted bytes, 0 on close_notify, or -1 with errno set
+    ssize_t tls_read(Connection& conn, char* buffer, size_t size) {
+        int n = SSL_read(conn.tls.get(), buffer, static_cast<int>(size));
+        switch (tls_status(conn.tls.get(), n)) {
+            case TlsStatus::Done:
+                return n;
+            case TlsStatus::Closed:
+                return 0;
+            case TlsStatus::WantWrite:
+                set_want_write(conn, true); // a post-handshake message is waiting to go out
+                errno = EAGAIN;
+                return -1;
+            case TlsStatus::WantRead:
+                errno = EAGAIN;
+                return -1;
+            default:
+                errno = ECONNRESET;
+                return -1;
+        }
+    }
+
+    // Without kTLS every byte is encrypted by SSL_write: up to one record of queued output is
+    // copied out of the queue (file ranges with pread) and written as one record. After
+    // WANT_WRITE the same bytes are still at the front of the queue and are written again.
+    // Returns bytes written, or -1 with errno set like writev
+    ssize_t tls_write(Connection& conn) {
+        thread_local char record[TLS_RECORD_SIZE];
+        OutputQueue& chunks = conn.out;
+        size_t limit = conn.tls_write_pending ? conn.tls_write_pending : sizeof(record);
+        size_t len = 0;
+        for (size_t i = 0; i < chunks.size() && len < limit; ++i) {
+            OutputChunk& chunk = chunks[i];
+            if (chunk.file) {
+                size_t want = std::min(limit - len, chunk.file_remaining);
+                ssize_t n = pread(chunk.file->fd, record + len, want, chunk.file_offset);
+                if (n <= 0) {
+                    errno = EIO; // file shrank underneath us, the response can't be completed
+                    return -1;
+                }
+                len += n;
+                if (static_cast<size_t>(n) < want) {
+                    break;
+                }
+                continue;
+            }
+            size_t n = std::min(limit - len, chunk.memory_size() - chunk.sent);
+            memcpy(record + len, chunk.memory() + chunk.sent, n);
+            len += n;
+            // Output behind a generated body waits until its last piece
+            if (chunk.source && !chunk.source_done) {
+                break;
+            }
+        }
+
+        int n = SSL_write(conn.tls.get(), record, static_cast<int>(len));
+        TlsStatus status = tls_status(conn.tls.get(), n);
+        if (status == TlsStatus::Done) {
+            conn.tls_write_pending = 0;
+            consume_output(chunks, n);
+            return n;
+        }
+        if (status == TlsStatus::WantWrite) {
+            conn.tls_write_pending = len;
+            errno = EAGAIN;
+        } else {
+            errno = EPIPE;
+        }
+        return -1;
+    }
+
+    // Drop n written bytes from the front of the queue. A generated body's chunk stays, its
+    // piece marked written, and is refilled at the top of the flush loop
+    static void consume_output(OutputQueue& chunks, size_t written) {
+        while (written > 0) {
+            OutputChunk& chunk = chunks.front();
+            if (chunk.file) {
+                size_t n = std::min(written, chunk.file_remaining);
+                chunk.file_offset += n;
+                chunk.file_remaining -= n;
+                written -= n;
+                if (chunk.file_remaining == 0) {
+                    chunks.pop_front();
+                }
+                continue;
+            }
+            size_t left = chunk.memory_size() - chunk.sent;
+            if (written < left) {
+                chunk.sent += written;
+                break;
+            }
+            written -= left;
+            if (chunk.source && !chunk.source_done) {
+                chunk.sent = chunk.data.size();
+                break;
+            }
+            chunks.pop_front();
+        }
+    }
+
+    // Serve the requests buffered in conn.in and write out the responses. Parsing stops while
+    // the send queue is full and reading pauses until EPOLLOUT has drained it, so a client that
+    // pipelines requests without reading the responses can't grow the queue without bound.
+    // Returns false if the connection was closed
+    bool process_input(Connection& conn) {
+        while (true) {
+            parse_requests(conn);
+            if (send_queue_full(conn) && !conn.reading_paused) {
+                server_metrics.paused.inc();
+                set_reading_paused(conn, true);
+            } else if (conn.peer_closed) {
+                conn.close_after_write = true;
+            }
+            // A request body is read from the client only as fast as the upstream takes it
+            if (proxy_backlogged(conn) && !conn.reading_paused) {
+                set_reading_paused(conn, true);
+            }
+            if (!flush(conn)) {
+                return false;
+            }
+            // The queue drained at once: carry on with the requests still buffered
+            if (!conn.reading_paused || !can_resume_reading(conn)) {
+                return true;
+            }
+            set_reading_paused(conn, false);
+        }
+    }
+
+    // Sample the request about to be handled and record the phases that led up to it. Later
+    // requests pipelined in the same read have no receive or recv phase of their own.
+    void start_trace(Connection& conn, const HttpRequest& req, bool first, uint64_t parse_start) {
+        uint64_t parsed = trace_ticks();
+        bool sampled = trace_sample_rate && ++trace_requests_ % trace_sample_rate == 0;
+        trace_current() = sampled ? &trace_ring_.start(conn.fd, req.method, req.path) : nullptr;
+        trace_current_fd() = conn.fd;
+        if (conn.request_ticks) {
+            if (first) {
+                trace_phase(TRACE_CONNECT, conn.accepted_ticks, conn.request_ticks);
+            }
+            if (conn.request_ticks < conn.read_start) {
+                trace_phase(TRACE_RECEIVE, conn.request_ticks, conn.read_start);
+            }
+            if (batch_ticks_ <= conn.read_start) {
+                trace_phase(TRACE_LOOP_WAIT, batch_ticks_, conn.read_start);
+            }
+            trace_phase(TRACE_RECV, conn.read_start, conn.read_end);
+            conn.request_ticks = 0;
+        }
+        trace_phase(TRACE_PARSE, parse_start, parsed);
+    }
+
+    void finish_trace(Connection& conn, const HttpRequest& req, uint64_t parse_start) {
+        uint64_t handled = trace_ticks();
+        TRACE_PROBE5(request, conn.fd, req.path.data(), req.path.size(), parse_start, handled);
+        if (TraceRecord* record = trace_current()) {
+            conn.trace_id = record->id;
+        }
+        if (!conn.send_ticks) {
+            conn.send_ticks = handled;
+        }
+        trace_current() = nullptr;
+        trace_current_fd() = -1;
+    }
+
+    // The send queue drained: the responses queued since it was last empty are out
+    void finish_send(Connection& conn) {
+        if (!conn.send_ticks) {
+            return;
+        }
+        uint64_t now = trace_ticks();
+        TRACE_PROBE4(phase, TRACE_SEND, conn.fd, conn.send_ticks, now);
+        if (TraceRecord* record = conn.trace_id ? trace_ring_.find(conn.trace_id) : nullptr) {
+            // From the end of its own handler, responses queued ahead of it included
+            uint64_t start = conn.send_ticks;
+            for (int i = 0; i < record->span_count; ++i) {
+                if (record->spans[i].phase == TRACE_HANDLE) {
+                    start = record->spans[i].end;
+                }
+            }
+            record->add(TRACE_SEND, start, now);
+        }
+        conn.send_ticks = 0;
+        conn.trace_id = 0;
+    }
+
+    bool send_queue_full(const Connection& conn) const {
+        return conn.out.buffered > SEND_QUEUE_HIGH_WATER || conn.out.size() > SEND_QUEUE_MAX_CHUNKS;
+    }
+
+    bool send_queue_drained(const Connection& conn) const {
+        return conn.out.buffered <= SEND_QUEUE_LOW_WATER && conn.out.size() <= SEND_QUEUE_MAX_CHUNKS / 2;
+    }
+
+    // A half-closed client has nothing more to send, but stays readable until closed
+    bool proxy_backlogged(const Connection& conn) const {
+        return conn.proxy && (conn.peer_closed || conn.in.size() > PROXY_REQUEST_BUFFER);
+    }
+
+    bool can_resume_reading(const Connection& conn) const {
+        return send_queue_drained(conn) && !proxy_backlogged(conn);
+    }
+
+    void parse_requests(Connection& conn) {
+        // Serve every complete request in the buffer, responses are queued in order (pipelining).
+        // The parsed request only holds views into conn.in, which stays untouched until the loop ends.
+        size_t consumed = 0;
+        if (conn.proxy) {
+            relay_request_body(conn, consumed);
+        }
+        if (conn.upload) {
+            receive_upload_body(conn, consumed);
+        }
+        while (!conn.h2 && !conn.proxy && !conn.upload && !conn.close_after_write && !send_queue_full(conn)) {
+            if (conn.body_remaining > 0 || conn.body_chunked) {
+                if (!skip_body(conn, consumed)) {
+                    break;
+                }
+                continue;
+            }
+
+            // HTTP/2 with prior knowledge: the client opens with the connection preface
+            if (conn.requests == 0 && consumed == 0) {
+                int preface = http2_preface_match(conn.in.data(), conn.in.size());
+                if (preface == 0) {
+                    break;
+                }
+                if (preface == 1) {
+                    conn.h2.reset(new Http2Session(handle_request));
+                    server_metrics.h2.inc();
+                    conn.h2->start(conn.out);
+                    break;
+                }
+            }
+
+            HttpRequest req;
+            size_t head_size = 0;
+            uint64_t parse_start = trace_ticks();
+            HttpParseStatus status = conn.parser.parse(conn.in.data() + consumed, conn.in.size() - consumed,
+                                                       req, head_size);
+            if (status == HttpParseStatus::Incomplete) {
+                break;
+            }
+            if (status != HttpParseStatus::Complete) {
+                append_response(conn.out, parse_error_status(status), "", "", false);
+                conn.close_after_write = true;
+                break;
+            }
+            conn.parser.reset();
+            consumed += head_size;
+
+            // Overload: a request that sat in the event loop past the target under a standing
+            // queue is refused before any work is done for it, and its connection closed
+            auto now = std::chrono::steady_clock::now();
+            if (delay_monitor_.should_shed(now - batch_start_, now)) {
+                server_metrics.shed.inc();
+                append_retry_later(conn.out, "503 Service Unavailable", false);
+                conn.close_after_write = true;
+                break;
+            }
+            bool admitted = admission.admit_request(conn.ip, now);
+
+            // Upgrade: h2c answers this request on stream 1 and continues in HTTP/2.
+            // Requests with a body stay on HTTP/1.1, which the RFC allows; over TLS, HTTP/2
+            // is negotiated with ALPN instead.
+            const std::string_view* upgrade = req.header("Upgrade");
+            const std::string_view* h2_settings = req.header("HTTP2-Settings");
+            if (admitted && !conn.tls && upgrade && h2_settings && http_iequals(*upgrade, "h2c") && !req.has_body()) {
+                std::unique_ptr<Http2Session> session(new Http2Session(handle_request));
+                if (session->start_upgrade(req, *h2_settings, conn.out)) {
+                    conn.h2 = std::move(session);
+                    server_metrics.h2.inc();
+                    break;
+                }
+            }
+
+            bool first = conn.requests == 0;
+            bool keep_alive = req.keep_alive() && ++conn.requests < MAX_KEEPALIVE_REQUESTS;
+            bool body_taken = false;
+            if (admitted && proxied_path(req.path)) {
+                start_trace(conn, req, first, parse_start);
+                body_taken = start_proxy(conn, req, keep_alive, consumed);
+                finish_trace(conn, req, parse_start);
+            } else if (admitted && max_upload_size && is_upload(req)) {
+                start_trace(conn, req, first, parse_start);
+                body_taken = start_upload(conn, req, keep_alive, consumed);
+                finish_trace(conn, req, parse_start);
+            } else if (admitted) {
+                start_trace(conn, req, first, parse_start);
+                handle_request(req, conn.out, keep_alive);
+                finish_trace(conn, req, parse_start);
+            } else {
+                server_metrics.rate_limited.inc();
+                append_retry_later(conn.out, "429 Too Many Requests", keep_alive);
+            }
+            if (!keep_alive) {
+                conn.close_after_write = true;
+            }
+            if (body_taken) {
+                continue; // relayed upstream or stored; later requests wait for the response
+            }
+            // No handler reads request bodies; skip any the client sent so the next pipelined request lines up
+            conn.body_remaining = req.content_length;
+            conn.body_chunked = req.chunked;
+            if (req.chunked) {
+                conn.chunked.reset();
+            }
+        }
+        if (conn.h2 && !send_queue_full(conn)) {
+            size_t used = 0;
+            if (!conn.h2->receive(conn.in.data() + consumed, conn.in.size() - consumed, used, conn.out)) {
+                conn.close_after_write = true;
+            }
+            consumed += used;
+        }
+        conn.in.erase(0, consumed);
+    }
+
+    static const char* parse_error_status(HttpParseStatus status) {
+        switch (status) {
+            case HttpParseStatus::HeadersTooLarge: return "431 Request Header Fields Too Large";
+            case HttpParseStatus::NotImplemented: return "501 Not Implemented";
+            default: return "400 Bad Request";
+        }
+    }
+
+    // Discard request body bytes from conn.in, returns true once the whole body has been skipped
+    bool skip_body(Connection& conn, size_t& consumed) {
+        size_t available = conn.in.size() - consumed;
+        if (!conn.body_chunked) {
+            size_t n = std::min<uint64_t>(available, conn.body_remaining);
+            consumed += n;
+            conn.body_remaining -= n;
+            return conn.body_remaining == 0;
+        }
+
+        size_t used = 0;
+        ChunkedStatus status = conn.chunked.feed(conn.in.data() + consumed, available, used,
+                                                 [](const char*, size_t) {});
+        consumed += used;
+        if (status == ChunkedStatus::Error) {
+            append_response(conn.out, "400 Bad Request", "", "", false);
+            conn.close_after_write = true;
+            return false;
+        }
+        if (status == ChunkedStatus::Done) {
+            conn.body_chunked = false;
+            return true;
+        }
+        return false;
+    }
+
+    // Uploads. A PUT or POST stores its body at the target path of the site, replacing the
+    // file there. Body bytes read along with the head are written from conn.in; on plain
+    // connections the rest of a Content-Length body is spliced from the socket into the file
+    // by handle_readable, so a multi-GB upload never passes through user space. Chunked and
+    // HTTPS bodies are decoded into conn.in and written from there. Later pipelined requests
+    // wait until the upload is answered.
+    // Returns false if the upload was refused: the answer is queued and the body still to skip
+    bool start_upload(Connection& conn, const HttpRequest& req, bool keep_alive, size_t& consumed) {
+        static thread_local std::string path;
+        auto upload = std::make_unique<Upload>();
+        bool too_large = req.content_length > max_upload_size;
+        const char* status = nullptr;
+        if (!normalize_request_path(req.path, path)) {
+            status = "400 Bad Request";
+        } else if (too_large) {
+            status = "413 Content Too Large";
+        } else {
+            upload->host = &virtual_hosts.find(req.header("Host"));
+            upload->target = upload->host->root + path;
+            if (!(status = upload->file.open(upload->host->root_fd, path))) {
+                status = upload->file.reserve(req.content_length);
+            }
+        }
+
+        const std::string_view* expect = req.header("Expect");
+        bool wants_continue = expect && http_iequals(*expect, "100-continue") && req.has_body();
+        if (status) {
+            server_metrics.uploads_failed.inc();
+            // A client waiting for the go-ahead may never send its body, one too large isn't worth reading
+            if (wants_continue || too_large) {
+                keep_alive = false;
+                conn.close_after_write = true;
+            }
+            append_response(conn.out, status, "", "", keep_alive);
+            return false;
+        }
+
+        upload->body_remaining = req.content_length;
+        upload->body_chunked = req.chunked;
+        upload->limit = max_upload_size;
+        upload->keep_alive = keep_alive;
+        if (!conn.tls && !req.chunked && req.content_length > 0) {
+            upload->pipe = pipe_pool_.take(); // without one the body is copied
+        }
+        if (wants_continue) {
+            conn.out.append("HTTP/1.1 100 Continue\r\n\r\n");
+        }
+        conn.upload = std::move(upload);
+        receive_upload_body(conn, consumed);
+        return true;
+    }
+
+    // Write the body bytes buffered in conn.in to the file, and answer once the body is complete
+    void receive_upload_body(Connection& conn, size_t& consumed) {
+        Upload& upload = *conn.upload;
+        size_t available = conn.in.size() - consumed;
+        if (upload.body_remaining > 0) {
+            size_t n = std::min<uint64_t>(available, upload.body_remaining);
+            bool written = upload.file.write(conn.in.data() + consumed, n);
+            consumed += n;
+            upload.body_remaining -= n;
+            if (!written) {
+                fail_upload(conn, upload_error_status(upload.file.error()));
+                return;
+            }
+        } else if (upload.body_chunked) {
+            bool written = true;
+            size_t used = 0;
+            ChunkedStatus status = upload.body_decoder.feed(conn.in.data() + consumed, available, used,
+                [&](const char* data, size_t len) {
+                    written = written && upload.file.written() + len <= upload.limit && upload.file.write(data, len);
+                });
+            consumed += used;
+            if (!written) {
+                fail_upload(conn, upload.file.error() ? upload_error_status(upload.file.error()) : "413 Content Too Large");
+                return;
+            }
+            if (status == ChunkedStatus::Error) {
+                fail_upload(conn, "400 Bad Request");
+                return;
+            }
+            upload.body_chunked = status == ChunkedStatus::NeedMore;
+        }
+        if (upload.complete()) {
+            finish_upload(conn);
+        } else if (conn.peer_closed) {
+            fail_upload(conn, "400 Bad Request"); // the body was cut off
+        }
+    }
+
+    // Move body bytes from the socket through the pipe into the file, and answer once the
+    // body is complete. Returns false if the connection was closed
+    bool splice_upload(Connection& conn) {
+        Upload& upload = *conn.upload;
+        PipeBuffer& pipe = *upload.pipe;
+        size_t budget = UPLOAD_BYTES_PER_WAKEUP;
+        while (upload.body_remaining > 0 && budget > 0) {
+            size_t want = std::min<uint64_t>({upload.body_remaining, pipe.capacity, budget});
+            ssize_t n = splice(conn.fd, nullptr, pipe.write_fd, nullptr, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                pipe.buffered += n;
+                upload.body_remaining -= n;
+                budget -= n;
+                server_metrics.received.inc(n);
+                if (!upload.file.drain(pipe)) {
+                    fail_upload(conn, upload_error_status(upload.file.error()));
+                    return true;
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            // Reset, or closed before the end of the body
+            close_connection(conn);
+            return false;
+        }
+        conn.last_active = std::chrono::steady_clock::now();
+        if (upload.complete()) {
+            finish_upload(conn);
+        }
+        return true;
+    }
+
+    // The whole body is in the file: put it in place and answer
+    void finish_upload(Connection& conn) {
+        std::unique_ptr<Upload> upload = std::move(conn.upload);
+        const char* status = upload->file.commit();
+        (status ? server_metrics.uploads_failed : server_metrics.uploads).inc();
+        if (!status) {
+            // inotify reports the rename later, a request right behind this one must see the file now
+            invalidate_cached(upload->target, false);
+            upload->host->index.on_change(upload->target, false);
+            status = upload->file.replaced() ? "200 OK" : "201 Created";
+        }
+        append_response(conn.out, status, "", "", upload->keep_alive);
+        pipe_pool_.give_back(std::move(upload->pipe));
+    }
+
+    // The body can't be stored: answer and close without reading the rest of it
+    void fail_upload(Connection& conn, const char* status) {
+        server_metrics.uploads_failed.inc();
+        conn.upload.reset();
+        append_response(conn.out, status, "", "", false);
+        conn.close_after_write = true;
+    }
+
+    // Reverse proxy. A request below PROXY_PREFIX is forwarded on a pooled keep-alive
+    // connection to the least loaded upstream; the connection is watched by this reactor's
+    // epoll like a client. The response head is rewritten into the client's output queue and
+    // the body follows it: spliced through a pipe into the client socket when the length is
+    // known or the upstream closes, copied when it is chunked or the client uses user-space
+    // TLS. Later pipelined requests wait until the response is complete.
+    // Returns false if no upstream is up: the client got 503 and its request body is still to skip
+    bool start_proxy(Connection& conn, const HttpRequest& req, bool keep_alive, size_t& consumed) {
+        Upstream* upstream = upstreams.pick();
+        if (!upstream) {
+            server_metrics.proxy_failed.inc();
+            append_retry_later(conn.out, "503 Service Unavailable", keep_alive);
+            return false;
+        }
+        auto proxy = std::make_unique<ProxyExchange>();
+        proxy->upstream = upstream;
+        proxy->keep_alive = keep_alive;
+        proxy->head_request = req.method == "HEAD";
+        proxy->idempotent = is_idempotent(req.method);
+        proxy->body_remaining = req.content_length;
+        proxy->body_chunked = req.chunked;
+        proxy->started = std::chrono::steady_clock::now();
+
+        // HTTP/1.0 clients can't take a chunked response, so the upstream hears HTTP/1.0 too
+        bool http10 = req.http_version == "HTTP/1.0";
+        proxy->upstream_keep_alive = !http10;
+        std::string& out = proxy->request;
+        out.append(req.method).append(" ").append(req.path).append(http10 ? " HTTP/1.0\r\n" : " HTTP/1.1\r\n");
+        const std::string_view* forwarded_for = nullptr;
+        for (size_t i = 0; i < req.header_count; ++i) {
+            const HttpHeader& header = req.headers[i];
+            if (http_iequals(header.name, "X-Forwarded-For")) {
+                forwarded_for = &header.value;
+            } else if (!is_hop_by_hop(header.name) && !http_iequals(header.name, "X-Forwarded-Proto")) {
+                out.append(header.name).append(": ").append(header.value).append("\r\n");
+            }
+        }
+        char ip[INET_ADDRSTRLEN];
+        struct in_addr addr = {htonl(conn.ip)};
+        inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+        out.append("X-Forwarded-For: ");
+        if (forwarded_for) {
+            out.append(*forwarded_for).append(", ");
+        }
+        out.append(ip).append(conn.tls ? "\r\nX-Forwarded-Proto: https\r\n" : "\r\nX-Forwarded-Proto: http\r\n");
+        out.append(http10 ? "Connection: close\r\n\r\n" : "\r\n");
+
+        // The body is relayed as it arrives, a client waiting for the go-ahead gets it from us
+        const std::string_view* expect = req.header("Expect");
+        if (expect && http_iequals(*expect, "100-continue") && req.has_body()) {
+            conn.out.append("HTTP/1.1 100 Continue\r\n\r\n");
+        }
+
+        upstream->outstanding.fetch_add(1, std::memory_order_relaxed);
+        conn.proxy = std::move(proxy);
+        relay_request_body(conn, consumed);
+        conn.proxy->retryable = conn.proxy->body_remaining == 0 && !conn.proxy->body_chunked;
+        if (!connect_upstream(conn, true)) {
+            fail_proxy(conn, "502 Bad Gateway");
+        }
+        return true;
+    }
+
+    // Send the request on a pooled connection, or a new one when the pool has none (or a
+    // pooled one just failed). Writing starts once epoll reports the socket writable.
+    bool connect_upstream(Connection& conn, bool pooled) {
+        ProxyExchange& proxy = *conn.proxy;
+        proxy.fd = pooled ? upstream_pool_.take(proxy.upstream) : -1;
+        proxy.reused = proxy.fd >= 0;
+        proxy.connecting = false;
+        if (proxy.reused) {
+            server_metrics.proxy_reused.inc();
+        } else {
+            proxy.fd = proxy.upstream->connect_nonblocking();
+            proxy.connecting = true;
+        }
+        if (proxy.fd < 0) {
+            upstreams.mark_down(*proxy.upstream);
+            return false;
+        }
+        proxy.want_read = proxy.want_write = true;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+        ev.data.fd = proxy.fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, proxy.fd, &ev);
+        upstream_clients_[proxy.fd] = conn.fd;
+        return true;
+    }
+
+    void set_upstream_events(ProxyExchange& proxy, bool want_read, bool want_write) {
+        if (proxy.want_read != want_read || proxy.want_write != want_write) {
+            proxy.want_read = want_read;
+            proxy.want_write = want_write;
+            struct epoll_event ev;
+            ev.events = want_read ? EPOLLIN | EPOLLRDHUP : 0;
+            if (want_write) {
+                ev.events |= EPOLLOUT;
+            }
+            ev.data.fd = proxy.fd;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, proxy.fd, &ev);
+        }
+    }
+
+    // Move request body bytes buffered from the client into the upstream's send buffer
+    void relay_request_body(Connection& conn, size_t& consumed) {
+        ProxyExchange& proxy = *conn.proxy;
+        size_t pending = proxy.request.size() - proxy.request_sent;
+        size_t n = std::min(conn.in.size() - consumed, pending < PROXY_REQUEST_BUFFER ? PROXY_REQUEST_BUFFER - pending : 0);
+        if (proxy.body_remaining > 0) {
+            n = std::min<uint64_t>(n, proxy.body_remaining);
+            proxy.body_remaining -= n;
+        } else if (proxy.body_chunked) {
+            // Forwarded as it is, chunk framing included; the decoder only finds where it ends
+            size_t used = 0;
+            ChunkedStatus status = proxy.body_decoder.feed(conn.in.data() + consumed, n, used, [](const char*, size_t) {});
+            n = used;
+            if (status != ChunkedStatus::NeedMore) {
+                proxy.body_chunked = false;
+                if (status == ChunkedStatus::Error) {
+                    conn.close_after_write = true; // the upstream gets the malformed body and answers it
+                }
+            }
+        } else {
+            n = 0;
+        }
+        if (n > 0) {
+            proxy.request.append(conn.in, consumed, n);
+            consumed += n;
+            if (!proxy.connecting && proxy.fd >= 0) {
+                set_upstream_events(proxy, proxy.want_read, true);
+            }
+        }
+    }
+
+    void handle_upstream(Connection& conn, uint32_t events) {
+        ProxyExchange& proxy = *conn.proxy;
+        if (proxy.connecting) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(proxy.fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+                upstreams.mark_down(*proxy.upstream);
+                upstream_failed(conn);
+                return;
+            }
+            if (!(events & EPOLLOUT)) {
+                return;
+            }
+            proxy.connecting = false;
+        }
+
+        if (proxy.request_sent < proxy.request.size()) {
+            while (proxy.request_sent < proxy.request.size()) {
+                ssize_t n = send(proxy.fd, proxy.request.data() + proxy.request_sent,
+                                 proxy.request.size() - proxy.request_sent, MSG_NOSIGNAL);
+                if (n > 0) {
+                    proxy.request_sent += n;
+                } else if (n < 0 && errno == EINTR) {
+                    continue;
+                } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                } else {
+                    upstream_failed(conn);
+                    return;
+                }
+            }
+            bool drained = proxy.request_sent == proxy.request.size();
+            if (drained && !proxy.retryable) {
+                proxy.request.clear();
+                proxy.request_sent = 0;
+            }
+            set_upstream_events(proxy, proxy.want_read, !drained);
+            // More of the body may be waiting on the client side
+            if (drained && (proxy.body_remaining > 0 || proxy.body_chunked) && (!conn.in.empty() || conn.reading_paused)) {
+                if (!process_input(conn)) {
+                    return;
+                }
+            }
+        } else if (proxy.want_write) {
+            set_upstream_events(proxy, proxy.want_read, false);
+        }
+
+        if (conn.proxy && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+            if (!conn.proxy->head_done) {
+                receive_response_head(conn);
+            } else {
+                relay_response(conn);
+            }
+        }
+    }
+
+    void receive_response_head(Connection& conn) {
+        ProxyExchange& proxy = *conn.proxy;
+        char buffer[BUFFER_SIZE];
+        while (true) {
+            ssize_t n = recv(proxy.fd, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (n <= 0) {
+                upstream_failed(conn);
+                return;
+            }
+            proxy.head.append(buffer, n);
+
+            HttpResponseHead head;
+            size_t head_size = 0;
+            ResponseParseStatus status;
+            while ((status = parse_response_head(proxy.head.data(), proxy.head.size(), head, head_size)) ==
+                       ResponseParseStatus::Complete && head.code >= 100 && head.code < 200 && head.code != 101) {
+                proxy.head.erase(0, head_size); // interim responses are not passed on
+            }
+            if (status == ResponseParseStatus::Invalid || (status == ResponseParseStatus::Complete && head.code == 101)) {
+                proxy.retryable = false;
+                upstream_failed(conn);
+                return;
+            }
+            if (status == ResponseParseStatus::Complete) {
+                begin_proxied_response(conn, head);
+                // Body bytes that came with the head go out through user space, the rest may be spliced
+                std::string rest = proxy.head.substr(head_size);
+                proxy.head.clear();
+                if (!rest.empty() && !relay_response_bytes(conn, rest.data(), rest.size())) {
+                    return;
+                }
+                relay_response(conn);
+                return;
+            }
+        }
+    }
+
+    // Queue the response head for the client: hop-by-hop headers replaced by our own
+    // Connection header, framing kept as the upstream sent it
+    void begin_proxied_response(Connection& conn, const HttpResponseHead& head) {
+        ProxyExchange& proxy = *conn.proxy;
+        proxy.head_done = true;
+        if (proxy.head_request || head.code == 204 || head.code == 304) {
+            proxy.framing = ResponseFraming::None;
+        } else if (head.chunked) {
+            proxy.framing = ResponseFraming::Chunked;
+            proxy.response_decoder.reset();
+        } else if (head.has_content_length) {
+            proxy.framing = ResponseFraming::Length;
+            proxy.response_remaining = head.content_length;
+        } else {
+            proxy.framing = ResponseFraming::UntilClose;
+            proxy.keep_alive = false; // the client learns where the body ends from the close too
+        }
+        if (head.close) {
+            proxy.upstream_keep_alive = false;
+        }
+        if (!proxy.keep_alive) {
+            conn.close_after_write = true;
+        }
+
+        std::string status(head.status);
+        begin_head(conn.out, status.c_str());
+        for (size_t i = 0; i < head.header_count; ++i) {
+            if (!is_hop_by_hop(head.headers[i].name)) {
+                append_header(conn.out, head.headers[i].name, head.headers[i].value);
+            }
+        }
+        end_head(conn.out, proxy.keep_alive);
+    }
+
+    // Append response body bytes read into user space; false if the connection was closed
+    bool relay_response_bytes(Connection& conn, const char* data, size_t len) {
+        ProxyExchange& proxy = *conn.proxy;
+        switch (proxy.framing) {
+            case ResponseFraming::None:
+                proxy.upstream_keep_alive = false; // bytes after a bodiless response: don't reuse
+                return true;
+            case ResponseFraming::Length:
+                if (len > proxy.response_remaining) {
+                    proxy.upstream_keep_alive = false;
+                    len = proxy.response_remaining;
+                }
+                proxy.response_remaining -= len;
+                break;
+            case ResponseFraming::Chunked: {
+                size_t used = 0;
+                ChunkedStatus status = proxy.response_decoder.feed(data, len, used, [](const char*, size_t) {});
+                if (status == ChunkedStatus::Error) {
+                    close_connection(conn); // the client already has the head, it can't be told otherwise
+                    return false;
+                }
+                if (used < len) {
+                    proxy.upstream_keep_alive = false;
+                }
+                len = used;
+                break;
+            }
+            case ResponseFraming::UntilClose:
+                break;
+        }
+        conn.out.append(data, len);
+        return true;
+    }
+
+    bool response_complete(const ProxyExchange& proxy) const {
+        switch (proxy.framing) {
+            case ResponseFraming::None: return true;
+            case ResponseFraming::Length: return proxy.response_remaining == 0;
+            case ResponseFraming::Chunked: return proxy.response_decoder.done();
+            case ResponseFraming::UntilClose: return false;
+        }
+        return false;
+    }
+
+    // Move response body bytes from the upstream to the client until the upstream has no more
+    // for now or the client can't take more; reading resumes from handle_writable
+    void relay_response(Connection& conn) {
+        ProxyExchange& proxy = *conn.proxy;
+        bool splicing = (!conn.tls || conn.tls_kernel_send) &&
+                        (proxy.framing == ResponseFraming::Length || proxy.framing == ResponseFraming::UntilClose);
+        if (splicing && !proxy.pipe) {
+            proxy.pipe = pipe_pool_.take();
+            splicing = proxy.pipe != nullptr;
+        }
+        while (!response_complete(proxy)) {
+            size_t room = splicing ? proxy.pipe->capacity - proxy.pipe->buffered
+                                   : (send_queue_full(conn) ? 0 : BUFFER_SIZE * 4);
+            if (proxy.framing == ResponseFraming::Length) {
+                room = std::min<uint64_t>(room, proxy.response_remaining);
+            }
+            if (room == 0) {
+                set_upstream_events(proxy, false, proxy.want_write);
+                return;
+            }
+            ssize_t n;
+            if (splicing) {
+                n = splice(proxy.fd, nullptr, proxy.pipe->write_fd, nullptr, room, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0) {
+                    proxy.pipe->buffered += n;
+                    conn.out.append_pipe(proxy.pipe, n);
+                    if (proxy.framing == ResponseFraming::Length) {
+                        proxy.response_remaining -= n;
+                    }
+                }
+            } else {
+                thread_local char buffer[BUFFER_SIZE * 4];
+                n = recv(proxy.fd, buffer, room, 0);
+                if (n > 0 && !relay_response_bytes(conn, buffer, n)) {
+                    return;
+                }
+            }
+            if (n == 0) {
+                if (proxy.framing != ResponseFraming::UntilClose) {
+                    close_connection(conn); // truncated by the upstream, the client must not take it as complete
+                    return;
+                }
+                proxy.upstream_keep_alive = false;
+                break;
+            }
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    close_connection(conn);
+                    return;
+                }
+                set_upstream_events(proxy, true, proxy.want_write);
+                flush(conn); // the head and bytes that came with it may still be queued
+                return;
+            }
+            conn.last_active = std::chrono::steady_clock::now();
+            if (!flush(conn)) {
+                return;
+            }
+        }
+
+        // Complete: the upstream connection goes back to the pool if it is still in a clean
+        // state, then the requests pipelined behind this one are served
+        server_metrics.proxied.inc();
+        finish_proxy(conn, proxy.upstream_keep_alive && proxy.request_complete());
+        process_input(conn);
+    }
+
+    // Before the response head arrived: a pooled connection the upstream had closed is retried
+    // once on a new one, otherwise the client gets 502. A request the upstream may already have
+    // read and acted on, a POST that got out before the connection failed, is not sent twice.
+    // After the head, the client connection is closed, the only way left to tell it the
+    // response is incomplete.
+    void upstream_failed(Connection& conn) {
+        ProxyExchange& proxy = *conn.proxy;
+        if (proxy.head_done) {
+            close_connection(conn);
+            return;
+        }
+        if (proxy.reused && proxy.retryable && proxy.head.empty() && (proxy.idempotent || proxy.request_sent == 0)) {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, proxy.fd, nullptr);
+            upstream_clients_.erase(proxy.fd);
+            close(proxy.fd);
+            proxy.fd = -1;
+            proxy.request_sent = 0;
+            if (connect_upstream(conn, false)) {
+                return;
+            }
+        }
+        fail_proxy(conn, "502 Bad Gateway");
+        process_input(conn);
+    }
+
+    // Answer the client ourselves, the upstream connection is dropped. The caller goes on
+    // with process_input unless it is already inside it.
+    void fail_proxy(Connection& conn, const char* status) {
+        server_metrics.proxy_failed.inc();
+        bool keep_alive = conn.proxy->keep_alive;
+        finish_proxy(conn, false);
+        append_response(conn.out, status, "", "", keep_alive);
+    }
+
+    // Release the upstream connection; body bytes the client still sends are skipped
+    void finish_proxy(Connection& conn, bool reusable) {
+        ProxyExchange& proxy = *conn.proxy;
+        if (proxy.fd >= 0) {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, proxy.fd, nullptr);
+            upstream_clients_.erase(proxy.fd);
+            if (reusable) {
+                upstream_pool_.put(proxy.upstream, proxy.fd, std::chrono::steady_clock::now());
+            } else {
+                close(proxy.fd);
+            }
+        }
+        proxy.upstream->outstanding.fetch_sub(1, std::memory_order_relaxed);
+        conn.body_remaining = proxy.body_remaining;
+        conn.body_chunked = proxy.body_chunked;
+        conn.chunked = proxy.body_decoder;
+        pipe_pool_.give_back(std::move(proxy.pipe));
+        conn.proxy.reset();
+    }
+
+    void handle_writable(Connection& conn) {
+        // The handshake finished on a write: read what the client sent along with it
+        if (conn.tls && !conn.tls_ready) {
+            if (continue_handshake(conn) && conn.tls_ready) {
+                handle_readable(conn);
+            }
+            return;
+        }
+        if (!flush(conn)) {
+            return;
+        }
+        // Room again for a proxied body that was held back by a full queue or pipe
+        if (conn.proxy && conn.proxy->head_done && !conn.proxy->want_read) {
+            relay_response(conn);
+            return;
+        }
+        if (conn.reading_paused && can_resume_reading(conn)) {
+            set_reading_paused(conn, false);
+            process_input(conn);
+        }
+    }
+
+    // Write as much pending output as the socket accepts: memory chunks are gathered into
+    // one writev, file ranges go through sendfile, proxied bodies waiting in a pipe through
+    // splice. With kTLS the kernel encrypts all of them, else HTTPS output goes through SSL_write. An HTTP/2 connection is topped up with DATA frames
+    // whenever the queue runs dry. Returns false if the connection was closed
+    bool flush(Connection& conn) {
+        OutputQueue& chunks = conn.out;
+        bool sent = false; // a slow reader draining a long response isn't idle
+        while (!chunks.empty() || (conn.h2 && conn.h2->fill(chunks))) {
+            // A generated body whose current piece is written: pull the next one, or finish it
+            OutputChunk& front = chunks.front();
+            if (front.source && front.sent == front.data.size()) {
+                if (front.source_done) {
+                    chunks.pop_front();
+                } else {
+                    front.refill();
+                }
+                continue;
+            }
+
+            ssize_t n;
+            if (conn.tls && !conn.tls_kernel_send) {
+                n = tls_write(conn);
+                if (n > 0) {
+                    server_metrics.sent.inc(n);
+                    sent = true;
+                    continue;
+                }
+            } else if (front.pipe) {
+                OutputChunk& chunk = front;
+                n = splice(chunk.pipe->read_fd, nullptr, conn.fd, nullptr, chunk.pipe_remaining,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0) {
+                    server_metrics.sent.inc(n);
+                    sent = true;
+                    chunk.pipe->buffered -= n;
+                    chunk.pipe_remaining -= n;
+                    if (chunk.pipe_remaining == 0) {
+                        chunks.pop_front();
+                    }
+                    continue;
+                }
+                if (n == 0) {
+                    close_connection(conn);
+                    return false;
+                }
+            } else if (front.file) {
+                OutputChunk& chunk = front;
+                n = sendfile(conn.fd, chunk.file->fd, &chunk.file_offset, chunk.file_remaining);
+                if (n > 0) {
+                    server_metrics.sent.inc(n);
+                    sent = true;
+                    chunk.file_remaining -= n;
+                    if (chunk.file_remaining == 0) {
+                        chunks.pop_front();
+                    }
+                    continue;
+                }
+                if (n == 0) {
+                    close_connection(conn); // file shrank underneath us, the response can't be completed
+                    return false;
+                }
+            } else {
+                struct iovec iov[MAX_IOVECS];
+                int iovcnt = 0;
+                for (size_t i = 0; i < chunks.size() && !chunks[i].file && !chunks[i].pipe && iovcnt < MAX_IOVECS; ++i) {
+                    const OutputChunk& chunk = chunks[i];
+                    if (chunk.memory_size() > chunk.sent) {
+                        iov[iovcnt].iov_base = const_cast<char*>(chunk.memory() + chunk.sent);
+                        iov[iovcnt].iov_len = chunk.memory_size() - chunk.sent;
+                        ++iovcnt;
+                    }
+                    // Output behind a generated body waits until its last piece
+                    if (chunk.source && !chunk.source_done) {
+                        break;
+                    }
+                }
+                n = writev(conn.fd, iov, iovcnt);
+                if (n > 0) {
+                    server_metrics.sent.inc(n);
+                    sent = true;
+                    consume_output(chunks, n);
+                    continue;
+                }
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (sent) {
+                    conn.last_active = std::chrono::steady_clock::now();
+                }
+                set_want_write(conn, true);
+                return true;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            close_connection(conn);
+            return false;
+        }
+
+        if (sent) {
+            conn.last_active = std::chrono::steady_clock::now();
+        }
+        set_want_write(conn, false);
+        finish_send(conn);
+        if ((conn.close_after_write && !conn.proxy && !conn.upload) || (conn.h2 && conn.h2->finished())) {
+            if (conn.tls_ready) {
+                SSL_shutdown(conn.tls.get()); // best effort close_notify, we don't wait for the reply
+            }
+            close_connection(conn);
+            return false;
+        }
+        return true;
+    }
+
+    void set_want_write(Connection& conn, bool want) {
+        if (conn.want_write != want) {
+            conn.want_write = want;
+            update_events(conn);
+        }
+    }
+
+    void set_reading_paused(Connection& conn, bool paused) {
+        if (conn.reading_paused != paused) {
+            conn.reading_paused = paused;
+            update_events(conn);
+        }
+    }
+
+    void update_events(Connection& conn) {
+        struct epoll_event ev;
+        ev.events = conn.reading_paused ? 0 : EPOLLIN | EPOLLRDHUP;
+        if (conn.want_write) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.fd = conn.fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd, &ev);
+    }
+
+    void close_connection(Connection& conn) {
+        if (conn.proxy) {
+            server_metrics.proxy_failed.inc();
+            finish_proxy(conn, false);
+        }
+        if (conn.upload) {
+            server_metrics.uploads_failed.inc(); // the temporary file goes with it
+        }
+        int fd = conn.fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        admission.release_connection(conn.ip);
+        server_metrics.open.add(-1);
+        connections_.erase(fd);
+    }
+
+    void close_idle_connections(std::chrono::steady_clock::time_point now) {
+        std::vector<int> idle;
+        std::vector<int> timed_out;
+        for (const auto& entry : connections_) {
+            const ProxyExchange* proxy = entry.second.proxy.get();
+            if (proxy && !proxy->head_done) {
+                if (now - proxy->started >= std::chrono::seconds(UPSTREAM_TIMEOUT)) {
+                    timed_out.push_back(entry.first);
+                }
+            } else if (now - entry.second.last_active >= std::chrono::seconds(IDLE_TIMEOUT)) {
+                idle.push_back(entry.first);
+            }
+        }
+        for (int fd : idle) {
+            close_connection(connections_[fd]);
+        }
+        for (int fd : timed_out) {
+            fail_proxy(connections_[fd], "504 Gateway Timeout");
+            process_input(connections_[fd]);
+        }
+        upstream_pool_.expire(now);
+    }
+
+    int id_;
+    QueueDelayMonitor delay_monitor_;
+    std::chrono::steady_clock::time_point batch_start_; // when epoll_wait last returned
+    uint64_t batch_ticks_ = 0;   // ... in trace ticks
+    TraceRing trace_ring_;
+    uint64_t trace_requests_ = 0; // requests seen by the sampler
+    uint64_t trace_dumped_ = 0;   // last trace dump request served
+    int listen_fd_ = -1;
+    int tls_listen_fd_ = -1;
+    int epoll_fd_ = -1;
+    std::unordered_map<int, Connection> connections_;
+    std::unordered_map<int, int> upstream_clients_; // upstream connection -> client connection
+    UpstreamPool upstream_pool_;
+    PipePool pipe_pool_;
+};
+
+int main(int argc, char* argv[]) {
+    // Usage: simple_http_server [reactors] [--mime-types file] [--backlog n] [--max-connections n]
+    //        [--max-connections-per-ip n] [--ip-rate requests_per_second] [--ip-burst n] [--queue-target-ms ms]
+    //        [--cert cert.pem --key key.pem] [--no-ktls] [--trace-sample n] [--vhost name=dir ...]
+    //        [--upstream host:port|unix:path ...] [--upstream-health path] [--uploads] [--max-upload bytes]
+    // A limit of 0 disables it; per-address request rates are unlimited unless --ip-rate is given.
+    // Each --vhost serves the Host name from its own document root, other hosts get DOCUMENT_ROOT.
+    // With upstreams, requests below PROXY_PREFIX are forwarded to them; they are checked with a
+    // connect every few seconds, or with a GET of the health path when one is given.
+    // --uploads lets PUT and POST store files below the document roots, bodies up to
+    // MAX_UPLOAD_SIZE or --max-upload bytes; the parent directory must exist.
+    // Every *.mp4 is also streamed: play /name.mp4.m3u8 (HLS) or /name.mp4.mpd (DASH).
+    // With a certificate HTTPS is served on TLS_PORT as well. For local testing a self-signed one does:
+    //   openssl req -x509 -newkey rsa:2048 -nodes -days 365 -subj /CN=localhost -keyout key.pem -out cert.pem
+    // kTLS needs the kernel's tls module (modprobe tls); without it OpenSSL encrypts in user space.
+    // One request in n (0: none) has its phases traced; kill -USR1 writes the recent ones to
+    // trace-<pid>-<n>.json in the working directory, to open in chrome://tracing or Perfetto.
+    int num_reactors = std::max(1u, std::thread::hardware_concurrency());
+    AdmissionConfig limits;
+    std::string cert_file;
+    std::string key_file;
+    bool kernel_tls = true;
+    std::vector<std::pair<std::string, std::string>> vhosts;
+    std::string health_path;
+    for (int i = 1; i < argc; ++i) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--backlog") == 0 && has_value) {
+            limits.backlog = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--max-connections") == 0 && has_value) {
+            limits.max_connections = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--max-connections-per-ip") == 0 && has_value) {
+            limits.max_connections_per_ip = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--ip-rate") == 0 && has_value) {
+            limits.requests_per_second_per_ip = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--ip-burst") == 0 && has_value) {
+            limits.request_burst_per_ip = std::max(1.0, atof(argv[++i]));
+        } else if (strcmp(argv[i], "--queue-target-ms") == 0 && has_value) {
+            limits.queue_target = std::chrono::microseconds(static_cast<int64_t>(atof(argv[++i]) * 1000));
+        } else if (strcmp(argv[i], "--cert") == 0 && has_value) {
+            cert_file = argv[++i];
+        } else if (strcmp(argv[i], "--key") == 0 && has_value) {
+            key_file = argv[++i];
+        } else if (strcmp(argv[i], "--trace-sample") == 0 && has_value) {
+            trace_sample_rate = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--vhost") == 0 && has_value) {
+            const char* spec = argv[++i];
+            const char* eq = strchr(spec, '=');
+            if (!eq || eq == spec || !eq[1]) {
+                std::cerr << "--vhost expects name=dir, got " << spec << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            vhosts.emplace_back(std::string(spec, eq), eq + 1);
+        } else if (strcmp(argv[i], "--upstream") == 0 && has_value) {
+            if (!upstreams.add(argv[++i])) {
+                std::cerr << "--upstream expects host:port or unix:path, got " << argv[i] << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--upstream-health") == 0 && has_value) {
+            health_path = argv[++i];
+        } else if (strcmp(argv[i], "--uploads") == 0) {
+            max_upload_size = max_upload_size ? max_upload_size : MAX_UPLOAD_SIZE;
+        } else if (strcmp(argv[i], "--max-upload") == 0 && has_value) {
+            max_upload_size = std::max<uint64_t>(1, strtoull(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--no-ktls") == 0) {
+            kernel_tls = false;
+        } else if (strcmp(argv[i], "--mime-types") == 0 && has_value) {
+            if (!mime_registry.load(argv[++i])) {
+                std::cerr << "Cannot read MIME types from " << argv[i] << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            std::cout << "Loaded " << mime_registry.size() << " MIME types from " << argv[i] << std::endl;
+        } else {
+            num_reactors = std::max(1, atoi(argv[i]));
+        }
+    }
+
+    admission.configure(limits);
+    if (!cert_file.empty() && !tls_context.init(cert_file, key_file.empty() ? cert_file : key_file, kernel_tls)) {
+        std::cerr << "Cannot load the TLS certificate and key" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // writev and sendfile have no MSG_NOSIGNAL, a peer reset must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+    trace_collector.set_reactors(num_reactors);
+    signal(SIGUSR1, [](int) { trace_collector.request_dump(); });
+
+    if (!virtual_hosts.add("", DOCUMENT_ROOT, DIR_PAGE_SIZE)) {
+        exit(EXIT_FAILURE);
+    }
+    for (const auto& [name, root] : vhosts) {
+        if (!virtual_hosts.add(name, root, DIR_PAGE_SIZE)) {
+            exit(EXIT_FAILURE);
+        }
+        std::cout << "Host " << name << " served from " << root << std::endl;
+    }
+
+    // Cached files and descriptors are dropped as soon as inotify reports a change below a
+    // document root; without inotify the caches could serve stale bytes, so they are turned off
+    virtual_hosts.for_each([](VirtualHost& host) {
+        host.watcher.subscribe(invalidate_cached);
+        host.watcher.subscribe([&host](const std::string& path, bool is_dir) { host.index.on_change(path, is_dir); });
+        if (!host.watcher.start(host.root)) {
+            std::cerr << "inotify unavailable for " << host.root << ", file cache disabled" << std::endl;
+            file_cache.disable();
+            path_cache.disable();
+        }
+    });
+
+    std::vector<std::unique_ptr<Reactor>> reactors;
+    for (int i = 0; i < num_reactors; ++i) {
+        reactors.emplace_back(new Reactor(i));
+        if (!reactors.back()->init()) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (upstreams.enabled()) {
+        upstreams.start_health_checks(health_path);
+    }
+
+    std::cout << "Server listening on port " << PORT << " with " << num_reactors << " reactors" << std::endl;
+    if (tls_context.enabled()) {
+        std::cout << "HTTPS on port " << TLS_PORT << (kernel_tls ? ", kTLS when available" : "") << std::endl;
+    }
+
+    std::vector<std::thread> threads;
+    for (auto& reactor : reactors) {
+        threads.emplace_back(&Reactor::run, reactor.get());
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return 0;
+}
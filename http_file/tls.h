@@ -0,0 +1,142 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <string>
+#include <memory>
+#include <iostream>
+#include <cstring>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_RECORD_SIZE 16384          // Largest TLS record plaintext, the unit of SSL_write
+#define TLS_SESSION_CACHE_SIZE 20480   // Sessions kept for resumption by session ID (TLS 1.2)
+#define TLS_SESSION_ID_CONTEXT "simple_http_server"
+
+struct SslFree {
+    void operator()(SSL* ssl) const {
+        SSL_free(ssl);
+    }
+};
+
+// The TLS state of one connection
+using TlsSession = std::unique_ptr<SSL, SslFree>;
+
+// Outcome of an OpenSSL call on a non-blocking socket
+enum class TlsStatus {
+    Done,
+    WantRead,  // retry once the socket is readable
+    WantWrite, // retry once the socket is writable
+    Closed,    // the peer sent close_notify
+    Error,
+};
+
+inline TlsStatus tls_status(SSL* ssl, int ret) {
+    if (ret > 0) {
+        return TlsStatus::Done;
+    }
+    switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ: return TlsStatus::WantRead;
+        case SSL_ERROR_WANT_WRITE: return TlsStatus::WantWrite;
+        case SSL_ERROR_ZERO_RETURN: return TlsStatus::Closed;
+        default:
+            ERR_clear_error(); // the error queue is per thread, don't let one connection's failure leak into the next
+            return TlsStatus::Error;
+    }
+}
+
+// After the handshake, true when the kernel encrypts what is written to the socket (kTLS):
+// writev and sendfile then work on the socket unchanged and file bodies never enter user space
+inline bool tls_kernel_send(SSL* ssl) {
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+// Server TLS configuration shared by every reactor. SSL_CTX is thread safe once set up, so
+// one session cache and one set of ticket keys serve all reactors: a client resumes its
+// session whichever reactor the kernel hands the new connection to.
+class TlsContext {
+public:
+    ~TlsContext() {
+        SSL_CTX_free(ctx_);
+    }
+
+    // Load a PEM certificate chain and private key; kernel_tls asks OpenSSL to hand record
+    // encryption to the kernel after each handshake when the kernel and cipher allow it
+    bool init(const std::string& cert_file, const std::string& key_file, bool kernel_tls) {
+        ctx_ = SSL_CTX_new(TLS_server_method());
+        if (!ctx_) {
+            print_errors("SSL_CTX_new");
+            return false;
+        }
+        SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+        if (SSL_CTX_use_certificate_chain_file(ctx_, cert_file.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx_, key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx_) != 1) {
+            print_errors(cert_file.c_str());
+            SSL_CTX_free(ctx_);
+            ctx_ = nullptr;
+            return false;
+        }
+
+        // Renegotiation would let SSL_write want a read; nobody needs it with TLS 1.2+.
+        // A client that shuts down its side without close_notify still gets its responses.
+        uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF;
+        if (kernel_tls) {
+            options |= SSL_OP_ENABLE_KTLS;
+        }
+        SSL_CTX_set_options(ctx_, options);
+        // Writes are retried from the output queue, whose buffer may have moved in between.
+        // Idle keep-alive connections give their record buffers back.
+        SSL_CTX_set_mode(ctx_, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+        // Resumption: TLS 1.3 and ticket-capable TLS 1.2 clients use session tickets, older
+        // ones the server-side cache keyed by session ID
+        SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx_, TLS_SESSION_CACHE_SIZE);
+        SSL_CTX_set_session_id_context(ctx_, reinterpret_cast<const unsigned char*>(TLS_SESSION_ID_CONTEXT),
+                                       strlen(TLS_SESSION_ID_CONTEXT));
+
+        SSL_CTX_set_alpn_select_cb(ctx_, select_protocol, nullptr);
+        return true;
+    }
+
+    bool enabled() const {
+        return ctx_ != nullptr;
+    }
+
+    // A server session on a connected socket, its handshake is driven by SSL_do_handshake
+    TlsSession accept(int fd) const {
+        TlsSession ssl(SSL_new(ctx_));
+        if (!ssl || SSL_set_fd(ssl.get(), fd) != 1) {
+            print_errors("SSL_new");
+            return nullptr;
+        }
+        SSL_set_accept_state(ssl.get());
+        return ssl;
+    }
+
+private:
+    // ALPN: h2 when offered, the client then opens with the HTTP/2 connection preface
+    static int select_protocol(SSL*, const unsigned char** out, unsigned char* out_len,
+                               const unsigned char* in, unsigned int in_len, void*) {
+        static const unsigned char supported[] = "\x02h2\x08http/1.1";
+        unsigned char* selected = nullptr;
+        if (SSL_select_next_proto(&selected, out_len, supported, sizeof(supported) - 1, in, in_len) !=
+            OPENSSL_NPN_NEGOTIATED) {
+            return SSL_TLSEXT_ERR_NOACK; // no common protocol: carry on, the client will speak HTTP/1.1
+        }
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    static void print_errors(const char* what) {
+        char message[256];
+        while (unsigned long error = ERR_get_error()) {
+            ERR_error_string_n(error, message, sizeof(message));
+            std::cerr << what << ": " << message << std::endl;
+        }
+    }
+
+    SSL_CTX* ctx_ = nullptr;
+};
+
+#endif // TLS_H
@@ -0,0 +1,296 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#endif
+
+#define TRACE_RING_SIZE 1024  // Sampled requests kept per reactor, the oldest is overwritten (power of two)
+#define TRACE_MAX_SPANS 12    // Phases recorded per request
+#define TRACE_TARGET_SIZE 64  // Bytes of "METHOD /path" kept per request
+
+// USDT probes, built in when <sys/sdt.h> is available. A probe is a single nop until a tracer
+// attaches, so they fire for every request, sampled or not, e.g. with bpftrace:
+//   usdt:./simple_http_server:simple_http_server:phase { @[arg0] = hist(arg3 - arg2); }
+#ifdef HAVE_SDT
+#define TRACE_PROBE4(name, a, b, c, d) DTRACE_PROBE4(simple_http_server, name, a, b, c, d)
+#define TRACE_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(simple_http_server, name, a, b, c, d, e)
+#else
+#define TRACE_PROBE4(name, a, b, c, d) do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#define TRACE_PROBE5(name, a, b, c, d, e) do { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); } while (0)
+#endif
+
+// Phases of a request, in the order they happen
+enum TracePhase : uint8_t {
+    TRACE_CONNECT,   // accepted until the first request bytes were read
+    TRACE_RECEIVE,   // request head arriving over several reads
+    TRACE_LOOP_WAIT, // ready in epoll until the reactor got to the connection
+    TRACE_RECV,      // recv calls
+    TRACE_PARSE,
+    TRACE_HANDLE,    // producing the response, the phases below nest in it
+    TRACE_CACHE,     // file cache lookup
+    TRACE_OPEN,      // open and fstat
+    TRACE_READ,      // reading a file into memory
+    TRACE_COMPRESS,
+    TRACE_LISTING,   // directory listing
+    TRACE_SEND,      // queued until the socket took the last byte
+    TRACE_PHASES
+};
+
+inline const char* trace_phase_name(int phase) {
+    static const char* const names[TRACE_PHASES] = {
+        "connect", "receive", "event loop wait", "recv", "parse", "handle",
+        "cache lookup", "open", "read", "compress", "listing", "send"
+    };
+    return names[phase];
+}
+
+// Timestamp counter: rdtsc on x86, a few cycles and constant rate on any CPU with an invariant
+// TSC; the monotonic clock elsewhere. Converted to time only when a trace is written.
+inline uint64_t trace_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+struct TraceSpan {
+    uint64_t start;
+    uint64_t end;
+    uint8_t phase;
+};
+
+// Phase timestamps of one sampled request
+struct TraceRecord {
+    uint64_t id = 0; // 0: slot never used
+    int fd = -1;
+    uint16_t status = 0;
+    uint8_t span_count = 0;
+    char target[TRACE_TARGET_SIZE] = {};
+    TraceSpan spans[TRACE_MAX_SPANS];
+
+    void add(uint8_t phase, uint64_t start, uint64_t end) {
+        if (span_count < TRACE_MAX_SPANS) {
+            spans[span_count++] = {start, end, phase};
+        }
+    }
+};
+
+// The sampled request being handled on this thread, phases timed inside the handler attach to it
+inline TraceRecord*& trace_current() {
+    thread_local TraceRecord* current = nullptr;
+    return current;
+}
+
+// Connection of the request being handled on this thread, for the probes
+inline int& trace_current_fd() {
+    thread_local int fd = -1;
+    return fd;
+}
+
+// Record a finished phase of the current request
+inline void trace_phase(uint8_t phase, uint64_t start, uint64_t end) {
+    TRACE_PROBE4(phase, phase, trace_current_fd(), start, end);
+    if (TraceRecord* record = trace_current()) {
+        record->add(phase, start, end);
+    }
+}
+
+// Times a phase inside the handler. Without probes built in, unsampled requests skip the clock.
+class TraceScope {
+public:
+    explicit TraceScope(uint8_t phase) : phase_(phase) {
+#ifndef HAVE_SDT
+        if (!trace_current()) {
+            return;
+        }
+#endif
+        start_ = trace_ticks();
+    }
+
+    ~TraceScope() {
+        if (start_) {
+            trace_phase(phase_, start_, trace_ticks());
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    uint8_t phase_;
+    uint64_t start_ = 0;
+};
+
+// Sampled requests of one reactor, written and read only by its thread
+class TraceRing {
+public:
+    TraceRing() : records_(new TraceRecord[TRACE_RING_SIZE]) {}
+
+    // Start recording a request; the slot is reused once the ring has gone round
+    TraceRecord& start(int fd, std::string_view method, std::string_view path) {
+        TraceRecord& record = records_[next_id_ & (TRACE_RING_SIZE - 1)];
+        record = TraceRecord();
+        record.id = ++next_id_;
+        record.fd = fd;
+        size_t n = method.copy(record.target, sizeof(record.target) - 2);
+        record.target[n++] = ' ';
+        path.copy(record.target + n, sizeof(record.target) - 1 - n);
+        return record;
+    }
+
+    // A record started earlier, nullptr once its slot has been reused
+    TraceRecord* find(uint64_t id) {
+        TraceRecord& record = records_[(id - 1) & (TRACE_RING_SIZE - 1)];
+        return record.id == id ? &record : nullptr;
+    }
+
+    void copy_to(std::vector<TraceRecord>& out) const {
+        for (size_t i = 0; i < TRACE_RING_SIZE; ++i) {
+            if (records_[i].id != 0) {
+                out.push_back(records_[i]);
+            }
+        }
+    }
+
+private:
+    std::unique_ptr<TraceRecord[]> records_;
+    uint64_t next_id_ = 0;
+};
+
+// Writes the rings of all reactors to a Chrome trace file (chrome://tracing, Perfetto) on
+// request. A signal handler can only bump a counter, so each reactor notices the request in
+// its loop and hands over a copy of its own ring; the last one to do so writes the file.
+// Every reactor is a process and every connection a thread in the viewer.
+class TraceCollector {
+public:
+    TraceCollector() {
+        origin_ticks_ = trace_ticks();
+        origin_ns_ = now_ns();
+    }
+
+    void set_reactors(int reactors) {
+        reactors_ = reactors;
+    }
+
+    // Async-signal-safe
+    void request_dump() {
+        requested_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t requested() const {
+        return requested_.load(std::memory_order_relaxed);
+    }
+
+    void contribute(uint64_t generation, int reactor, const TraceRing& ring) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (generation != generation_) {
+            generation_ = generation;
+            contributed_ = 0;
+            records_.clear();
+        }
+        std::vector<TraceRecord> copy;
+        ring.copy_to(copy);
+        for (TraceRecord& record : copy) {
+            records_.emplace_back(reactor, record);
+        }
+        if (++contributed_ == reactors_) {
+            write();
+            records_.clear();
+        }
+    }
+
+private:
+    static uint64_t now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+    }
+
+    static void write_escaped(FILE* f, const char* s) {
+        for (; *s; ++s) {
+            unsigned char c = *s;
+            if (c == '"' || c == '\\') {
+                fprintf(f, "\\%c", c);
+            } else if (c < 0x20) {
+                fprintf(f, "\\u%04x", c);
+            } else {
+                fputc(c, f);
+            }
+        }
+    }
+
+    void write() {
+        // Tick rate measured over the whole run, against the monotonic clock
+        uint64_t ticks = trace_ticks() - origin_ticks_;
+        uint64_t ns = now_ns() - origin_ns_;
+        double ticks_per_us = ns ? static_cast<double>(ticks) / ns * 1000.0 : 1000.0;
+        auto us = [&](uint64_t t) { return static_cast<double>(t - origin_ticks_) / ticks_per_us; };
+
+        std::string path = "trace-" + std::to_string(getpid()) + "-" + std::to_string(generation_) + ".json";
+        FILE* f = fopen(path.c_str(), "w");
+        if (!f) {
+            perror(path.c_str());
+            return;
+        }
+        fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        bool first = true;
+        for (const auto& [reactor, record] : records_) {
+            if (record.span_count == 0) {
+                continue;
+            }
+            uint64_t start = record.spans[0].start;
+            uint64_t end = record.spans[0].end;
+            for (int i = 1; i < record.span_count; ++i) {
+                start = std::min(start, record.spans[i].start);
+                end = std::max(end, record.spans[i].end);
+            }
+            fprintf(f, "%s{\"name\":\"", first ? "" : ",\n");
+            write_escaped(f, record.target);
+            fprintf(f, "\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                       "\"args\":{\"status\":%u,\"id\":%llu}}",
+                    us(start), (end - start) / ticks_per_us, reactor, record.fd, record.status,
+                    static_cast<unsigned long long>(record.id));
+            for (int i = 0; i < record.span_count; ++i) {
+                const TraceSpan& span = record.spans[i];
+                fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                        trace_phase_name(span.phase), us(span.start), (span.end - span.start) / ticks_per_us,
+                        reactor, record.fd);
+            }
+            first = false;
+        }
+        fprintf(f, "\n]}\n");
+        fclose(f);
+        printf("Trace of %zu sampled requests written to %s\n", records_.size(), path.c_str());
+        fflush(stdout);
+    }
+
+    std::atomic<uint64_t> requested_{0};
+    std::mutex mtx_;
+    int reactors_ = 1;
+    uint64_t generation_ = 0;
+    int contributed_ = 0;
+    std::vector<std::pair<int, TraceRecord>> records_;
+    uint64_t origin_ticks_;
+    uint64_t origin_ns_;
+};
+
+#endif // TRACE_H
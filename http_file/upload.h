@@ -0,0 +1,211 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "http_parser.h"
+#include "output_queue.h"
+#include "path_cache.h"
+#include "virtual_host.h"
+
+#define MAX_UPLOAD_SIZE (8ULL << 30)          // Default limit of one uploaded body, see --max-upload
+#define UPLOAD_BYTES_PER_WAKEUP (4 * 1024 * 1024) // Body bytes spliced per readiness event, a fast upload can't starve the reactor
+
+// Status for a failed file operation of an upload
+inline const char* upload_error_status(int error) {
+    switch (error) {
+        case ENOENT:
+        case ENOTDIR:
+        case EISDIR:
+            return "409 Conflict";
+        case EXDEV:
+        case ELOOP:
+        case EACCES:
+        case EPERM:
+        case EROFS:
+            return "403 Forbidden";
+        case ENAMETOOLONG:
+            return "414 URI Too Long";
+        case EFBIG:
+            return "413 Content Too Large";
+        case ENOSPC:
+        case EDQUOT:
+            return "507 Insufficient Storage";
+        default:
+            return "500 Internal Server Error";
+    }
+}
+
+// The file an uploaded body is stored in. Bytes go to an unnamed O_TMPFILE inode in the
+// target's directory that is linked under a temporary name and renamed over the target once
+// the body is complete: readers, the caches and the directory listing never see a partial
+// file, and an upload that fails or is cut off leaves nothing behind. File systems without
+// O_TMPFILE get a named temporary file instead, visible while the body is written.
+class UploadFile {
+public:
+    UploadFile() = default;
+    UploadFile(const UploadFile&) = delete;
+    UploadFile& operator=(const UploadFile&) = delete;
+
+    ~UploadFile() {
+        if (fd_ >= 0) {
+            close(fd_);
+            if (named_) {
+                unlinkat(dir_fd_, temp_.c_str(), 0);
+            }
+        }
+        if (dir_fd_ >= 0) {
+            close(dir_fd_);
+        }
+    }
+
+    // Create the temporary file for the normalized request path beneath the document root
+    // root_fd; the parent directory must exist. Returns nullptr, or the status to answer.
+    const char* open(int root_fd, const std::string& path) {
+        size_t slash = path.find_last_of('/');
+        if (slash == path.size() - 1) {
+            return "409 Conflict"; // a directory
+        }
+        name_ = path.substr(slash + 1);
+        dir_fd_ = slash == 0 ? fcntl(root_fd, F_DUPFD_CLOEXEC, 0)
+                             : open_beneath(root_fd, path.substr(1, slash - 1).c_str(), O_PATH | O_DIRECTORY);
+        if (dir_fd_ < 0) {
+            return upload_error_status(errno);
+        }
+        struct stat st;
+        if (fstatat(dir_fd_, name_.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                return "409 Conflict";
+            }
+            replaced_ = true;
+        }
+        static std::atomic<uint64_t> sequence{0};
+        temp_ = "." + name_ + ".upload-" + std::to_string(getpid()) + "-" +
+                std::to_string(sequence.fetch_add(1, std::memory_order_relaxed));
+        fd_ = openat(dir_fd_, ".", O_WRONLY | O_TMPFILE | O_CLOEXEC, 0644);
+        if (fd_ < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+            fd_ = openat(dir_fd_, temp_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            named_ = true;
+        }
+        return fd_ < 0 ? upload_error_status(errno) : nullptr;
+    }
+
+    // Claim the space of a body of known size up front, so a full disk is reported before the
+    // client sends it. File systems without fallocate simply allocate as the body is written.
+    const char* reserve(uint64_t size) {
+        if (size > 0 && fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) < 0 &&
+            (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)) {
+            return upload_error_status(errno);
+        }
+        return nullptr;
+    }
+
+    bool write(const char* data, size_t len) {
+        while (len > 0) {
+            ssize_t n = ::write(fd_, data, len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                error_ = n < 0 ? errno : ENOSPC;
+                return false;
+            }
+            data += n;
+            len -= n;
+            written_ += n;
+        }
+        return true;
+    }
+
+    // Move everything buffered in the pipe into the file; the pages spliced in from the
+    // socket reach the page cache without a copy through user space
+    bool drain(PipeBuffer& pipe) {
+        while (pipe.buffered > 0) {
+            ssize_t n = splice(pipe.read_fd, nullptr, fd_, nullptr, pipe.buffered, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                error_ = n < 0 ? errno : ENOSPC;
+                return false;
+            }
+            pipe.buffered -= n;
+            written_ += n;
+        }
+        return true;
+    }
+
+    // Replace the target with the complete file. Returns nullptr, or the status to answer.
+    const char* commit() {
+        // Space reserved beyond a body that ended short of it is given back
+        if (ftruncate(fd_, static_cast<off_t>(written_)) < 0) {
+            return upload_error_status(errno);
+        }
+        // The inode gets its name only now, through /proc: linkat with AT_EMPTY_PATH would need
+        // CAP_DAC_READ_SEARCH. Renaming a link rather than linking the target directly replaces
+        // an existing file atomically.
+        if (!named_) {
+            std::string proc = "/proc/self/fd/" + std::to_string(fd_);
+            if (linkat(AT_FDCWD, proc.c_str(), dir_fd_, temp_.c_str(), AT_SYMLINK_FOLLOW) < 0) {
+                return upload_error_status(errno);
+            }
+            named_ = true;
+        }
+        if (renameat(dir_fd_, temp_.c_str(), dir_fd_, name_.c_str()) < 0) {
+            return upload_error_status(errno);
+        }
+        close(fd_);
+        fd_ = -1;
+        return nullptr;
+    }
+
+    uint64_t written() const {
+        return written_;
+    }
+
+    bool replaced() const {
+        return replaced_;
+    }
+
+    // errno of the write or drain that failed
+    int error() const {
+        return error_;
+    }
+
+private:
+    int dir_fd_ = -1;
+    int fd_ = -1;
+    std::string name_;
+    std::string temp_;
+    bool named_ = false; // temp_ names the file in the directory, it is unlinked if not committed
+    uint64_t written_ = 0;
+    bool replaced_ = false;
+    int error_ = 0;
+};
+
+// A PUT or POST whose body is being stored. A Content-Length body on a plain connection is
+// spliced from the socket through pipe into the file; chunked bodies and HTTPS bodies are
+// decoded in user space and written from the connection's input buffer.
+struct Upload {
+    UploadFile file;
+    VirtualHost* host = nullptr;
+    std::string target;          // path of the stored file, as the caches and inotify name it
+    uint64_t body_remaining = 0; // Content-Length body bytes still to come
+    bool body_chunked = false;   // ... or a chunked body, ended when the decoder says so
+    ChunkedDecoder body_decoder;
+    uint64_t limit = 0;          // bytes the body may have
+    bool keep_alive = false;     // of the client connection, after the response
+    std::shared_ptr<PipeBuffer> pipe;
+
+    bool complete() const {
+        return body_remaining == 0 && !body_chunked;
+    }
+};
+
+#endif // UPLOAD_H
@@ -0,0 +1,94 @@
+#ifndef VIRTUAL_HOST_H
+#define VIRTUAL_HOST_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "dir_index.h"
+#include "resource_watcher.h"
+
+// A site: the document root every path of it is resolved beneath, opened once so that
+// resolution never walks the root's own path, plus its root listing and inotify watch
+struct VirtualHost {
+    std::string root;   // also the prefix of its file and path cache keys
+    int root_fd = -1;
+    DirectoryIndex index;
+    ResourceWatcher watcher;
+
+    VirtualHost(std::string dir, size_t page_size) : root(std::move(dir)), index(root, "/", page_size) {}
+
+    ~VirtualHost() {
+        if (root_fd >= 0) {
+            close(root_fd);
+        }
+    }
+};
+
+// Host header -> site. Names are matched case-insensitively without the port, anything
+// unknown (or no Host at all, as from HTTP/1.0 clients) gets the default site. Built at
+// startup and read-only afterwards; sites are few, so a scan beats hashing a lowered copy.
+class VirtualHosts {
+public:
+    // name "" is the default site. Returns false if root can't be opened as a directory.
+    bool add(std::string_view name, std::string root, size_t page_size) {
+        while (root.size() > 1 && root.back() == '/') {
+            root.pop_back();
+        }
+        auto host = std::make_unique<VirtualHost>(root, page_size);
+        host->root_fd = open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (host->root_fd < 0) {
+            perror(root.c_str());
+            return false;
+        }
+        if (name.empty()) {
+            default_ = std::move(host);
+        } else {
+            hosts_.emplace_back(std::string(name), std::move(host));
+        }
+        return true;
+    }
+
+    VirtualHost& find(const std::string_view* host_header) {
+        if (host_header && !hosts_.empty()) {
+            std::string_view name = host_name(*host_header);
+            for (auto& [alias, site] : hosts_) {
+                if (name.size() == alias.size() && strncasecmp(name.data(), alias.data(), name.size()) == 0) {
+                    return *site;
+                }
+            }
+        }
+        return *default_;
+    }
+
+    template <typename F>
+    void for_each(F f) {
+        f(*default_);
+        for (auto& entry : hosts_) {
+            f(*entry.second);
+        }
+    }
+
+private:
+    // "Example.com:8080" -> "Example.com", "[::1]:8080" -> "[::1]"; a trailing dot is dropped
+    static std::string_view host_name(std::string_view host) {
+        size_t colon = host.rfind(':');
+        if (colon != std::string_view::npos && host.find(']', colon) == std::string_view::npos) {
+            host = host.substr(0, colon);
+        }
+        if (!host.empty() && host.back() == '.') {
+            host.remove_suffix(1);
+        }
+        return host;
+    }
+
+    std::unique_ptr<VirtualHost> default_;
+    std::vector<std::pair<std::string, std::unique_ptr<VirtualHost>>> hosts_;
+};
+
+#endif // VIRTUAL_HOST_H
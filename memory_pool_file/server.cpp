@@ -11,6 +11,15 @@
 #include <condition_variable>
 #include <chrono>
 
+#include "../common/metrics.h"
+
+// 运行指标, 由 METRICS_PORT 端口以 Prometheus 文本格式导出
+Gauge& clients_open = metrics().gauge("pool_server_clients_open", "Clients currently connected.");
+Counter& messages_received = metrics().counter("pool_server_messages_total", "Messages received and acknowledged.");
+Counter& received_bytes = metrics().counter("pool_server_received_bytes_total", "Bytes received from clients.");
+Counter& allocation_failures = metrics().counter("pool_server_allocation_failures_total", "Messages dropped because the memory pool was empty.");
+Histogram& message_duration = metrics().histogram("pool_server_message_duration_seconds", "Time to store, log and acknowledge one message.");
+
 // 内存池类，用于管理固定大小的内存块
 class MemoryPool {
 public:
@@ -37,6 +46,16 @@ public:
         return ptr;
     }
 
+    // 当前空闲的内存块数量
+    std::size_t free_blocks() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return free_list_.size();
+    }
+
+    std::size_t total_blocks() const {
+        return num_blocks_;
+    }
+
     // 释放一块内存，使其可以被再次分配
     void deallocate(void* ptr) {
         if (!ptr) {
@@ -62,11 +81,14 @@ void handle_client(int client_socket, sockaddr_in client_addr, MemoryPool& pool)
         if (bytes_received <= 0) {
             break; // 连接关闭或错误
         }
+        uint64_t start = metrics_now_ns();
+        received_bytes.inc(bytes_received);
 
         // 使用内存池分配内存块来存储接收到的数据
         void* data_block = pool.allocate();
         if (!data_block) {
             std::cerr << "Memory allocation failed!" << std::endl;
+            allocation_failures.inc();
             break;
         }
 
@@ -88,9 +110,12 @@ void handle_client(int client_socket, sockaddr_in client_addr, MemoryPool& pool)
 
         // 释放内存块
         pool.deallocate(data_block);
+        messages_received.inc();
+        message_duration.record(metrics_now_ns() - start);
     }
 
     close(client_socket);
+    clients_open.add(-1);
 }
 
 int main() {
@@ -122,6 +147,12 @@ int main() {
 
     MemoryPool pool(1024 * 1024, 1024); // 1MB内存池，每个块1KB
 
+    metrics().gauge_callback("pool_server_blocks_in_use", "Memory pool blocks currently allocated.",
+                             [&pool] { return static_cast<double>(pool.total_blocks() - pool.free_blocks()); });
+    if (start_metrics_server(METRICS_PORT)) {
+        std::cout << "Metrics on port " << METRICS_PORT << std::endl;
+    }
+
     while (true) {
         sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
@@ -135,6 +166,7 @@ int main() {
             }
         }
 
+        clients_open.add(1);
         std::thread client_thread(handle_client, client_socket, client_addr, std::ref(pool));
         client_thread.detach(); // 分离线程，让其独立运行
     }
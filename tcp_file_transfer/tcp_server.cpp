@@ -11,9 +11,18 @@
 #include <sys/stat.h>
 #include <netinet/tcp.h> // 包含 TCP_NODELAY 的头文件
 
+#include "../common/metrics.h"
+
 #define PORT 8080
 #define BUFFER_SIZE 1024 * 1024 // 1MB per chunk
 
+// 运行指标, 由 METRICS_PORT 端口以 Prometheus 文本格式导出
+Gauge& transfers_active = metrics().gauge("file_server_transfers_active", "File transfers in progress.");
+Counter& transfers_completed = metrics().counter("file_server_transfers_completed_total", "Files sent to the end.");
+Counter& sent_bytes = metrics().counter("file_server_sent_bytes_total", "File bytes sent to clients.");
+Counter& send_errors = metrics().counter("file_server_send_errors_total", "Chunks that could not be read or fully sent.");
+Histogram& chunk_duration = metrics().histogram("file_server_chunk_duration_seconds", "Time to read and send one chunk.");
+
 void enable_tcp_options(int sockfd) {
     int optval = 1;
     if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval)) < 0) { // 启用 TCP_NODELAY 选项
@@ -22,21 +31,35 @@ void enable_tcp_options(int sockfd) {
     }
 }
 
-void send_file_chunk(int sockfd, int file_fd, off_t offset, size_t length) {
+// 返回整块是否都已发出
+bool send_file_chunk(int sockfd, int file_fd, off_t offset, size_t length) {
+    uint64_t start = metrics_now_ns();
     char buffer[BUFFER_SIZE];
     ssize_t bytes_read = pread(file_fd, buffer, length, offset); // 从文件读取数据
     if (bytes_read <= 0) {
         std::cerr << "Failed to read file at offset " << offset << ", bytes_read: " << bytes_read << std::endl;
-        return;
+        send_errors.inc();
+        return false;
     }
 
     ssize_t bytes_sent = send(sockfd, buffer, bytes_read, 0); // 发送数据
+    if (bytes_sent > 0) {
+        sent_bytes.inc(bytes_sent);
+    }
     if (bytes_sent != bytes_read) {
         std::cerr << "Failed to send all data. Sent " << bytes_sent << " out of " << bytes_read << " bytes." << std::endl;
+        send_errors.inc();
     }
+    chunk_duration.record(metrics_now_ns() - start);
+    return bytes_sent == bytes_read && static_cast<size_t>(bytes_read) == length;
 }
 
 void server_thread(int client_sockfd, const std::string& file_path) {
+    struct ActiveTransfer {
+        ActiveTransfer() { transfers_active.add(1); }
+        ~ActiveTransfer() { transfers_active.add(-1); }
+    } active;
+
     int file_fd = open(file_path.c_str(), O_RDONLY); // 打开文件
     if (file_fd < 0) {
         perror("Failed to open file");
@@ -53,9 +76,13 @@ void server_thread(int client_sockfd, const std::string& file_path) {
     }
     size_t file_size = file_stat.st_size;
 
+    bool complete = true;
     for (off_t offset = 0; offset < file_size; offset += BUFFER_SIZE) {
         size_t length = static_cast<size_t>(std::min(static_cast<long long>(file_size - offset), static_cast<long long>(BUFFER_SIZE))); // 计算当前块的长度
-        send_file_chunk(client_sockfd, file_fd, offset, length); // 发送文件块
+        if (!send_file_chunk(client_sockfd, file_fd, offset, length)) { // 发送文件块
+            complete = false; // 缺了一块, 后面的数据也拼不成完整的文件
+            break;
+        }
         std::cout << "Sent " << length << " bytes from offset " << offset << std::endl;
     }
 
@@ -63,6 +90,9 @@ void server_thread(int client_sockfd, const std::string& file_path) {
     char empty_buffer[1] = {0};
     send(client_sockfd, empty_buffer, 0, 0);
     std::cout << "Sent end-of-file indicator" << std::endl;
+    if (complete) {
+        transfers_completed.inc();
+    }
 
     close(file_fd);
     close(client_sockfd);
@@ -106,6 +136,10 @@ int main(int argc, char const *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    if (start_metrics_server(METRICS_PORT)) {
+        std::cout << "Metrics on port " << METRICS_PORT << std::endl;
+    }
+
     while (true) {
         if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) { // 接受连接
             perror("accept");
@@ -0,0 +1,134 @@
+#ifndef TRANSFER_PROGRESS_H
+#define TRANSFER_PROGRESS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+// 发送路径只对这些原子计数器做 relaxed 自增，不做任何输出
+struct TransferStats {
+    uint64_t total_size = 0;
+    std::atomic<uint64_t> bytes_sent{0};            // 首次发送的字节数，不含重传
+    std::atomic<uint64_t> packets_sent{0};          // 所有发出的数据包，含重传
+    std::atomic<uint64_t> retransmitted_packets{0};
+    std::atomic<uint64_t> retransmitted_bytes{0};
+    std::atomic<uint64_t> lost_bytes{0};            // 服务端 NACK 报告缺失的字节数
+    std::atomic<bool> done{false};
+
+    void add_sent(uint64_t bytes) {
+        bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+        packets_sent.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void add_retransmitted(uint64_t bytes) {
+        retransmitted_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        retransmitted_packets.fetch_add(1, std::memory_order_relaxed);
+        packets_sent.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void add_lost(uint64_t bytes) {
+        lost_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+};
+
+// 独立线程按固定频率读取计数器并重绘进度：吞吐量、剩余时间、丢包率和重传率。
+// json 模式下每次刷新输出一行 JSON，便于脚本采集
+class ProgressReporter {
+public:
+    ProgressReporter(const TransferStats& stats, bool json, int refresh_hz = 10)
+        : stats_(stats), json_(json), interval_(std::chrono::milliseconds(1000 / refresh_hz)) {}
+
+    ~ProgressReporter() { stop(); }
+
+    void start() {
+        start_time_ = last_time_ = std::chrono::steady_clock::now();
+        thread_ = std::thread(&ProgressReporter::run, this);
+    }
+
+    // 停止刷新并输出最终一行
+    void stop() {
+        if (!thread_.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+        render(true);
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!cv_.wait_for(lock, interval_, [this] { return stopping_; })) {
+            render(false);
+        }
+    }
+
+    void render(bool final) {
+        auto now = std::chrono::steady_clock::now();
+        uint64_t sent = stats_.bytes_sent.load(std::memory_order_relaxed);
+        uint64_t packets = stats_.packets_sent.load(std::memory_order_relaxed);
+        uint64_t retrans_packets = stats_.retransmitted_packets.load(std::memory_order_relaxed);
+        uint64_t retrans_bytes = stats_.retransmitted_bytes.load(std::memory_order_relaxed);
+        uint64_t lost = stats_.lost_bytes.load(std::memory_order_relaxed);
+        uint64_t total = stats_.total_size;
+
+        double elapsed = std::chrono::duration<double>(now - start_time_).count();
+        double tick = std::chrono::duration<double>(now - last_time_).count();
+        uint64_t wire_bytes = sent + retrans_bytes;
+
+        // 瞬时速率做指数平滑，避免每次刷新数字跳动
+        double instant = tick > 0 ? (wire_bytes - last_wire_bytes_) / tick : 0;
+        rate_ = rate_ == 0 ? instant : 0.7 * rate_ + 0.3 * instant;
+        last_time_ = now;
+        last_wire_bytes_ = wire_bytes;
+
+        double progress = total ? static_cast<double>(sent) / total : 1.0;
+        double eta = (rate_ > 0 && sent < total) ? (total - sent) / rate_ : 0;
+        double loss = wire_bytes ? 100.0 * lost / wire_bytes : 0;
+        double retrans = packets ? 100.0 * retrans_packets / packets : 0;
+        double mbps = (final ? (elapsed > 0 ? wire_bytes / elapsed : 0) : rate_) * 8 / 1e6;
+
+        if (json_) {
+            std::printf("{\"elapsed\":%.3f,\"bytes_sent\":%llu,\"total_size\":%llu,\"progress\":%.4f,"
+                        "\"throughput_mbps\":%.2f,\"eta\":%.1f,\"packets_sent\":%llu,"
+                        "\"retransmitted_packets\":%llu,\"lost_bytes\":%llu,\"loss_rate\":%.3f,"
+                        "\"retransmit_rate\":%.3f,\"done\":%s}\n",
+                        elapsed, (unsigned long long)sent, (unsigned long long)total, progress,
+                        mbps, eta, (unsigned long long)packets, (unsigned long long)retrans_packets,
+                        (unsigned long long)lost, loss, retrans,
+                        stats_.done.load(std::memory_order_relaxed) ? "true" : "false");
+        } else {
+            const int bar_width = 50;
+            char bar[bar_width + 1];
+            int pos = bar_width * progress;
+            for (int i = 0; i < bar_width; ++i) {
+                bar[i] = i < pos ? '=' : (i == pos ? '>' : ' ');
+            }
+            bar[bar_width] = '\0';
+            std::printf("[%s] %3d %% %9.2f Mbit/s ETA %6.1fs loss %.2f%% retrans %.2f%%%s",
+                        bar, int(progress * 100.0), mbps, eta, loss, retrans, final ? "\n" : "\r");
+        }
+        std::fflush(stdout);
+    }
+
+    const TransferStats& stats_;
+    bool json_;
+    std::chrono::milliseconds interval_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::chrono::steady_clock::time_point start_time_, last_time_;
+    uint64_t last_wire_bytes_ = 0;
+    double rate_ = 0;
+};
+
+#endif // TRANSFER_PROGRESS_H
@@ -1,78 +1,298 @@
 #include <iostream>
 #include <fstream>
-#include <thread>
 #include <vector>
-#include <mutex>
+#include <random>
 #include <cstring>
+#include <cerrno>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <arpa/inet.h> // 引入 inet_addr 的声明
 #include <iomanip>      // 引入 setw 和 setfill
 #include <cmath>        // 引入 ceil
 
+#include "udp_protocol.h"
+#include "transfer_progress.h"
+
 #define SERVER_IP "127.0.0.1"
-#define PORT 8080
-#define BUFFER_SIZE 1472 // MTU size minus IP and UDP headers (1500 - 20 - 8 = 1472)
+#define FIN_TIMEOUT_MS 200   // 等待服务端回复 FIN 的超时时间
+#define MAX_FIN_RETRIES 50   // 连续超时多少次后放弃
+#define PROBE_TIMEOUT_MS 100 // 等待 PMTU 探测回复的超时时间
+#define PROBE_ATTEMPTS 2     // 每个探测长度的尝试次数，避免偶发丢包被误判为超过 PMTU
+#define PROBE_PRECISION 64   // 二分查找的上下界相差不超过该值时停止
 
-void send_file_with_progress(const std::string& filename, int client_socket, const struct sockaddr_in& server_addr) {
-    std::ifstream infile(filename, std::ios::binary);
-    if (!infile) {
-        std::cerr << "Error opening file for reading: " << filename << std::endl;
+// 一次上传的状态
+struct Transfer {
+    int socket = -1;
+    uint32_t conn_id = 0;
+    uint64_t total_size = 0;
+    size_t datagram_size = DEFAULT_DATAGRAM_SIZE; // 按路径探测得到的数据报长度（含协议头）
+    std::ifstream infile;
+    const char* map = nullptr; // --mmap：源文件的只读映射，数据报直接由 iovec 指向映射
+    std::vector<char> buffer;
+    TransferStats stats;
+    bool json = false; // --json：进度以 JSON 行输出到 stdout，其余信息改走 stderr
+    bool failed = false; // 读文件失败或数据报已无法再缩小，传输中止
+
+    size_t max_payload() const { return datagram_size - HEADER_SIZE; }
+    std::ostream& log() { return json ? std::cerr : std::cout; }
+};
+
+// 路由 MTU 对应的数据报上限，loopback 为 65536，巨帧网卡为 9000
+size_t route_datagram_limit(int sock) {
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+    if (getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &len) < 0 || mtu <= IP_UDP_OVERHEAD) {
+        return DEFAULT_DATAGRAM_SIZE;
+    }
+    return std::min<size_t>(mtu - IP_UDP_OVERHEAD, MAX_DATAGRAM_SIZE);
+}
+
+// 发送一个 size 字节的探测包，服务端回复 PROBE_ACK 说明该长度能通过整条路径
+bool probe_size(Transfer& t, size_t size) {
+    for (int attempt = 0; attempt < PROBE_ATTEMPTS; ++attempt) {
+        encode_header(t.buffer.data(), t.conn_id, PKT_PROBE, static_cast<uint16_t>(size - HEADER_SIZE), 0, 0);
+        if (send(t.socket, t.buffer.data(), size, 0) < 0) {
+            return false; // EMSGSIZE：超过本机出接口 MTU
+        }
+
+        struct pollfd pfd = {t.socket, POLLIN, 0};
+        while (poll(&pfd, 1, PROBE_TIMEOUT_MS) > 0) {
+            char reply[HEADER_SIZE];
+            ssize_t n = recv(t.socket, reply, sizeof(reply), 0);
+            PacketHeader h;
+            if (n > 0 && decode_header(reply, n, h) && h.conn_id == t.conn_id &&
+                h.type == PKT_PROBE_ACK && h.offset == size) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Packetization Layer PMTU 探测：设置 DF 并忽略内核缓存的 PMTU，直接用数据报长度试探路径。
+// 先试路由 MTU 允许的最大值（loopback、巨帧链路通常一次成功），否则二分查找；
+// 中间有隧道时大包会被静默丢弃，表现为探测超时。
+void discover_datagram_size(Transfer& t) {
+    int pmtudisc = IP_PMTUDISC_PROBE;
+    if (setsockopt(t.socket, IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc, sizeof(pmtudisc)) < 0) {
+        perror("setsockopt IP_MTU_DISCOVER");
         return;
     }
 
-    // Get the size of the file
-    infile.seekg(0, std::ios::end);
-    size_t total_size = infile.tellg();
-    infile.seekg(0, std::ios::beg);
+    size_t hi = route_datagram_limit(t.socket);
+    if (probe_size(t, hi)) {
+        t.datagram_size = hi;
+    } else {
+        size_t lo = MIN_DATAGRAM_SIZE;
+        while (hi - lo > PROBE_PRECISION) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (probe_size(t, mid)) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        t.datagram_size = lo;
+    }
+    t.log() << "Datagram size: " << t.datagram_size << " bytes" << std::endl;
+}
 
-    char buffer[BUFFER_SIZE];
-    size_t sent_bytes = 0;
+// 发送 [offset, offset + chunk) 这一个数据包。
+// mmap 模式下头部和映射中的数据由两个 iovec 拼成一个数据报，文件数据不经过用户态缓冲区；
+// 否则先从 ifstream 读到缓冲区。返回 -1 表示传输无法继续（读文件失败，或最小长度的数据报
+// 仍然 EMSGSIZE），0 表示 EMSGSIZE（路径 MTU 变小，已缩小数据报长度，调用方按新长度重发），
+// 1 表示已发出
+int send_chunk(Transfer& t, uint64_t offset, uint16_t chunk) {
+    ssize_t sent;
+    if (t.map) {
+        char header[HEADER_SIZE];
+        encode_header(header, t.conn_id, PKT_DATA, chunk, offset, t.total_size);
+        struct iovec iov[2] = {
+            {header, HEADER_SIZE},
+            {const_cast<char*>(t.map + offset), chunk},
+        };
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        sent = sendmsg(t.socket, &msg, 0);
+    } else {
+        if (t.infile.tellg() != static_cast<std::streamoff>(offset)) {
+            t.infile.clear();
+            t.infile.seekg(offset, std::ios::beg);
+        }
+        if (!t.infile.read(t.buffer.data() + HEADER_SIZE, chunk)) {
+            std::cerr << "Error reading file at offset " << offset << std::endl;
+            t.failed = true;
+            return -1;
+        }
+        encode_header(t.buffer.data(), t.conn_id, PKT_DATA, chunk, offset, t.total_size);
+        sent = send(t.socket, t.buffer.data(), HEADER_SIZE + chunk, 0);
+    }
+    if (sent < 0 && errno == EMSGSIZE) {
+        if (t.datagram_size <= MIN_DATAGRAM_SIZE) {
+            std::cerr << "Datagram of " << t.datagram_size << " bytes still too large for the path" << std::endl;
+            t.failed = true;
+            return -1;
+        }
+        t.datagram_size = std::max<size_t>(MIN_DATAGRAM_SIZE, std::min(route_datagram_limit(t.socket), t.datagram_size / 2));
+        return 0;
+    }
+    return 1;
+}
 
-    while (infile.read(buffer, BUFFER_SIZE)) {
-        size_t bytes_to_send = infile.gcount();
-        sendto(client_socket, buffer, bytes_to_send, 0, (const struct sockaddr *)&server_addr, sizeof(server_addr));
-        sent_bytes += bytes_to_send;
+// 逐个数据报发送 [offset, offset + length)，retransmit 为 true 时计入重传统计
+size_t send_range(Transfer& t, uint64_t offset, uint64_t length, bool retransmit) {
+    size_t packets = 0;
+    uint64_t end = offset + length;
+    while (offset < end) {
+        uint16_t chunk = static_cast<uint16_t>(std::min<uint64_t>(t.max_payload(), end - offset));
+        int rc = send_chunk(t, offset, chunk);
+        if (rc < 0) {
+            break;
+        }
+        if (rc == 0) {
+            continue;
+        }
+        if (retransmit) {
+            t.stats.add_retransmitted(chunk);
+        } else {
+            t.stats.add_sent(chunk);
+        }
+        offset += chunk;
+        ++packets;
+    }
+    return packets;
+}
 
-        // Update progress bar
-        double progress = static_cast<double>(sent_bytes) / total_size;
-        int bar_width = 50;
-        std::cout << "[";
-        int pos = bar_width * progress;
-        for (int i = 0; i < bar_width; ++i) {
-            if (i < pos) std::cout << "=";
-            else if (i == pos) std::cout << ">";
-            else std::cout << " ";
+// 只读映射整个源文件，并提示内核顺序预读
+bool map_source_file(Transfer& t, const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error opening file for reading: " << filename << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return false;
+    }
+    t.total_size = st.st_size;
+    if (t.total_size > 0) {
+        void* map = mmap(nullptr, t.total_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return false;
         }
-        std::cout << "] " << int(progress * 100.0) << " %\r";
-        std::cout.flush();
+        madvise(map, t.total_size, MADV_SEQUENTIAL);
+        t.map = static_cast<const char*>(map);
     }
+    close(fd); // 映射建立后不再需要文件描述符
+    return true;
+}
 
-    // Send remaining bytes
-    size_t remaining_bytes = infile.gcount();
-    if (remaining_bytes > 0) {
-        sendto(client_socket, buffer, remaining_bytes, 0, (const struct sockaddr *)&server_addr, sizeof(server_addr));
-        sent_bytes += remaining_bytes;
+// 发送 FIN 并等待服务端回复，收到 NACK 时重传缺失区间，直到收到 ACK
+bool finish_transfer(Transfer& t) {
+    int timeouts = 0;
+    std::vector<char> reply(MAX_DATAGRAM_SIZE);
+    while (timeouts < MAX_FIN_RETRIES) {
+        encode_header(t.buffer.data(), t.conn_id, PKT_FIN, 0, 0, t.total_size);
+        send(t.socket, t.buffer.data(), HEADER_SIZE, 0);
+
+        struct pollfd pfd = {t.socket, POLLIN, 0};
+        if (poll(&pfd, 1, FIN_TIMEOUT_MS) <= 0) {
+            ++timeouts;
+            continue;
+        }
 
-        // Update progress bar for remaining bytes
-        double progress = static_cast<double>(sent_bytes) / total_size;
-        int bar_width = 50;
-        std::cout << "[";
-        int pos = bar_width * progress;
-        for (int i = 0; i < bar_width; ++i) {
-            if (i < pos) std::cout << "=";
-            else if (i == pos) std::cout << ">";
-            else std::cout << " ";
+        ssize_t n = recv(t.socket, reply.data(), reply.size(), 0);
+        PacketHeader h;
+        if (n <= 0 || !decode_header(reply.data(), n, h) || h.conn_id != t.conn_id) {
+            continue;
+        }
+        if (h.type == PKT_ACK) {
+            return true;
+        }
+        if (h.type == PKT_NACK) {
+            timeouts = 0;
+            const MissingRange* missing = reinterpret_cast<const MissingRange*>(reply.data() + HEADER_SIZE);
+            size_t count = h.payload_len / sizeof(MissingRange);
+            for (size_t i = 0; i < count; ++i) {
+                MissingRange r;
+                std::memcpy(&r, &missing[i], sizeof(r));
+                uint64_t offset = be64toh(r.offset), length = be64toh(r.length);
+                if (offset > t.total_size || length > t.total_size - offset) {
+                    continue;
+                }
+                t.stats.add_lost(length);
+                send_range(t, offset, length, true);
+                if (t.failed) {
+                    return false;
+                }
+            }
         }
-        std::cout << "] " << int(progress * 100.0) << " %\n";
-        std::cout.flush();
     }
+    std::cerr << "Server did not acknowledge the transfer" << std::endl;
+    return false;
+}
+
+void send_file_with_progress(const std::string& filename, int client_socket, bool use_mmap, bool json) {
+    Transfer t;
+    t.socket = client_socket;
+    t.json = json;
+    if (use_mmap) {
+        if (!map_source_file(t, filename)) {
+            return;
+        }
+    } else {
+        t.infile.open(filename, std::ios::binary);
+        if (!t.infile) {
+            std::cerr << "Error opening file for reading: " << filename << std::endl;
+            return;
+        }
+
+        // Get the size of the file
+        t.infile.seekg(0, std::ios::end);
+        t.total_size = t.infile.tellg();
+        t.infile.seekg(0, std::ios::beg);
+    }
+
+    // 随机连接 ID，服务端据此区分同时上传的多个客户端
+    std::random_device rd;
+    t.conn_id = rd();
+    t.log() << "Connection ID: " << t.conn_id << std::endl;
+
+    t.buffer.resize(MAX_DATAGRAM_SIZE);
+    discover_datagram_size(t);
+
+    // 发送循环只更新计数器，进度由 reporter 线程以 10Hz 刷新
+    t.stats.total_size = t.total_size;
+    ProgressReporter reporter(t.stats, t.json);
+    reporter.start();
 
-    infile.close();
+    send_range(t, 0, t.total_size, false);
+    bool acknowledged = !t.failed && finish_transfer(t);
+    t.stats.done.store(acknowledged, std::memory_order_relaxed);
+    reporter.stop();
+
+    if (acknowledged) {
+        t.log() << "Transfer acknowledged by server" << std::endl;
+    }
+
+    if (t.map) {
+        munmap(const_cast<char*>(t.map), t.total_size);
+    }
+    t.infile.close();
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     int client_socket;
     struct sockaddr_in server_addr;
 
@@ -87,18 +307,37 @@ int main() {
     // Filling server information
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = inet_addr(SERVER_IP); // 使用 inet_addr 转换 IP 地址
+    // 参数：[--mmap] [--json] [file] [server_ip]
+    bool use_mmap = false, json = false;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--mmap") == 0) {
+            use_mmap = true;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+    server_addr.sin_addr.s_addr = inet_addr(args.size() > 1 ? args[1].c_str() : SERVER_IP); // 使用 inet_addr 转换 IP 地址
+
+    // 连接后的 UDP 套接字只接收来自服务端的数据报，ACK/NACK 可以直接 recv，也能查询路由 MTU
+    if (connect(client_socket, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("connect failed");
+        close(client_socket);
+        exit(EXIT_FAILURE);
+    }
 
     std::string filename;
-    std::cout << "Enter the file to send: ";
-    std::cin >> filename;
+    if (!args.empty()) {
+        filename = args[0];
+    } else {
+        std::cout << "Enter the file to send: ";
+        std::cin >> filename;
+    }
 
-    send_file_with_progress(filename, client_socket, server_addr);
+    send_file_with_progress(filename, client_socket, use_mmap, json);
 
     close(client_socket);
     return 0;
 }
-
-
-
-
@@ -0,0 +1,73 @@
+#ifndef UDP_PROTOCOL_H
+#define UDP_PROTOCOL_H
+
+#include <cstdint>
+#include <cstring>
+#include <endian.h>
+
+#define PORT 8080
+#define IP_UDP_OVERHEAD 28        // IPv4 头部 20 字节 + UDP 头部 8 字节
+#define DEFAULT_DATAGRAM_SIZE 1472 // 以太网 MTU 1500 - 28，探测失败时的回退值
+#define MIN_DATAGRAM_SIZE 548      // IPv4 最小重组长度 576 - 28，任何路径都能通过
+#define MAX_DATAGRAM_SIZE 65507    // IPv4 上 UDP 负载的上限，也是接收缓冲区大小
+
+// 数据报类型
+enum PacketType : uint8_t {
+    PKT_DATA = 1, // 文件数据，payload 写到 offset 处
+    PKT_FIN  = 2, // 发送端已发完，请求服务端确认或报告缺失区间
+    PKT_ACK  = 3, // 服务端：会话已完整接收
+    PKT_NACK = 4, // 服务端：payload 为缺失区间列表
+    PKT_PROBE = 5,     // 客户端：PMTU 探测包，按待测长度填充
+    PKT_PROBE_ACK = 6, // 服务端：探测包已到达，offset 为收到的数据报长度
+};
+
+// 每个数据报开头的固定头部，所有字段使用网络字节序
+// 服务端按 conn_id 区分会话，按 offset 定位数据，因此乱序和多客户端互不干扰
+struct __attribute__((packed)) PacketHeader {
+    uint32_t conn_id;     // 客户端随机生成的连接 ID
+    uint8_t  type;        // PacketType
+    uint8_t  reserved;
+    uint16_t payload_len; // 头部之后的字节数
+    uint64_t offset;      // 数据在文件中的偏移
+    uint64_t total_size;  // 文件总大小，每个包都带上，服务端收到任意一个包即可建立会话
+};
+
+#define HEADER_SIZE sizeof(PacketHeader)
+
+// NACK 的 payload 由若干个缺失区间组成
+struct __attribute__((packed)) MissingRange {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// 指定数据报长度下一个 NACK 最多能携带的区间数
+inline size_t max_nack_ranges(size_t datagram_size) {
+    return (datagram_size - HEADER_SIZE) / sizeof(MissingRange);
+}
+
+inline void encode_header(char* buf, uint32_t conn_id, uint8_t type, uint16_t payload_len,
+                          uint64_t offset, uint64_t total_size) {
+    PacketHeader h;
+    h.conn_id = htobe32(conn_id);
+    h.type = type;
+    h.reserved = 0;
+    h.payload_len = htobe16(payload_len);
+    h.offset = htobe64(offset);
+    h.total_size = htobe64(total_size);
+    std::memcpy(buf, &h, HEADER_SIZE);
+}
+
+// 解析头部，长度不合法时返回 false
+inline bool decode_header(const char* buf, size_t len, PacketHeader& h) {
+    if (len < HEADER_SIZE) {
+        return false;
+    }
+    std::memcpy(&h, buf, HEADER_SIZE);
+    h.conn_id = be32toh(h.conn_id);
+    h.payload_len = be16toh(h.payload_len);
+    h.offset = be64toh(h.offset);
+    h.total_size = be64toh(h.total_size);
+    return HEADER_SIZE + h.payload_len <= len;
+}
+
+#endif // UDP_PROTOCOL_H
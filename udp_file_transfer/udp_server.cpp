@@ -1,85 +1,258 @@
 #include <iostream>
-#include <fstream>
 #include <thread>
 #include <vector>
 #include <mutex>
-#include <queue>
+#include <map>
+#include <memory>
+#include <string>
+#include <chrono>
+#include <unordered_map>
 #include <cstring>
+#include <cerrno>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
-#define PORT 8080
-#define BUFFER_SIZE 1472 // MTU size minus IP and UDP headers (1500 - 20 - 8 = 1472)
+#include "udp_protocol.h"
+#include "packet_ring.h"
 
-std::mutex mtx;
-std::queue<std::pair<char*, int>> packet_queue;
+#define SESSION_SHARDS 64
+#define SESSION_IDLE_TIMEOUT 30 // 秒，超时未收到任何包的会话被回收
+#define SESSION_LINGER 10       // 秒，完成后保留会话以便重复的 FIN 仍能得到 ACK
 
-void receive_packets(int server_socket, struct sockaddr_in client_addr) {
-    char buffer[BUFFER_SIZE];
-    socklen_t addr_len = sizeof(client_addr);
-    while (true) {
-        ssize_t bytes_received = recvfrom(server_socket, buffer, BUFFER_SIZE, 0, (struct sockaddr*)&client_addr, &addr_len);
-        if (bytes_received > 0) {
-            char* data = new char[bytes_received];
-            std::memcpy(data, buffer, bytes_received);
-            {
-                std::lock_guard<std::mutex> lock(mtx);
-                packet_queue.push({data, static_cast<int>(bytes_received)});
-            }
+// 单个上传会话的重组状态
+struct Session {
+    std::mutex mtx;
+    uint32_t conn_id = 0;
+    uint64_t total_size = 0;
+    int fd = -1;
+    char* map = nullptr; // mmap 模式下输出文件的可写映射
+    std::string filename;
+    std::map<uint64_t, uint64_t> ranges; // 已收到的区间 [start, end)，相邻区间会被合并
+    uint64_t received = 0;               // 已收到的不重复字节数
+    size_t datagram_size = MIN_DATAGRAM_SIZE; // 该会话路径上见过的最大数据报，NACK 不会超过它
+    bool done = false;
+    std::chrono::steady_clock::time_point last_active;
+};
+
+// 会话表按 conn_id 分片，不同接收线程很少争用同一把锁
+struct SessionShard {
+    std::mutex mtx;
+    std::unordered_map<uint32_t, std::shared_ptr<Session>> sessions;
+};
+
+SessionShard shards[SESSION_SHARDS];
+bool use_mmap = false; // --mmap：输出文件先 ftruncate 再映射，数据按 offset 直接拷进映射
+std::string ring_ifname; // --ring <ifname>：在该接口上用 PACKET_MMAP 环收包，普通套接字只用来发送回复
+
+// 把 [start, end) 并入区间表，返回新覆盖的字节数
+uint64_t add_range(std::map<uint64_t, uint64_t>& ranges, uint64_t start, uint64_t end) {
+    if (start >= end) {
+        return 0;
+    }
+    uint64_t covered = 0;
+    auto it = ranges.upper_bound(start);
+    if (it != ranges.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second >= start) {
+            it = prev;
         }
     }
+    uint64_t new_start = start, new_end = end;
+    while (it != ranges.end() && it->first <= end) {
+        new_start = std::min(new_start, it->first);
+        new_end = std::max(new_end, it->second);
+        covered += it->second - it->first;
+        it = ranges.erase(it);
+    }
+    ranges[new_start] = new_end;
+    return (new_end - new_start) - covered;
 }
 
-void save_file(const std::string& filename) {
-    std::ofstream outfile(filename, std::ios::binary);
-    if (!outfile) {
-        std::cerr << "Error opening file for writing: " << filename << std::endl;
-        return;
+void close_session_file(Session& session) {
+    if (session.map) {
+        munmap(session.map, session.total_size);
+        session.map = nullptr;
     }
+    if (session.fd >= 0) {
+        close(session.fd);
+        session.fd = -1;
+    }
+}
 
-    std::vector<char*> packets;
-    std::vector<int> sizes;
+std::shared_ptr<Session> find_or_create_session(const PacketHeader& h) {
+    SessionShard& shard = shards[h.conn_id % SESSION_SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto it = shard.sessions.find(h.conn_id);
+    if (it != shard.sessions.end()) {
+        return it->second;
+    }
 
-    while (true) {
-        {
-            std::lock_guard<std::mutex> lock(mtx);
-            if (!packet_queue.empty()) {
-                packets.push_back(packet_queue.front().first);
-                sizes.push_back(packet_queue.front().second);
-                packet_queue.pop();
-            } else {
-                continue;
-            }
+    auto session = std::make_shared<Session>();
+    session->conn_id = h.conn_id;
+    session->total_size = h.total_size;
+    session->filename = "received_" + std::to_string(h.conn_id) + ".bin";
+    // 不使用 O_TRUNC：会话回收后迟到的重复包重新建会话时，不会截断已完成的文件
+    // 映射要求以读写方式打开
+    session->fd = open(session->filename.c_str(), (use_mmap ? O_RDWR : O_WRONLY) | O_CREAT, 0644);
+    if (session->fd < 0 || ftruncate(session->fd, h.total_size) < 0) {
+        std::cerr << "Error opening file for writing: " << session->filename << std::endl;
+        close_session_file(*session);
+        return nullptr;
+    }
+    if (use_mmap && h.total_size > 0) {
+        void* map = mmap(nullptr, h.total_size, PROT_READ | PROT_WRITE, MAP_SHARED, session->fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            close_session_file(*session);
+            return nullptr;
         }
+        session->map = static_cast<char*>(map);
+    }
+    session->last_active = std::chrono::steady_clock::now();
+    shard.sessions[h.conn_id] = session;
+    std::cout << "Session " << h.conn_id << " started, " << h.total_size << " bytes -> "
+              << session->filename << std::endl;
+    return session;
+}
 
-        outfile.write(packets.back(), sizes.back());
-        delete[] packets.back();
-        packets.pop_back();
-        sizes.pop_back();
+// 会话完整时回复 ACK，否则回复缺失区间列表
+void reply_status(int server_socket, Session& session, const struct sockaddr_in& client_addr) {
+    char buffer[MAX_DATAGRAM_SIZE];
+    if (session.done) {
+        encode_header(buffer, session.conn_id, PKT_ACK, 0, 0, session.total_size);
+        sendto(server_socket, buffer, HEADER_SIZE, 0, (const struct sockaddr*)&client_addr, sizeof(client_addr));
+        return;
+    }
 
-        if (sizes.back() < BUFFER_SIZE) {
+    MissingRange* missing = reinterpret_cast<MissingRange*>(buffer + HEADER_SIZE);
+    size_t max_ranges = max_nack_ranges(session.datagram_size);
+    size_t count = 0;
+    uint64_t cursor = 0;
+    for (auto it = session.ranges.begin(); count < max_ranges && cursor < session.total_size; ) {
+        uint64_t gap_end = (it == session.ranges.end()) ? session.total_size : it->first;
+        if (gap_end > cursor) {
+            MissingRange r;
+            r.offset = htobe64(cursor);
+            r.length = htobe64(gap_end - cursor);
+            std::memcpy(&missing[count++], &r, sizeof(r));
+        }
+        if (it == session.ranges.end()) {
             break;
         }
+        cursor = it->second;
+        ++it;
     }
 
-    outfile.close();
+    uint16_t payload_len = static_cast<uint16_t>(count * sizeof(MissingRange));
+    encode_header(buffer, session.conn_id, PKT_NACK, payload_len, 0, session.total_size);
+    sendto(server_socket, buffer, HEADER_SIZE + payload_len, 0, (const struct sockaddr*)&client_addr, sizeof(client_addr));
 }
 
-int main() {
-    int server_socket;
-    struct sockaddr_in server_addr, client_addr;
+// 回应 PMTU 探测：探测包能到达说明该长度的数据报可以无分片通过路径
+void reply_probe(int server_socket, const PacketHeader& h, size_t len, const struct sockaddr_in& client_addr) {
+    char buffer[HEADER_SIZE];
+    encode_header(buffer, h.conn_id, PKT_PROBE_ACK, 0, len, 0);
+    sendto(server_socket, buffer, HEADER_SIZE, 0, (const struct sockaddr*)&client_addr, sizeof(client_addr));
+}
+
+void handle_packet(int server_socket, const char* buffer, size_t len, const struct sockaddr_in& client_addr) {
+    PacketHeader h;
+    if (!decode_header(buffer, len, h)) {
+        return; // 非本协议的数据报直接丢弃
+    }
+    if (h.type == PKT_PROBE) {
+        reply_probe(server_socket, h, len, client_addr);
+        return;
+    }
+    if (h.type != PKT_DATA && h.type != PKT_FIN) {
+        return;
+    }
+
+    std::shared_ptr<Session> session = find_or_create_session(h);
+    if (!session) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(session->mtx);
+    session->last_active = std::chrono::steady_clock::now();
+    session->datagram_size = std::max(session->datagram_size, std::min<size_t>(len, MAX_DATAGRAM_SIZE));
+
+    if (h.type == PKT_DATA && !session->done) {
+        if (h.offset > session->total_size || h.payload_len > session->total_size - h.offset) {
+            return; // 越界的数据不写入
+        }
+        if (session->map) {
+            std::memcpy(session->map + h.offset, buffer + HEADER_SIZE, h.payload_len);
+        } else if (pwrite(session->fd, buffer + HEADER_SIZE, h.payload_len, h.offset) != h.payload_len) {
+            perror("pwrite");
+            return;
+        }
+        session->received += add_range(session->ranges, h.offset, h.offset + h.payload_len);
+        if (session->received == session->total_size) {
+            session->done = true;
+            close_session_file(*session);
+            std::cout << "Session " << session->conn_id << " complete: " << session->filename << std::endl;
+        }
+    } else if (h.type == PKT_FIN) {
+        if (!session->done && session->received == session->total_size) {
+            session->done = true; // 空文件只会收到 FIN
+            close_session_file(*session);
+            std::cout << "Session " << session->conn_id << " complete: " << session->filename << std::endl;
+        }
+        reply_status(server_socket, *session, client_addr);
+    }
+}
 
-    // Creating socket file descriptor
+// 回收本线程负责的分片中空闲或已完成的会话
+void reap_sessions(int thread_index, int num_threads) {
+    auto now = std::chrono::steady_clock::now();
+    for (int i = thread_index; i < SESSION_SHARDS; i += num_threads) {
+        std::lock_guard<std::mutex> lock(shards[i].mtx);
+        for (auto it = shards[i].sessions.begin(); it != shards[i].sessions.end(); ) {
+            std::shared_ptr<Session> session = it->second;
+            std::lock_guard<std::mutex> session_lock(session->mtx);
+            auto idle = std::chrono::duration_cast<std::chrono::seconds>(now - session->last_active).count();
+            if ((session->done && idle >= SESSION_LINGER) || idle >= SESSION_IDLE_TIMEOUT) {
+                if (!session->done) {
+                    std::cerr << "Session " << session->conn_id << " timed out with "
+                              << session->received << "/" << session->total_size << " bytes" << std::endl;
+                }
+                close_session_file(*session);
+                it = shards[i].sessions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+int create_server_socket() {
+    int server_socket;
     if ((server_socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("socket creation failed");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    memset(&client_addr, 0, sizeof(client_addr));
+    // 每个接收线程各绑定一个 SO_REUSEPORT 套接字，由内核按四元组把数据报分散到各线程
+    int opt = 1;
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        close(server_socket);
+        return -1;
+    }
+
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(server_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 
-    // Filling server information
+    // 设置接收超时，空闲时也能定期回收会话
+    struct timeval tv = {1, 0};
+    setsockopt(server_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET; // IPv4
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(PORT);
@@ -88,20 +261,103 @@ int main() {
     if (bind(server_socket, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("bind failed");
         close(server_socket);
-        exit(EXIT_FAILURE);
+        return -1;
     }
+    return server_socket;
+}
 
-    std::cout << "Server listening on port " << PORT << std::endl;
+// 让内核 UDP 套接字丢弃所有数据报：环模式下数据已从环里读取，不必再排进套接字接收队列
+void drop_socket_input(int server_socket) {
+    struct sock_filter code[] = {BPF_STMT(BPF_RET | BPF_K, 0)};
+    struct sock_fprog prog = {1, code};
+    if (setsockopt(server_socket, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        perror("setsockopt SO_ATTACH_FILTER");
+    }
+}
 
-    std::thread receiver(receive_packets, server_socket, client_addr);
-    receiver.detach();
+// 环模式的接收循环：数据报从共享内存环中批量取出，只有环空时才 poll
+void receive_from_ring(PacketRing& ring, int server_socket, int thread_index, int num_threads) {
+    auto last_reap = std::chrono::steady_clock::now();
+    while (true) {
+        ring.poll_ring(1000, [server_socket](const char* data, size_t len, const struct sockaddr_in& client_addr) {
+            handle_packet(server_socket, data, len, client_addr);
+        });
 
-    save_file("received_file.bin");
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_reap >= std::chrono::seconds(1)) {
+            reap_sessions(thread_index, num_threads);
+            last_reap = now;
+        }
+    }
+}
 
-    close(server_socket);
-    return 0;
+void receive_packets(int server_socket, int thread_index, int num_threads) {
+    if (!ring_ifname.empty()) {
+        PacketRing ring;
+        if (ring.open_ring(ring_ifname, PORT, getpid())) {
+            drop_socket_input(server_socket);
+            receive_from_ring(ring, server_socket, thread_index, num_threads);
+            return;
+        }
+        std::cerr << "Thread " << thread_index << ": packet ring unavailable on " << ring_ifname
+                  << ", falling back to socket receive" << std::endl;
+    }
+
+    std::vector<char> buffer(MAX_DATAGRAM_SIZE);
+    auto last_reap = std::chrono::steady_clock::now();
+    while (true) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        ssize_t bytes_received = recvfrom(server_socket, buffer.data(), buffer.size(), 0, (struct sockaddr*)&client_addr, &addr_len);
+        if (bytes_received > 0) {
+            handle_packet(server_socket, buffer.data(), bytes_received, client_addr);
+        } else if (bytes_received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("recvfrom");
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_reap >= std::chrono::seconds(1)) {
+            reap_sessions(thread_index, num_threads);
+            last_reap = now;
+        }
+    }
 }
 
+int main(int argc, char* argv[]) {
+    int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--mmap") == 0) {
+            use_mmap = true;
+        } else if (strcmp(argv[i], "--ring") == 0 && i + 1 < argc) {
+            ring_ifname = argv[++i];
+        } else {
+            num_threads = std::max(1, atoi(argv[i]));
+        }
+    }
+
+    std::vector<int> sockets;
+    for (int i = 0; i < num_threads; ++i) {
+        int server_socket = create_server_socket();
+        if (server_socket < 0) {
+            exit(EXIT_FAILURE);
+        }
+        sockets.push_back(server_socket);
+    }
 
+    std::cout << "Server listening on port " << PORT << " with " << num_threads << " receive threads"
+              << (use_mmap ? " (mmap output)" : "")
+              << (ring_ifname.empty() ? "" : " (packet ring on " + ring_ifname + ")") << std::endl;
 
+    std::vector<std::thread> receivers;
+    for (int i = 0; i < num_threads; ++i) {
+        receivers.emplace_back(receive_packets, sockets[i], i, num_threads);
+    }
+    for (auto& receiver : receivers) {
+        receiver.join();
+    }
 
+    for (int server_socket : sockets) {
+        close(server_socket);
+    }
+    return 0;
+}
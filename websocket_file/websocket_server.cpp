@@ -13,14 +13,64 @@
 #include <unordered_map>
 #include <openssl/sha.h>
 #include <iomanip>
+#include <csignal>
 #include <sstream>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/buffer.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <poll.h>
+#include <memory>
+#include <string>
+#include <chrono>
+
+#include "../common/metrics.h"
 
 #define MAX_EVENTS 1024
 #define BUFFER_SIZE 4096
 #define THREAD_POOL_SIZE 4
+#define IO_TIMEOUT_MS 5000 // 握手必须在此时间内完成; 也是 TLS 写入等待套接字就绪的最长时间
+
+// 一个 wss:// 连接的 TLS 状态. SSL 对象不是线程安全的, 多个工作线程会同时读写
+// (接收一个客户端的消息, 向所有客户端广播), 所以每次 SSL_read/SSL_write 都持有 mtx
+struct TlsClient {
+    SSL* ssl = nullptr;
+    std::mutex mtx;
+
+    ~TlsClient() {
+        SSL_free(ssl);
+    }
+};
+
+struct ClientInfo {
+    sockaddr_in addr;
+    std::shared_ptr<TlsClient> tls; // ws:// 连接为空
+};
+
+// 还在 TLS 或升级握手中的连接, 只由主线程访问. 套接字已注册到 epoll, 每个就绪事件推进一步,
+// 主线程从不等待单个客户端
+struct PendingClient {
+    sockaddr_in addr;
+    std::shared_ptr<TlsClient> tls;
+    bool tls_done = false;
+    std::string request; // 已收到的升级请求
+    std::chrono::steady_clock::time_point deadline;
+};
+
+// 指定证书后所有连接都走 TLS (wss://)
+SSL_CTX* ssl_ctx = nullptr;
+
+// 运行指标, 由 METRICS_PORT 端口以 Prometheus 文本格式导出
+Gauge& clients_open = metrics().gauge("websocket_clients_open", "WebSocket clients currently connected.");
+Counter& handshakes_failed = metrics().counter("websocket_handshakes_failed_total", "Connections closed during the TLS or upgrade handshake.");
+Counter& tls_resumed = metrics().counter("websocket_tls_handshakes_total", "Completed TLS handshakes.", "resumed=\"true\"");
+Counter& tls_full = metrics().counter("websocket_tls_handshakes_total", "Completed TLS handshakes.", "resumed=\"false\"");
+Counter& messages_received = metrics().counter("websocket_messages_received_total", "Messages received from clients.");
+Counter& frames_sent = metrics().counter("websocket_frames_sent_total", "Broadcast frames sent to clients.");
+Counter& received_bytes = metrics().counter("websocket_received_bytes_total", "Bytes read from clients, after TLS decryption.");
+Counter& sent_bytes = metrics().counter("websocket_sent_bytes_total", "Bytes of frames sent to clients.");
+Histogram& broadcast_duration = metrics().histogram("websocket_broadcast_duration_seconds", "Time to broadcast one message to every client.");
 
 // 设置套接字为非阻塞模式
 int set_nonblocking(int fd) {
@@ -37,6 +87,103 @@ int set_nonblocking(int fd) {
     return 0;
 }
 
+// 等待套接字可读或可写, 超时返回 false
+bool wait_socket(int fd, short events) {
+    pollfd pfd{fd, events, 0};
+    return poll(&pfd, 1, IO_TIMEOUT_MS) > 0;
+}
+
+// 创建 TLS 上下文: 加载证书和私钥, 开启会话复用, 并请求 OpenSSL 在握手后把记录加解密
+// 交给内核 (kTLS, 需要 tls 内核模块, 否则仍在用户态加密)
+SSL_CTX* create_ssl_ctx(const char* cert_file, const char* key_file) {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        ERR_print_errors_fp(stderr);
+        return nullptr;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    static const unsigned char session_context[] = "websocket_server";
+    SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+    return ctx;
+}
+
+// 为新连接创建 TLS 状态, 握手由 tls_continue_accept 推进
+std::shared_ptr<TlsClient> tls_create(int fd) {
+    auto tls = std::make_shared<TlsClient>();
+    tls->ssl = SSL_new(ssl_ctx);
+    if (!tls->ssl || SSL_set_fd(tls->ssl, fd) != 1) {
+        return nullptr;
+    }
+    return tls;
+}
+
+// 在非阻塞套接字上推进 TLS 握手: 返回 1 表示完成, 0 表示等待下一次就绪事件, -1 表示失败
+int tls_continue_accept(TlsClient* tls) {
+    int ret = SSL_accept(tls->ssl);
+    if (ret != 1) {
+        int err = SSL_get_error(tls->ssl, ret);
+        ERR_clear_error();
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+    }
+    (SSL_session_reused(tls->ssl) ? tls_resumed : tls_full).inc();
+    std::cout << "TLS " << SSL_get_version(tls->ssl) << (SSL_session_reused(tls->ssl) ? " (resumed)" : "")
+              << ", kTLS send " << (BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) ? "on" : "off")
+              << ", receive " << (BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)) ? "on" : "off") << std::endl;
+    return 1;
+}
+
+// 接收数据, 与 recv 相同的返回值; TLS 记录还没收全时返回 -1 并置 errno 为 EAGAIN
+ssize_t client_recv(int fd, TlsClient* tls, char* buffer, size_t size) {
+    if (!tls) {
+        return recv(fd, buffer, size, 0);
+    }
+    std::lock_guard<std::mutex> guard(tls->mtx);
+    int ret = SSL_read(tls->ssl, buffer, static_cast<int>(size));
+    if (ret > 0) {
+        return ret;
+    }
+    int err = SSL_get_error(tls->ssl, ret);
+    ERR_clear_error();
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+}
+
+// 发送整段数据. kTLS 开启时 SSL_write 直接交给内核加密
+void client_send(int fd, TlsClient* tls, const char* data, size_t size) {
+    if (!tls) {
+        send(fd, data, size, MSG_NOSIGNAL);
+        return;
+    }
+    std::lock_guard<std::mutex> guard(tls->mtx);
+    while (size > 0) {
+        int ret = SSL_write(tls->ssl, data, static_cast<int>(size));
+        if (ret > 0) {
+            data += ret;
+            size -= ret;
+            continue;
+        }
+        // 重试必须使用相同的参数
+        int err = SSL_get_error(tls->ssl, ret);
+        if ((err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) ||
+            !wait_socket(fd, err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT)) {
+            ERR_clear_error();
+            return;
+        }
+    }
+}
+
 // 计算 Sec-WebSocket-Accept 值
 std::string compute_accept_key(const std::string& key) {
     const std::string magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
@@ -65,16 +212,8 @@ std::string compute_accept_key(const std::string& key) {
     return ret;
 }
 
-// 处理 HTTP 握手请求
-bool handle_handshake(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received <= 0) {
-        return false;
-    }
-    buffer[bytes_received] = '\0';
-
-    std::string request(buffer);
+// 处理完整的 HTTP 升级请求
+bool handle_handshake(int client_socket, TlsClient* tls, const std::string& request) {
     size_t upgrade_pos = request.find("Upgrade: websocket");
     size_t connection_pos = request.find("Connection: Upgrade");
     size_t key_pos = request.find("Sec-WebSocket-Key:");
@@ -98,10 +237,64 @@ bool handle_handshake(int client_socket) {
         "Connection: Upgrade\r\n"
         "Sec-WebSocket-Accept: " + accept_key + "\r\n\r\n";
 
-    send(client_socket, response.c_str(), response.size(), 0);
+    client_send(client_socket, tls, response.c_str(), response.size());
     return true;
 }
 
+// 推进一个握手中的连接, 只做非阻塞的读写: 返回 1 表示升级完成, 0 表示等待下一次就绪事件,
+// -1 表示失败
+int advance_handshake(int fd, PendingClient& pending) {
+    if (pending.tls && !pending.tls_done) {
+        int ret = tls_continue_accept(pending.tls.get());
+        if (ret <= 0) {
+            return ret;
+        }
+        pending.tls_done = true;
+    }
+    char buffer[BUFFER_SIZE];
+    while (pending.request.find("\r\n\r\n") == std::string::npos) {
+        if (pending.request.size() >= BUFFER_SIZE) {
+            return -1;
+        }
+        ssize_t bytes_received = client_recv(fd, pending.tls.get(), buffer, sizeof(buffer));
+        if (bytes_received < 0 && errno == EAGAIN) {
+            return 0;
+        }
+        if (bytes_received <= 0) {
+            return -1;
+        }
+        pending.request.append(buffer, bytes_received);
+    }
+    return handle_handshake(fd, pending.tls.get(), pending.request) ? 1 : -1;
+}
+
+// 缓冲区开头一个完整帧的长度, 帧还没收全时返回 0
+size_t frame_size(const char* data, size_t length) {
+    if (length < 2) {
+        return 0;
+    }
+    uint64_t payload_len = data[1] & 0x7F;
+    size_t header_len = 2;
+    if (payload_len == 126) {
+        header_len = 4;
+    } else if (payload_len == 127) {
+        header_len = 10;
+    }
+    if (length < header_len) {
+        return 0;
+    }
+    if (payload_len >= 126) {
+        payload_len = 0;
+        for (size_t i = 2; i < header_len; ++i) {
+            payload_len = payload_len << 8 | static_cast<uint8_t>(data[i]);
+        }
+    }
+    if (data[1] & 0x80) {
+        header_len += 4;
+    }
+    return payload_len <= length - std::min(length, header_len) ? header_len + payload_len : 0;
+}
+
 // 解析 WebSocket 数据帧
 std::pair<bool, std::string> parse_frame(char* data, ssize_t length) {
     bool fin = (data[0] & 0x80) != 0;
@@ -111,17 +304,13 @@ std::pair<bool, std::string> parse_frame(char* data, ssize_t length) {
 
     size_t header_len = 2;
     if (payload_len == 126) {
-        payload_len = (static_cast<uint16_t>(data[2]) << 8) | static_cast<uint16_t>(data[3]);
+        payload_len = (static_cast<uint16_t>(static_cast<uint8_t>(data[2])) << 8) | static_cast<uint8_t>(data[3]);
         header_len = 4;
     } else if (payload_len == 127) {
-        payload_len = ((static_cast<uint64_t>(data[2]) << 56) |
-                       (static_cast<uint64_t>(data[3]) << 48) |
-                       (static_cast<uint64_t>(data[4]) << 40) |
-                       (static_cast<uint64_t>(data[5]) << 32) |
-                       (static_cast<uint64_t>(data[6]) << 24) |
-                       (static_cast<uint64_t>(data[7]) << 16) |
-                       (static_cast<uint64_t>(data[8]) << 8) |
-                       static_cast<uint64_t>(data[9]));
+        payload_len = 0;
+        for (size_t i = 2; i < 10; ++i) {
+            payload_len = payload_len << 8 | static_cast<uint8_t>(data[i]);
+        }
         header_len = 10;
     }
 
@@ -163,41 +352,102 @@ std::string build_frame(const std::string& message) {
     return frame;
 }
 
-// 工作线程函数
+// 广播消息给所有客户端. 先在锁内取出连接列表, TLS 状态由 shared_ptr 保活
+void broadcast(const std::string& message, std::mutex& queue_mutex, std::unordered_map<int, ClientInfo>& clients) {
+    uint64_t start = metrics_now_ns();
+    std::string frame = build_frame("Broadcast: " + message);
+    std::vector<std::pair<int, std::shared_ptr<TlsClient>>> targets;
+    {
+        std::lock_guard<std::mutex> guard(queue_mutex);
+        for (const auto& [fd, info] : clients) {
+            targets.emplace_back(fd, info.tls);
+        }
+    }
+    for (const auto& [fd, target] : targets) {
+        client_send(fd, target.get(), frame.c_str(), frame.size());
+    }
+    frames_sent.inc(targets.size());
+    sent_bytes.inc(targets.size() * frame.size());
+    broadcast_duration.record(metrics_now_ns() - start);
+}
+
+// 工作线程函数. 客户端以 EPOLLONESHOT 注册, 同一时刻只有一个工作线程处理它; 一直读到
+// EAGAIN 再重新挂上: 一次边沿可能带来多个帧, 而 TLS 下每次 SSL_read 只返回一个记录
 void worker_thread(int epoll_fd, std::queue<int>& work_queue, std::mutex& queue_mutex,
-                   std::condition_variable& cv, std::unordered_map<int, sockaddr_in>& clients) {
+                   std::condition_variable& cv, std::unordered_map<int, ClientInfo>& clients) {
     while (true) {
         std::unique_lock<std::mutex> lock(queue_mutex);
         cv.wait(lock, [&work_queue] { return !work_queue.empty(); });
         int client_socket = work_queue.front();
         work_queue.pop();
+        auto it = clients.find(client_socket);
+        std::shared_ptr<TlsClient> tls = it != clients.end() ? it->second.tls : nullptr;
         lock.unlock();
 
         char buffer[BUFFER_SIZE];
-        ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_received <= 0) {
-            close(client_socket);
-            std::lock_guard<std::mutex> guard(queue_mutex);
-            clients.erase(client_socket);
-            continue;
+        bool alive = true;
+        while (true) {
+            ssize_t bytes_received = client_recv(client_socket, tls.get(), buffer, sizeof(buffer));
+            if (bytes_received < 0 && errno == EAGAIN) {
+                break; // 读完了, 或只收到半个 TLS 记录
+            }
+            if (bytes_received <= 0) {
+                std::lock_guard<std::mutex> guard(queue_mutex);
+                if (clients.erase(client_socket)) {
+                    clients_open.add(-1);
+                }
+                close(client_socket);
+                alive = false;
+                break;
+            }
+            received_bytes.inc(bytes_received);
+
+            // 不跨读取拼接帧, 超出缓冲区的帧和被截断的尾部会被丢弃
+            size_t offset = 0;
+            while (size_t size = frame_size(buffer + offset, bytes_received - offset)) {
+                auto [fin, message] = parse_frame(buffer + offset, size);
+                offset += size;
+                if (!fin) {
+                    continue; // 不支持分片消息
+                }
+                std::cout << "Received message from client " << client_socket << ": " << message << std::endl;
+                messages_received.inc();
+                broadcast(message, queue_mutex, clients);
+            }
         }
-
-        auto [fin, message] = parse_frame(buffer, bytes_received);
-        if (!fin) {
-            continue; // 不支持分片消息
+        if (alive) {
+            epoll_event event;
+            event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+            event.data.fd = client_socket;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_socket, &event);
         }
+    }
+}
 
-        std::cout << "Received message from client " << client_socket << ": " << message << std::endl;
-
-        // 广播消息给所有客户端
-        std::string frame = build_frame("Broadcast: " + message);
-        for (const auto& [fd, _] : clients) {
-            send(fd, frame.c_str(), frame.size(), MSG_NOSIGNAL);
+// 用法: websocket_server [--cert cert.pem --key key.pem]
+// 指定证书后提供 wss://. 本地测试可以用自签名证书:
+//   openssl req -x509 -newkey rsa:2048 -nodes -days 365 -subj /CN=localhost -keyout key.pem -out cert.pem
+int main(int argc, char* argv[]) {
+    const char* cert_file = nullptr;
+    const char* key_file = nullptr;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--cert") == 0) {
+            cert_file = argv[i + 1];
+        } else if (strcmp(argv[i], "--key") == 0) {
+            key_file = argv[i + 1];
         }
     }
-}
+    if (cert_file) {
+        ssl_ctx = create_ssl_ctx(cert_file, key_file ? key_file : cert_file);
+        if (!ssl_ctx) {
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN); // SSL_write 没有 MSG_NOSIGNAL
+    if (start_metrics_server(METRICS_PORT)) {
+        std::cout << "Metrics on port " << METRICS_PORT << std::endl;
+    }
 
-int main() {
     int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (server_socket == -1) {
         perror("socket");
@@ -222,7 +472,7 @@ int main() {
         return 1;
     }
 
-    std::cout << "Server listening on port 8080..." << std::endl;
+    std::cout << "Server listening on port 8080" << (ssl_ctx ? " (wss)" : "") << "..." << std::endl;
 
     int epoll_fd = epoll_create1(0);
     if (epoll_fd == -1) {
@@ -244,7 +494,8 @@ int main() {
     std::queue<int> work_queue;
     std::mutex queue_mutex;
     std::condition_variable cv;
-    std::unordered_map<int, sockaddr_in> clients;
+    std::unordered_map<int, ClientInfo> clients;
+    std::unordered_map<int, PendingClient> pending; // 只由主线程访问
 
     std::vector<std::thread> workers;
     for (int i = 0; i < THREAD_POOL_SIZE; ++i) {
@@ -255,8 +506,12 @@ int main() {
     struct epoll_event events[MAX_EVENTS];
 
     while (true) {
-        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        // 有握手进行中时定期醒来, 关闭超时的连接
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, pending.empty() ? -1 : 1000);
         if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             perror("epoll_wait");
             break;
         }
@@ -282,27 +537,62 @@ int main() {
                               << inet_ntoa(client_addr.sin_addr) << ":" 
                               << ntohs(client_addr.sin_port) << std::endl;
 
-                    if (!handle_handshake(client_socket)) {
+                    PendingClient client;
+                    client.addr = client_addr;
+                    client.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(IO_TIMEOUT_MS);
+                    if (ssl_ctx && !(client.tls = tls_create(client_socket))) {
+                        handshakes_failed.inc();
                         close(client_socket);
                         continue;
                     }
 
-                    event.events = EPOLLIN | EPOLLET;
+                    // 握手期间 SSL_accept 可能等待可写, 所以同时关注 EPOLLOUT
+                    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
                     event.data.fd = client_socket;
                     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
                         perror("epoll_ctl: add");
                         close(client_socket);
-                    } else {
+                        continue;
+                    }
+                    pending[client_socket] = std::move(client);
+                }
+            } else if (auto it = pending.find(fd); it != pending.end()) {
+                int ret = advance_handshake(fd, it->second);
+                if (ret == 0) {
+                    continue;
+                }
+                if (ret < 0) {
+                    handshakes_failed.inc();
+                    close(fd);
+                } else {
+                    {
                         std::lock_guard<std::mutex> guard(queue_mutex);
-                        clients[client_socket] = client_addr;
+                        clients[fd] = ClientInfo{it->second.addr, it->second.tls};
+                        clients_open.add(1);
                     }
+                    // 从此由工作线程读取, 已经到达的数据会立即触发一次事件
+                    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+                    event.data.fd = fd;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
                 }
+                pending.erase(it);
             } else {
                 std::lock_guard<std::mutex> guard(queue_mutex);
                 work_queue.push(fd);
                 cv.notify_one();
             }
         }
+
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = pending.begin(); it != pending.end(); ) {
+            if (now < it->second.deadline) {
+                ++it;
+                continue;
+            }
+            handshakes_failed.inc();
+            close(it->first);
+            it = pending.erase(it);
+        }
     }
 
     close(server_socket);